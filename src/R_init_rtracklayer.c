@@ -2,8 +2,12 @@
 #include "readGFF.h"
 #include "bigWig.h"
 #include "bigBed.h"
+#include "bbiHelper.h"
 #include "twoBit.h"
+#include "liftOver.h"
+#include "chainIndex.h"
 #include "utils.h"
+#include "loopbackServer.h"
 
 #include <R_ext/Rdynload.h>
 
@@ -19,24 +23,56 @@ static const R_CallMethodDef callMethods[] = {
   CALLMETHOD_DEF(BWGSectionList_add, 5),
   CALLMETHOD_DEF(BWGSectionList_write, 5),
   CALLMETHOD_DEF(BWGSectionList_cleanup, 1),
-  CALLMETHOD_DEF(BWGFile_query, 5),
+  CALLMETHOD_DEF(BWGFile_query, 6),
   CALLMETHOD_DEF(BWGFile_seqlengths, 1),
   CALLMETHOD_DEF(BWGFile_summary, 6),
   CALLMETHOD_DEF(BWGFile_fromWIG, 4),
-  CALLMETHOD_DEF(R_udcCleanup, 1),
+  CALLMETHOD_DEF(BWGFile_openCursor, 1),
+  CALLMETHOD_DEF(BWGCursor_read, 2),
+  CALLMETHOD_DEF(R_udcCleanup, 2),
   CALLMETHOD_DEF(R_setUserUdcDir, 1),
+  CALLMETHOD_DEF(R_udcFetchParallelism, 1),
+  CALLMETHOD_DEF(R_udcKeepAlive, 1),
+  CALLMETHOD_DEF(R_udcCacheType, 1),
+  CALLMETHOD_DEF(R_udcMemoryCacheBudget, 1),
+  CALLMETHOD_DEF(R_udcDiskCacheBudget, 1),
+  CALLMETHOD_DEF(R_udcAccessPattern, 1),
+  CALLMETHOD_DEF(R_udcReadAheadMax, 1),
+  CALLMETHOD_DEF(R_udcCacheStats, 0),
+  CALLMETHOD_DEF(R_ioStats, 0),
+  CALLMETHOD_DEF(R_resetIoStats, 0),
   /* bigBed.c */
   CALLMETHOD_DEF(BBDFile_fieldnames, 1),
   CALLMETHOD_DEF(BBDFile_seqlengths, 1),
-  CALLMETHOD_DEF(BBDFile_query, 5),
-  CALLMETHOD_DEF(BBDFile_write, 6),
+  CALLMETHOD_DEF(BBDFile_query, 6),
+  CALLMETHOD_DEF(BBDFile_countOverlaps, 5),
+  CALLMETHOD_DEF(BBDFile_write, 7),
+  CALLMETHOD_DEF(BBDFile_openCursor, 1),
+  CALLMETHOD_DEF(BBDCursor_read, 5),
+  /* bbiHelper.c */
+  CALLMETHOD_DEF(BBICursor_close, 1),
   /* twobit.c */
   CALLMETHOD_DEF(DNAString_to_twoBit, 3),
   CALLMETHOD_DEF(TwoBits_write, 2),
+  CALLMETHOD_DEF(TwoBitFile_write, 5),
+  CALLMETHOD_DEF(FastaFile_to_twoBit, 4),
   CALLMETHOD_DEF(TwoBitFile_seqlengths, 1),
-  CALLMETHOD_DEF(TwoBitFile_read, 4),
+  CALLMETHOD_DEF(TwoBitFile_read, 5),
+  CALLMETHOD_DEF(TwoBitFile_to_fasta, 3),
+  CALLMETHOD_DEF(TwoBitFile_composition, 4),
+  /* liftOver.c */
+  CALLMETHOD_DEF(Chain_liftOver, 6),
+  /* chainIndex.c */
+  CALLMETHOD_DEF(Chain_writeIndex, 5),
+  CALLMETHOD_DEF(ChainIndex_header, 1),
+  CALLMETHOD_DEF(ChainIndex_read, 1),
+  CALLMETHOD_DEF(ChainFile_checksum, 1),
   /* utils.c */
   CALLMETHOD_DEF(CharacterList_pasteCollapse, 2),
+  /* loopbackServer.c */
+  CALLMETHOD_DEF(LoopbackServer_start, 3),
+  CALLMETHOD_DEF(LoopbackServer_stats, 1),
+  CALLMETHOD_DEF(LoopbackServer_stop, 0),
   {NULL, NULL, 0}
 };
 
@@ -1,7 +1,9 @@
 #include "ucsc/common.h"
 #include "ucsc/bbiFile.h"
+#include "ucsc/udc.h"
 
 #include "bbiHelper.h"
+#include "handlers.h"
 
 SEXP bbiSeqLengths(struct bbiFile *file) {
   struct bbiChromInfo *chromList = bbiChromList(file);
@@ -21,3 +23,98 @@ SEXP bbiSeqLengths(struct bbiFile *file) {
   UNPROTECT(1);
   return seqlengths;
 }
+
+/* Takes ownership of 'bbi'; it is closed by bbiCursorFree(). */
+struct bbiCursor *bbiCursorNew(struct bbiFile *bbi) {
+  struct bbiCursor *cursor;
+  AllocVar(cursor);
+  cursor->bbi = bbi;
+  bbiAttachUnzoomedCir(bbi);
+  cursor->blockList = cirTreeEnumerateBlocks(bbi->unzoomedCir);
+  cursor->block = cursor->blockList;
+  /* blocks are visited in file order, so remote reads can run ahead */
+  udcSetAccessPattern(bbi->udc, udcAccessSequential);
+  if (bbi->uncompressBufSize > 0)
+    cursor->uncompressBuf = needLargeMem(bbi->uncompressBufSize);
+
+  /* chromosome names by id, so records can be labeled without lookups */
+  struct bbiChromInfo *chrom, *chromList = bbiChromList(bbi);
+  for (chrom = chromList; chrom != NULL; chrom = chrom->next)
+    cursor->chromCount = max(cursor->chromCount, chrom->id + 1);
+  AllocArray(cursor->chromNames, cursor->chromCount);
+  for (chrom = chromList; chrom != NULL; chrom = chrom->next)
+    cursor->chromNames[chrom->id] = cloneString(chrom->name);
+  bbiChromInfoFreeList(&chromList);
+  return cursor;
+}
+
+/* Returns the name of chromosome 'chromId', taken from a data record, so
+ * checked against the chromosome list of the file. */
+char *bbiCursorChromName(struct bbiCursor *cursor, bits32 chromId) {
+  if (chromId >= (bits32) cursor->chromCount ||
+      cursor->chromNames[chromId] == NULL)
+    errAbort("record with unknown chromosome id %u in %s", chromId,
+             cursor->bbi->fileName);
+  return cursor->chromNames[chromId];
+}
+
+/* Loads the next block, setting blockPt/blockEnd. Returns FALSE when the
+ * blocks are exhausted. */
+boolean bbiCursorNextBlock(struct bbiCursor *cursor) {
+  struct fileOffsetSize *block = cursor->block;
+  if (block == NULL)
+    return FALSE;
+  freez(&cursor->blockBuf);
+  udcSeek(cursor->bbi->udc, block->offset);
+  char *data = udcReadOrMap(cursor->bbi->udc, block->size,
+                            (void **)&cursor->blockBuf);
+  cursor->blockPt = bbiBlockData(cursor->bbi, data, block->size,
+                                 cursor->uncompressBuf, &cursor->blockEnd);
+  cursor->block = block->next;
+  return TRUE;
+}
+
+void bbiCursorFree(struct bbiCursor **pCursor) {
+  struct bbiCursor *cursor = *pCursor;
+  if (cursor == NULL)
+    return;
+  for (int i = 0; i < cursor->chromCount; ++i)
+    freeMem(cursor->chromNames[i]);
+  freeMem(cursor->chromNames);
+  freeMem(cursor->blockBuf);
+  freeMem(cursor->uncompressBuf);
+  slFreeList(&cursor->blockList);
+  bbiFileClose(&cursor->bbi);
+  freez(pCursor);
+}
+
+static void bbiCursorFinalizer(SEXP r_cursor) {
+  struct bbiCursor *cursor = R_ExternalPtrAddr(r_cursor);
+  bbiCursorFree(&cursor);
+  R_ClearExternalPtr(r_cursor);
+}
+
+SEXP bbiCursorToExternalPtr(struct bbiCursor *cursor) {
+  SEXP ans = PROTECT(R_MakeExternalPtr(cursor, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ans, bbiCursorFinalizer, TRUE);
+  UNPROTECT(1);
+  return ans;
+}
+
+struct bbiCursor *bbiCursorFromExternalPtr(SEXP r_cursor) {
+  struct bbiCursor *cursor = NULL;
+  if (TYPEOF(r_cursor) == EXTPTRSXP)
+    cursor = R_ExternalPtrAddr(r_cursor);
+  if (cursor == NULL)
+    error("the file is not open");
+  return cursor;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP BBICursor_close(SEXP r_cursor) {
+  pushRHandlers();
+  if (TYPEOF(r_cursor) == EXTPTRSXP)
+    bbiCursorFinalizer(r_cursor);
+  popRHandlers();
+  return R_NilValue;
+}
@@ -3,9 +3,40 @@
 
 #include "ucsc/common.h"
 #include "ucsc/bbiFile.h"
+#include "ucsc/bwgInternal.h"
 
 #include "rtracklayer.h"
 
 SEXP bbiSeqLengths(struct bbiFile *file);
 
+struct bbiCursor
+/* A position in the unzoomed data of an open bbiFile. Blocks are visited
+ * in file order, one at a time, so memory use is bounded by block size. */
+{
+  struct bbiFile *bbi;
+  struct fileOffsetSize *blockList; /* All unzoomed blocks, in file order */
+  struct fileOffsetSize *block;     /* Next block to load */
+  char *blockBuf;                   /* Copy of the raw block, NULL when
+                                       it is read from a file mapping */
+  char *uncompressBuf;              /* NULL if file is uncompressed */
+  char *blockPt, *blockEnd;         /* Unread part of the current block */
+  char **chromNames;                /* Indexed by chromId */
+  int chromCount;
+  /* bigWig only: each block holds one section */
+  struct bwgSectionHead section;    /* Header of the current block */
+  bits32 fixedStart;                /* Start of the next fixedStep item */
+};
+
+struct bbiCursor *bbiCursorNew(struct bbiFile *bbi);
+char *bbiCursorChromName(struct bbiCursor *cursor, bits32 chromId);
+boolean bbiCursorNextBlock(struct bbiCursor *cursor);
+void bbiCursorFree(struct bbiCursor **pCursor);
+
+SEXP bbiCursorToExternalPtr(struct bbiCursor *cursor);
+struct bbiCursor *bbiCursorFromExternalPtr(SEXP r_cursor);
+
+/* The .Call entry points */
+
+SEXP BBICursor_close(SEXP r_cursor);
+
 #endif
@@ -3,11 +3,13 @@
 #include "ucsc/bigBed.h"
 #include "ucsc/linefile.h"
 #include "ucsc/localmem.h"
+#include "ucsc/udc.h"
 
 #include "bigBed.h"
 #include "handlers.h"
 #include "bbiHelper.h"
 #include "bigBedHelper.h"
+#include "utils.h"
 
 /* --- .Call ENTRY POINT --- */
 SEXP BBDFile_seqlengths(SEXP r_filename)
@@ -60,47 +62,18 @@ SEXP BBDFile_fieldnames(SEXP r_filename)
   return list;
 }
 
-/* --- .Call ENTRY POINT --- */
-SEXP BBDFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
-                   SEXP r_defaultindex, SEXP r_extraindex)
+/* Decodes the records in 'hits' into the list of columns returned to R.
+ * The first element is left for the caller to fill in. */
+static SEXP bigBedIntervalsToColumns(struct bigBedInterval *hits, int n_hits,
+                                     struct asObject *as, int fieldCount,
+                                     SEXP r_defaultindex, SEXP r_extraindex)
 {
-  pushRHandlers();
-  struct bbiFile *file = bigBedFileOpen((char *)CHAR(asChar(r_filename)));
-  struct lm *lm = lmInit(0);
-  int n_ranges = get_IRanges_length(r_ranges);
-  int *start = INTEGER(get_IRanges_start(r_ranges));
-  int *width = INTEGER(get_IRanges_width(r_ranges));
-
-  SEXP ans, n_qhits, ranges, chromStart, chromWidth, name, score,
+  SEXP ans, ranges, chromStart, chromWidth, name, score,
     strand = R_NilValue, thickStart, thickWidth, itemRgb, blocks,
-    extraFields = R_NilValue, lengthIndex;
-
-  n_qhits = PROTECT(allocVector(INTSXP, n_ranges));
-  struct bigBedInterval *hits = NULL, *tail = NULL;
-  /* querying records in range */
-  for (int i = 0; i < n_ranges; ++i) {
-    struct bigBedInterval *queryHits =
-      bigBedIntervalQuery(file, (char *)CHAR(STRING_ELT(r_seqnames, i)),
-                          start[i] - 1, start[i] - 1 + width[i], 0, lm);
-    if (!hits) {
-      hits = queryHits;
-      tail = slLastEl(hits);
-    } else {
-      tail->next = queryHits;
-      tail = slLastEl(tail);
-    }
-    INTEGER(n_qhits)[i] = slCount(queryHits);
-  }
-
-  /* need these before closing file */
-  char *asText = bigBedAutoSqlText(file);
-  struct asObject *as = asParseText(asText);
-  freeMem(asText);
-  int fieldCount = file->fieldCount;
+    blocksEnd = R_NilValue, extraFields = R_NilValue, lengthIndex;
+  IntPairAE *blocksBuf = NULL;
   int definedFieldCount = getDefinedFieldCount(as);
   int extraFieldCount = fieldCount - definedFieldCount;
-  int n_hits = slCount(hits);
-  bigBedFileClose(&file);
 
   int presentFieldCount = 0, unprotectCount = 0;
   /* mandatory default field */
@@ -132,8 +105,11 @@ SEXP BBDFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
     ++presentFieldCount;
     ++unprotectCount;
   }
+  /* blocks of all records go into one flat start/width buffer,
+   * partitioned by record at the end (a CompressedIRangesList) */
   if (isPresent(definedFieldCount, i_blocks) && isSelected(r_defaultindex, 5)) {
-      blocks = PROTECT(allocVector(VECSXP, n_hits));
+      blocksEnd = PROTECT(allocVector(INTSXP, n_hits));
+      blocksBuf = new_IntPairAE(n_hits, 0);
       ++presentFieldCount;
       ++unprotectCount;
   }
@@ -175,17 +151,10 @@ SEXP BBDFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
     memset(INTEGER(lengthIndex), 0, sizeof(int) * extraFieldCount);
     unprotectCount += 2;
   }
-  asObjectFree(&as);
-
-  int count = 0, k = 0;
   char startBuf[16], endBuf[16], *row[fieldCount], rgbBuf[8];
-  for (int i = 0; i < n_hits; ++i, hits = hits->next, ++count) {
-    if (INTEGER(n_qhits)[k] == count && k < n_ranges) {
-      ++k;
-      count = 0;
-    }
-    bigBedIntervalToRow(hits, (char *)CHAR(STRING_ELT(r_seqnames, k)),
-                        startBuf, endBuf, row, fieldCount);
+  for (int i = 0; i < n_hits; ++i, hits = hits->next) {
+    /* the chrom is not decoded, only the fields after it */
+    bigBedIntervalToRow(hits, "", startBuf, endBuf, row, fieldCount);
     struct bed *bed = bedLoadN(row, definedFieldCount);
     /* mandatory default field */
     INTEGER(chromStart)[i] = bed->chromStart;
@@ -209,14 +178,10 @@ SEXP BBDFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
       SET_STRING_ELT(itemRgb, i, mkChar(rgbBuf));
     }
     if (isPresent(definedFieldCount, i_blocks) && isSelected(r_defaultindex, 5)) {
-      SEXP bstart = PROTECT(allocVector(INTSXP, bed->blockCount));
-      SEXP bwidth = PROTECT(allocVector(INTSXP, bed->blockCount));
-      for (int j = 0; j< bed->blockCount; ++j) {
-        INTEGER(bwidth)[j] = bed->blockSizes[j];
-        INTEGER(bstart)[j] = bed->chromStarts[j];
-      }
-      SET_VECTOR_ELT(blocks, i, new_IRanges("IRanges", bstart, bwidth, R_NilValue));
-      UNPROTECT(2);
+      for (int j = 0; j < bed->blockCount; ++j)
+        IntPairAE_insert_at(blocksBuf, IntPairAE_get_nelt(blocksBuf),
+                            bed->chromStarts[j], bed->blockSizes[j]);
+      INTEGER(blocksEnd)[i] = IntPairAE_get_nelt(blocksBuf);
     }
     bedFree(&bed);
 
@@ -246,10 +211,19 @@ SEXP BBDFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
     freeMem(row[3]);
   }
 
+  if (isPresent(definedFieldCount, i_blocks) && isSelected(r_defaultindex, 5)) {
+    SEXP blocksRanges = PROTECT(new_IRanges_from_IntPairAE("IRanges", blocksBuf));
+    SEXP blocksPart = PROTECT(new_PartitioningByEnd("PartitioningByEnd", blocksEnd,
+                                                    R_NilValue));
+    blocks = PROTECT(new_CompressedList("CompressedIRangesList", blocksRanges,
+                                        blocksPart));
+    unprotectCount += 3;
+  }
+
   ranges = PROTECT(new_IRanges("IRanges", chromStart, chromWidth, R_NilValue));
   ans = PROTECT(allocVector(VECSXP, presentFieldCount + 4));
   int index = 0;
-  SET_VECTOR_ELT(ans, index++, n_qhits);
+  SET_VECTOR_ELT(ans, index++, R_NilValue);
   SET_VECTOR_ELT(ans, index++, extraFields);
   SET_VECTOR_ELT(ans, index++, ranges);
   SET_VECTOR_ELT(ans, index++, strand);
@@ -269,7 +243,352 @@ SEXP BBDFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
   if (isPresent(definedFieldCount, i_blocks) && isSelected(r_defaultindex, 5)) {
     SET_VECTOR_ELT(ans, index++, blocks);
   }
-  UNPROTECT(5 + unprotectCount);
+  UNPROTECT(4 + unprotectCount);
+  return ans;
+}
+
+/* A record filter is a list of clauses that must all hold. Each clause is
+ * list(column, op, values), 'column' indexing the bed row (1 and 2 being
+ * the 1-based start and the end) and 'values' numeric or character. */
+
+enum bbFilterOp { op_eq, op_ne, op_lt, op_le, op_gt, op_ge, op_in };
+
+struct bbFilterClause
+{
+  int column;
+  enum bbFilterOp op;
+  int nValues;
+  double *numbers;  /* NULL if comparing strings */
+  SEXP strings;
+};
+
+static struct bbFilterClause *bbFilterFromR(SEXP r_filter)
+{
+  static const char *ops[] = {"==", "!=", "<", "<=", ">", ">=", "%in%"};
+  int nClauses = length(r_filter);
+  struct bbFilterClause *clauses =
+    (struct bbFilterClause *)R_alloc(nClauses, sizeof(struct bbFilterClause));
+  for (int i = 0; i < nClauses; ++i) {
+    SEXP r_clause = VECTOR_ELT(r_filter, i);
+    struct bbFilterClause *clause = clauses + i;
+    clause->column = asInteger(VECTOR_ELT(r_clause, 0));
+    const char *op = CHAR(asChar(VECTOR_ELT(r_clause, 1)));
+    clause->op = -1;
+    for (int j = 0; j < (int)ArraySize(ops); ++j)
+      if (strcmp(op, ops[j]) == 0)
+        clause->op = j;
+    if (clause->op == -1)
+      error("unsupported filter operator '%s'", op);
+    SEXP values = VECTOR_ELT(r_clause, 2);
+    clause->nValues = length(values);
+    clause->numbers = isString(values) ? NULL : REAL(values);
+    clause->strings = values;
+  }
+  return clauses;
+}
+
+/* Points 'pField' at bed column 'column' (3 or more) in the
+ * tab-separated 'rest' of a record and returns its length, or -1 if
+ * the record has no such column. */
+static int bigBedRestField(char *rest, int column, char **pField)
+{
+  char *pt = rest, *end;
+  if (pt == NULL)
+    return -1;
+  for (int i = 3; i < column; ++i) {
+    if ((pt = strchr(pt, '\t')) == NULL)
+      return -1;
+    ++pt;
+  }
+  *pField = pt;
+  end = strchr(pt, '\t');
+  return end ? end - pt : strlen(pt);
+}
+
+static int compareField(char *field, int len, const char *value)
+{
+  int cmp = strncmp(field, value, len);
+  if (cmp == 0 && value[len] != '\0')
+    cmp = -1;
+  return cmp;
+}
+
+static boolean bbFilterClauseHolds(struct bbFilterClause *clause,
+                                   struct bigBedInterval *bi)
+{
+  char *field = NULL;
+  int len = 0, cmp = 0;
+  double x = 0;
+  if (clause->column == 1)
+    x = bi->start + 1;
+  else if (clause->column == 2)
+    x = bi->end;
+  else {
+    len = bigBedRestField(bi->rest, clause->column, &field);
+    if (len < 0)
+      return FALSE;
+    if (clause->numbers)
+      x = strtod(field, NULL);
+  }
+  if (clause->op == op_in) {
+    for (int i = 0; i < clause->nValues; ++i) {
+      if (clause->numbers ? x == clause->numbers[i] :
+          compareField(field, len,
+                       CHAR(STRING_ELT(clause->strings, i))) == 0)
+        return TRUE;
+    }
+    return FALSE;
+  }
+  if (clause->numbers)
+    cmp = x < clause->numbers[0] ? -1 : x > clause->numbers[0];
+  else if (field == NULL)
+    return FALSE;
+  else cmp = compareField(field, len, CHAR(STRING_ELT(clause->strings, 0)));
+  switch (clause->op) {
+  case op_eq: return cmp == 0;
+  case op_ne: return cmp != 0;
+  case op_lt: return cmp < 0;
+  case op_le: return cmp <= 0;
+  case op_gt: return cmp > 0;
+  case op_ge: return cmp >= 0;
+  default: return FALSE;
+  }
+}
+
+static boolean bbFilterHolds(struct bbFilterClause *clauses, int nClauses,
+                             struct bigBedInterval *bi)
+{
+  for (int i = 0; i < nClauses; ++i)
+    if (!bbFilterClauseHolds(clauses + i, bi))
+      return FALSE;
+  return TRUE;
+}
+
+/* Drops the records failing the filter, straight from the raw bytes, so
+ * no R objects are made for them. */
+static struct bigBedInterval *bbFilterIntervals(struct bbFilterClause *clauses,
+                                                int nClauses,
+                                                struct bigBedInterval *list)
+{
+  struct bigBedInterval *bi, *next, *kept = NULL;
+  if (nClauses == 0)
+    return list;
+  for (bi = list; bi != NULL; bi = next) {
+    next = bi->next;
+    if (bbFilterHolds(clauses, nClauses, bi))
+      slAddHead(&kept, bi);
+  }
+  slReverse(&kept);
+  return kept;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP BBDFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
+                   SEXP r_defaultindex, SEXP r_extraindex, SEXP r_filter)
+{
+  int nClauses = length(r_filter);
+  struct bbFilterClause *clauses = bbFilterFromR(r_filter);
+  pushRHandlers();
+  struct bbiFile *file = bigBedFileOpen((char *)CHAR(asChar(r_filename)));
+  struct lm *lm = lmInit(0);
+  int n_ranges = get_IRanges_length(r_ranges);
+  int *start = INTEGER(get_IRanges_start(r_ranges));
+  int *width = INTEGER(get_IRanges_width(r_ranges));
+
+  SEXP ans, n_qhits;
+
+  n_qhits = PROTECT(allocVector(INTSXP, n_ranges));
+  struct bigBedInterval *hits = NULL, *tail = NULL;
+  /* querying records in range */
+  for (int i = 0; i < n_ranges; ++i) {
+    struct bigBedInterval *queryHits =
+      bigBedIntervalQuery(file, (char *)CHAR(STRING_ELT(r_seqnames, i)),
+                          start[i] - 1, start[i] - 1 + width[i], 0, lm);
+    queryHits = bbFilterIntervals(clauses, nClauses, queryHits);
+    if (!hits) {
+      hits = queryHits;
+      tail = slLastEl(hits);
+    } else {
+      tail->next = queryHits;
+      tail = slLastEl(tail);
+    }
+    INTEGER(n_qhits)[i] = slCount(queryHits);
+  }
+
+  /* need these before closing file */
+  char *asText = bigBedAutoSqlText(file);
+  struct asObject *as = asParseText(asText);
+  freeMem(asText);
+  int fieldCount = file->fieldCount;
+  int n_hits = slCount(hits);
+  bigBedFileClose(&file);
+
+  ans = PROTECT(bigBedIntervalsToColumns(hits, n_hits, as, fieldCount,
+                                         r_defaultindex, r_extraindex));
+  SET_VECTOR_ELT(ans, 0, n_qhits);
+  asObjectFree(&as);
+  UNPROTECT(2);
+  lmCleanup(&lm);
+  popRHandlers();
+  return ans;
+}
+
+/* Counts the records overlapping [start, end) by at least 'minOverlap'
+ * bases, looking only at the (chromId, start, end) prefix of each record.
+ * With 'anyOnly', stops at the first one. */
+static int bigBedCountOverlaps(struct bbiFile *bbi, char *chrom,
+                               bits32 start, bits32 end, int minOverlap,
+                               boolean anyOnly)
+{
+  int count = 0;
+  bbiAttachUnzoomedCir(bbi);
+  /* padded like bigBedIntervalQuery(), to catch zero-length insertions */
+  bits32 paddedStart = (start > 0) ? start - 1 : start;
+  bits32 chromId;
+  struct fileOffsetSize *blockList =
+    bbiOverlappingBlocks(bbi, bbi->unzoomedCir, chrom, paddedStart, end + 1,
+                         &chromId);
+  struct fileOffsetSize *block, *beforeGap, *afterGap;
+  boolean isSwapped = bbi->isSwapped;
+  if (!anyOnly) /* anyOnly usually stops after the first block */
+    udcPrefetch(bbi->udc, blockList);
+  char *uncompressBuf = bbiUncompressBuf(bbi);
+
+  for (block = blockList; block != NULL && !(anyOnly && count > 0); ) {
+    /* read runs of contiguous blocks at once */
+    fileOffsetSizeFindGap(block, &beforeGap, &afterGap);
+    bits64 mergedOffset = block->offset;
+    bits64 mergedSize = beforeGap->offset + beforeGap->size - mergedOffset;
+    void *mergedBuf;
+    udcSeek(bbi->udc, mergedOffset);
+    char *blockBuf = udcReadOrMap(bbi->udc, mergedSize, &mergedBuf);
+    for (; block != afterGap; block = block->next) {
+      char *blockEnd;
+      char *blockPt = bbiBlockData(bbi, blockBuf, block->size, uncompressBuf,
+                                   &blockEnd);
+      while (blockPt < blockEnd) {
+        bits32 chr = memReadBits32(&blockPt, isSwapped);
+        bits32 s = memReadBits32(&blockPt, isSwapped);
+        bits32 e = memReadBits32(&blockPt, isSwapped);
+        blockPt += strlen(blockPt) + 1;
+        if (chr != chromId)
+          continue;
+        if (minOverlap > 1) {
+          if (rangeIntersection(s, e, start, end) >= minOverlap)
+            ++count;
+        } else if ((s < end && e > start) ||
+                   (s == e && (s == end || e == start))) {
+          ++count;
+        }
+      }
+      blockBuf += block->size;
+    }
+    freeMem(mergedBuf);
+  }
+  slFreeList(&blockList);
+  return count;
+}
+
+/* --- .Call ENTRY POINT --- */
+/* Per-range counts of overlapping records (or whether there are any, if
+ * 'r_any'), without decoding the records. */
+SEXP BBDFile_countOverlaps(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
+                           SEXP r_minoverlap, SEXP r_any)
+{
+  int n_ranges = get_IRanges_length(r_ranges);
+  int *start = INTEGER(get_IRanges_start(r_ranges));
+  int *width = INTEGER(get_IRanges_width(r_ranges));
+  int minOverlap = asInteger(r_minoverlap);
+  Rboolean anyOnly = asLogical(r_any);
+  SEXP ans = PROTECT(allocVector(anyOnly ? LGLSXP : INTSXP, n_ranges));
+  pushRHandlers();
+  struct bbiFile *file = bigBedFileOpen((char *)CHAR(asChar(r_filename)));
+  for (int i = 0; i < n_ranges; ++i) {
+    int count = bigBedCountOverlaps(file,
+                                    (char *)CHAR(STRING_ELT(r_seqnames, i)),
+                                    start[i] - 1, start[i] - 1 + width[i],
+                                    minOverlap, anyOnly);
+    if (anyOnly)
+      LOGICAL(ans)[i] = count > 0;
+    else INTEGER(ans)[i] = count;
+  }
+  bigBedFileClose(&file);
+  popRHandlers();
+  UNPROTECT(1);
+  return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP BBDFile_openCursor(SEXP r_filename)
+{
+  pushRHandlers();
+  struct bbiFile *file = bigBedFileOpen((char *)CHAR(asChar(r_filename)));
+  SEXP ans = bbiCursorToExternalPtr(bbiCursorNew(file));
+  popRHandlers();
+  return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+/* Reads the next 'r_n' records (all remaining if NA) in file order. The
+ * first element of the result holds the seqnames of the records. Returns
+ * NULL once the cursor is exhausted. */
+SEXP BBDCursor_read(SEXP r_cursor, SEXP r_n, SEXP r_defaultindex,
+                    SEXP r_extraindex, SEXP r_filter)
+{
+  int nClauses = length(r_filter);
+  struct bbFilterClause *clauses = bbFilterFromR(r_filter);
+  struct bbiCursor *cursor = bbiCursorFromExternalPtr(r_cursor);
+  pushRHandlers();
+  struct bbiFile *file = cursor->bbi;
+  boolean isSwapped = file->isSwapped;
+  int n = asInteger(r_n);
+  struct lm *lm = lmInit(0);
+  struct bigBedInterval *hits = NULL, *el;
+  int n_hits = 0;
+
+  while (n == NA_INTEGER || n_hits < n) {
+    if (cursor->blockPt >= cursor->blockEnd && !bbiCursorNextBlock(cursor))
+      break;
+    /* filter the record in place, and copy only those kept */
+    struct bigBedInterval raw;
+    memset(&raw, 0, sizeof(raw));
+    raw.chromId = memReadBits32(&cursor->blockPt, isSwapped);
+    raw.start = memReadBits32(&cursor->blockPt, isSwapped);
+    raw.end = memReadBits32(&cursor->blockPt, isSwapped);
+    int restLen = strlen(cursor->blockPt);
+    if (restLen > 0)
+      raw.rest = cursor->blockPt;
+    cursor->blockPt += restLen + 1;
+    if (!bbFilterHolds(clauses, nClauses, &raw))
+      continue;
+    el = lmCloneVar(lm, &raw);
+    if (restLen > 0)
+      el->rest = lmCloneStringZ(lm, raw.rest, restLen);
+    slAddHead(&hits, el);
+    ++n_hits;
+  }
+  slReverse(&hits);
+
+  if (n_hits == 0) {
+    lmCleanup(&lm);
+    popRHandlers();
+    return R_NilValue;
+  }
+
+  SEXP ans, seqnames = PROTECT(allocVector(STRSXP, n_hits));
+  int i = 0;
+  for (el = hits; el != NULL; el = el->next, ++i)
+    SET_STRING_ELT(seqnames, i,
+                   mkChar(bbiCursorChromName(cursor, el->chromId)));
+
+  char *asText = bigBedAutoSqlText(file);
+  struct asObject *as = asParseText(asText);
+  freeMem(asText);
+  ans = PROTECT(bigBedIntervalsToColumns(hits, n_hits, as, file->fieldCount,
+                                         r_defaultindex, r_extraindex));
+  SET_VECTOR_ELT(ans, 0, seqnames);
+  asObjectFree(&as);
+  UNPROTECT(2);
   lmCleanup(&lm);
   popRHandlers();
   return ans;
@@ -285,7 +604,8 @@ static struct hash *createIntHash(SEXP v) {
 
 /* --- .Call ENTRY POINT --- */
 SEXP BBDFile_write(SEXP r_seqlengths, SEXP r_bedString, SEXP r_autosql,
-                   SEXP r_indexfields, SEXP r_compress, SEXP r_outfile)
+                   SEXP r_indexfields, SEXP r_compress, SEXP r_threads,
+                   SEXP r_outfile)
 {
   pushRHandlers();
   int blockSize = 256;
@@ -304,6 +624,11 @@ SEXP BBDFile_write(SEXP r_seqlengths, SEXP r_bedString, SEXP r_autosql,
   bits16 extraIndexCount = slCount(extraIndexList);
   if (extraIndexList != NULL)
     eim = bbExIndexMakerNew(extraIndexList, as);
+  /* by default, one thread per extra index */
+  int threads = asInteger(r_threads);
+  if (threads == NA_INTEGER)
+    threads = extraIndexCount;
+  threads = clampThreads(threads);
 
   /* Do first pass, mostly just scanning file and counting hits per chromosome. */
   int minDiff = 0;
@@ -394,14 +719,14 @@ SEXP BBDFile_write(SEXP r_seqlengths, SEXP r_bedString, SEXP r_autosql,
                                     zoomIndexOffsets, &totalSum);
   }
 
-  /* Write out extra indexes if need be. */
+  /* Write out extra indexes if need be. The sorting, which dominates,
+   * runs on several threads; the B+ trees are then written in turn. */
   if (eim) {
     int i;
+    bbExIndexMakerSortChunkArrays(eim, threads);
     for (i=0; i < eim->indexCount; ++i) {
       eim->fileOffsets[i] = ftell(f);
       maxBedNameSize = eim->maxFieldSize[i];
-      qsort(eim->chunkArrayArray[i], bedCount,
-            sizeof(struct bbNamedFileChunk), bbNamedFileChunkCmpByName);
       assert(sizeof(struct bbNamedFileChunk) == sizeof(eim->chunkArrayArray[i][0]));
       bptFileBulkIndexToOpenFile(eim->chunkArrayArray[i], sizeof(eim->chunkArrayArray[i][0]),
                                  bedCount, blockSize, bbNamedFileChunkKey, maxBedNameSize,
@@ -8,8 +8,14 @@
 SEXP BBDFile_seqlengths(SEXP r_filename);
 SEXP BBDFile_fieldnames(SEXP r_filename);
 SEXP BBDFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
-                   SEXP r_defaultindex, SEXP r_extraindex);
+                   SEXP r_defaultindex, SEXP r_extraindex, SEXP r_filter);
+SEXP BBDFile_countOverlaps(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
+                           SEXP r_minoverlap, SEXP r_any);
+SEXP BBDFile_openCursor(SEXP r_filename);
+SEXP BBDCursor_read(SEXP r_cursor, SEXP r_n, SEXP r_defaultindex,
+                    SEXP r_extraindex, SEXP r_filter);
 SEXP BBDFile_write(SEXP r_seqlengths, SEXP r_bedString, SEXP r_autosql,
-                   SEXP r_indexfields, SEXP r_compress, SEXP r_outfile);
+                   SEXP r_indexfields, SEXP r_compress, SEXP r_threads,
+                   SEXP r_outfile);
 
 #endif
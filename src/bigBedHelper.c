@@ -1,4 +1,8 @@
 #include "bigBedHelper.h"
+#include "utils.h"
+
+/* Key size of the extra index being written, for bbNamedFileChunkKey() */
+int maxBedNameSize;
 
 /*
   Most of the functions in this file are taken from ucscGenomeBrowser/kent/src/utils/bedToBigBed.c
@@ -130,6 +134,111 @@ struct bbExIndexMaker *bbExIndexMakerNew(struct slName *extraIndexList, struct a
   return eim;
 }
 
+/* Sorting of the extra index chunk arrays. The indexes are sorted
+ * concurrently, one thread each. An index given several threads is cut
+ * into slices that are sorted in parallel, then merged pairwise, each
+ * round of merges also in parallel. Nothing here may errAbort. */
+
+struct chunkSortJob
+{
+  struct bbNamedFileChunk *chunks;
+  struct bbNamedFileChunk *tmp;  /* Merge buffer, NULL to sort serially */
+  bits64 count;
+  int threads;
+};
+
+struct chunkMergeJob
+{
+  struct bbNamedFileChunk *src, *dst;
+  bits64 start, mid, end;        /* Merges [start, mid) and [mid, end) */
+};
+
+/* Below this many chunks, a single qsort() beats the thread overhead */
+#define MIN_PARALLEL_SORT 65536
+
+static void *chunkQsort(void *arg)
+{
+  struct chunkSortJob *job = arg;
+  qsort(job->chunks, job->count, sizeof(struct bbNamedFileChunk),
+        bbNamedFileChunkCmpByName);
+  return NULL;
+}
+
+static void *chunkMerge(void *arg)
+{
+  struct chunkMergeJob *job = arg;
+  struct bbNamedFileChunk *src = job->src, *dst = job->dst;
+  bits64 i = job->start, j = job->mid, k = job->start;
+  while (i < job->mid && j < job->end) {
+    /* take from the left on ties; the slices come from qsort(), so equal
+       names may still end up in any order */
+    if (bbNamedFileChunkCmpByName(src + j, src + i) < 0)
+      dst[k++] = src[j++];
+    else dst[k++] = src[i++];
+  }
+  while (i < job->mid)
+    dst[k++] = src[i++];
+  while (j < job->end)
+    dst[k++] = src[j++];
+  return NULL;
+}
+
+static void *chunkSort(void *arg)
+{
+  struct chunkSortJob *job = arg;
+  int n = job->threads;
+  if (n <= 1 || job->tmp == NULL)
+    return chunkQsort(job);
+
+  bits64 bounds[n + 1];
+  struct chunkSortJob slices[n];
+  for (int i = 0; i <= n; ++i)
+    bounds[i] = job->count * i / n;
+  for (int i = 0; i < n; ++i) {
+    slices[i].chunks = job->chunks + bounds[i];
+    slices[i].count = bounds[i + 1] - bounds[i];
+  }
+  runJobs(chunkQsort, slices, sizeof(slices[0]), n);
+
+  struct bbNamedFileChunk *src = job->chunks, *dst = job->tmp, *swap;
+  struct chunkMergeJob merges[n];
+  for (int width = 1; width < n; width *= 2) {
+    int m = 0;
+    for (int i = 0; i < n; i += 2 * width, ++m) {
+      merges[m].src = src;
+      merges[m].dst = dst;
+      merges[m].start = bounds[i];
+      merges[m].mid = bounds[min(i + width, n)];
+      merges[m].end = bounds[min(i + 2 * width, n)];
+    }
+    runJobs(chunkMerge, merges, sizeof(merges[0]), m);
+    swap = src; src = dst; dst = swap;
+  }
+  if (src != job->chunks)
+    memcpy(job->chunks, src, job->count * sizeof(struct bbNamedFileChunk));
+  return NULL;
+}
+
+/* Sorts the chunk arrays of all extra indexes by name, spreading about
+ * 'threads' threads over the indexes. */
+void bbExIndexMakerSortChunkArrays(struct bbExIndexMaker *eim, int threads)
+{
+  int n = eim->indexCount;
+  struct chunkSortJob jobs[n];
+  for (int i = 0; i < n; ++i) {
+    jobs[i].chunks = eim->chunkArrayArray[i];
+    jobs[i].count = eim->recordCount;
+    jobs[i].threads = max(1, threads / n);
+    jobs[i].tmp = NULL;
+    /* allocated here, as the sorting threads must not errAbort */
+    if (jobs[i].threads > 1 && jobs[i].count >= MIN_PARALLEL_SORT)
+      jobs[i].tmp = needHugeMem(jobs[i].count * sizeof(struct bbNamedFileChunk));
+  }
+  runJobs(chunkSort, jobs, sizeof(jobs[0]), n);
+  for (int i = 0; i < n; ++i)
+    freeMem(jobs[i].tmp);
+}
+
 /* Compare two named offset object to facilitate qsorting by name. */
 int bbNamedFileChunkCmpByName(const void *va, const void *vb) {
   const struct bbNamedFileChunk *a = va, *b = vb;
@@ -14,7 +14,7 @@
 
 #include "rtracklayer.h"
 
-static int maxBedNameSize;
+extern int maxBedNameSize;
 
 enum IFields
 {
@@ -35,6 +35,7 @@ void bbNamedFileChunkKey(const void *va, char *keyBuf);
 int bbNamedFileChunkCmpByName(const void *va, const void *vb);
 struct rbTree *rangeTreeForBedChrom(struct lineFile *lf, char *chrom);
 void bbExIndexMakerAllocChunkArrays(struct bbExIndexMaker *eim, int recordCount);
+void bbExIndexMakerSortChunkArrays(struct bbExIndexMaker *eim, int threads);
 void bbExIndexMakerAddKeysFromRow(struct bbExIndexMaker *eim, char **row, int recordIx);
 struct bbExIndexMaker *bbExIndexMakerNew(struct slName *extraIndexList, struct asObject *as);
 void bbExIndexMakerAddOffsetSize(struct bbExIndexMaker *eim, bits64 offset, bits64 size,
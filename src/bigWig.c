@@ -5,10 +5,12 @@
 #include "ucsc/bbiFile.h"
 #include "ucsc/bigWig.h"
 #include "ucsc/bwgInternal.h"
+#include "ucsc/errCatch.h"
 
 #include "bigWig.h"
 #include "bbiHelper.h"
 #include "handlers.h"
+#include "utils.h"
 
 static struct bwgBedGraphItem *
 createBedGraphItems(int *start, int *width, double *score, int len,
@@ -222,72 +224,130 @@ SEXP BWGFile_seqlengths(SEXP r_filename) {
   return seqlengths;
 }
 
+/* Queries of BWGFile_query, split over threads. Each job has its own
+ * handle on the file and its own memory, and takes a stretch of ranges,
+ * so ranges near each other, which often share blocks, are read by the
+ * same handle. Errors are caught on the job's thread and reported by the
+ * calling thread, as the R handlers must not run on the others. */
+struct bwgQueryJob
+{
+  struct bbiFile *file;
+  struct lm *lm;
+  char **seqnames;
+  int *start, *width;
+  int first, end;                /* Ranges [first, end) */
+  struct bbiInterval **hits;     /* Hits of each range, shared by the jobs */
+  char *error;                   /* Message of error caught, or NULL */
+};
+
+static void *bwgQueryRanges(void *arg)
+{
+  struct bwgQueryJob *job = arg;
+  struct errCatch *errCatch = errCatchNew();
+  if (errCatchStart(errCatch)) {
+    for (int i = job->first; i < job->end; i++)
+      job->hits[i] = bigWigIntervalQuery(job->file, job->seqnames[i],
+                                         job->start[i] - 1,
+                                         job->start[i] - 1 + job->width[i],
+                                         job->lm);
+  }
+  errCatchEnd(errCatch);
+  if (errCatch->gotError)
+    job->error = cloneString(errCatch->message->string);
+  errCatchFree(&errCatch);
+  return NULL;
+}
+
 /* --- .Call ENTRY POINT --- */
 SEXP BWGFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
-		   SEXP r_return_score, SEXP r_return_list) {
+		   SEXP r_return_score, SEXP r_return_list, SEXP r_threads) {
   pushRHandlers();
   struct bbiFile * file = bigWigFileOpen((char *)CHAR(asChar(r_filename)));
   Rboolean return_list = asLogical(r_return_list);
   SEXP ans, ans_start, ans_width, ans_score, ans_ranges, ans_nhits;
   SEXP numericListEls = NULL;
   bool returnScore = asLogical(r_return_score);
-  struct lm *lm = lmInit(0);
-  
-  struct bbiInterval *hits = NULL;
 
   int n_ranges = get_IRanges_length(r_ranges);
-
-  if (return_list) {
-      PROTECT(numericListEls = allocVector(VECSXP, n_ranges));
-  } else {
-      PROTECT(ans_nhits = allocVector(INTSXP, n_ranges));
-  }
-  
   int *start = INTEGER(get_IRanges_start(r_ranges));
   int *width = INTEGER(get_IRanges_width(r_ranges));
+  char **seqnames = (char **) R_alloc(n_ranges, sizeof(char *));
+  for (int i = 0; i < n_ranges; i++)
+    seqnames[i] = (char *)CHAR(STRING_ELT(r_seqnames, i));
+  struct bbiInterval **hits =
+    (struct bbiInterval **) R_alloc(n_ranges, sizeof(struct bbiInterval *));
+
+  int n_jobs = max(1, min(clampThreads(asInteger(r_threads)), n_ranges));
+  struct bwgQueryJob *jobs =
+    (struct bwgQueryJob *) R_alloc(n_jobs, sizeof(struct bwgQueryJob));
+  for (int j = 0; j < n_jobs; j++) {
+    jobs[j].file = j == 0 ? file : bbiFileOpenShared(file);
+    jobs[j].lm = lmInit(0);
+    jobs[j].seqnames = seqnames;
+    jobs[j].start = start;
+    jobs[j].width = width;
+    jobs[j].first = (int)((double) n_ranges * j / n_jobs);
+    jobs[j].end = (int)((double) n_ranges * (j + 1) / n_jobs);
+    jobs[j].hits = hits;
+    jobs[j].error = NULL;
+  }
+  runJobs(bwgQueryRanges, jobs, sizeof(struct bwgQueryJob), n_jobs);
 
-  for (int i = 0; i < n_ranges; i++) {
-      struct bbiInterval *queryHits =
-	  bigWigIntervalQuery(file, (char *)CHAR(STRING_ELT(r_seqnames, i)),
-			      start[i] - 1, start[i] - 1 + width[i], lm);
-      int nqhits = slCount(queryHits);
-      if (return_list) {
-	  struct bbiInterval *qhits = queryHits;
-	  SEXP ans_numeric;
-	  PROTECT(ans_numeric = allocVector(REALSXP, width[i]));
-	  memset(REAL(ans_numeric), 0, sizeof(double) * width[i]);
-	  for (int k = 0; k < nqhits; k++, qhits = qhits->next) {
-	      for (int l = qhits->start; l < qhits->end; l++)
-		  REAL(ans_numeric)[(l - start[i] + 1)] = qhits->val;
-	  }
-	  SET_VECTOR_ELT(numericListEls, i, ans_numeric);
-	  UNPROTECT(1);
-      } else {
-	  slReverse(&queryHits);
-	  hits = slCat(queryHits, hits);
-	  INTEGER(ans_nhits)[i] = nqhits;
-      }
+  char *error = NULL;
+  for (int j = n_jobs - 1; j >= 0; j--) {
+    if (jobs[j].error != NULL) {
+      freeMem(error);
+      error = jobs[j].error;
+    }
+    bbiFileClose(&jobs[j].file);
+  }
+  if (error != NULL) {
+    for (int j = 0; j < n_jobs; j++)
+      lmCleanup(&jobs[j].lm);
+    char message[1024];
+    safef(message, sizeof(message), "%s", error);
+    freeMem(error);
+    errAbort("%s", message);
   }
 
-  bbiFileClose(&file);
-  
   if (return_list) {
+    PROTECT(numericListEls = allocVector(VECSXP, n_ranges));
+    for (int i = 0; i < n_ranges; i++) {
+      SEXP ans_numeric;
+      PROTECT(ans_numeric = allocVector(REALSXP, width[i]));
+      memset(REAL(ans_numeric), 0, sizeof(double) * width[i]);
+      for (struct bbiInterval *qhits = hits[i]; qhits != NULL;
+           qhits = qhits->next) {
+        for (int l = qhits->start; l < qhits->end; l++)
+          REAL(ans_numeric)[(l - start[i] + 1)] = qhits->val;
+      }
+      SET_VECTOR_ELT(numericListEls, i, ans_numeric);
+      UNPROTECT(1);
+    }
     ans = new_SimpleList("SimpleList", numericListEls);
     UNPROTECT(1);
   } else {
-    int n_hits = slCount(hits);
+    PROTECT(ans_nhits = allocVector(INTSXP, n_ranges));
+    int n_hits = 0;
+    for (int i = 0; i < n_ranges; i++) {
+      INTEGER(ans_nhits)[i] = slCount(hits[i]);
+      n_hits += INTEGER(ans_nhits)[i];
+    }
     PROTECT(ans_start = allocVector(INTSXP, n_hits));
     PROTECT(ans_width = allocVector(INTSXP, n_hits));
     if (returnScore) {
       PROTECT(ans_score = allocVector(REALSXP, n_hits));
     } else ans_score = R_NilValue;
 
-    slReverse(&hits);
-    for (int i = 0; i < n_hits; i++, hits = hits->next) {
-      INTEGER(ans_start)[i] = hits->start + 1;
-      INTEGER(ans_width)[i] = hits->end - hits->start;
-      if (returnScore)
-	REAL(ans_score)[i] = hits->val;
+    int k = 0;
+    for (int i = 0; i < n_ranges; i++) {
+      for (struct bbiInterval *qhits = hits[i]; qhits != NULL;
+           qhits = qhits->next, k++) {
+        INTEGER(ans_start)[k] = qhits->start + 1;
+        INTEGER(ans_width)[k] = qhits->end - qhits->start;
+        if (returnScore)
+          REAL(ans_score)[k] = qhits->val;
+      }
     }
 
     PROTECT(ans_ranges = new_IRanges("IRanges", ans_start, ans_width,
@@ -301,7 +361,88 @@ SEXP BWGFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
     UNPROTECT(4 + returnScore);
   }
 
-  lmCleanup(&lm);
+  for (int j = 0; j < n_jobs; j++)
+    lmCleanup(&jobs[j].lm);
+  popRHandlers();
+  return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP BWGFile_openCursor(SEXP r_filename) {
+  pushRHandlers();
+  struct bbiFile *file = bigWigFileOpen((char *)CHAR(asChar(r_filename)));
+  SEXP ans = bbiCursorToExternalPtr(bbiCursorNew(file));
+  popRHandlers();
+  return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+/* Reads the next 'r_n' intervals (all remaining if NA) in file order, as a
+ * list of seqnames, ranges and scores. Returns NULL once the cursor is
+ * exhausted. */
+SEXP BWGCursor_read(SEXP r_cursor, SEXP r_n) {
+  struct bbiCursor *cursor = bbiCursorFromExternalPtr(r_cursor);
+  pushRHandlers();
+  boolean isSwapped = cursor->bbi->isSwapped;
+  struct bwgSectionHead *head = &cursor->section;
+  int n = asInteger(r_n), n_hits = 0;
+  IntAE *chromIds = new_IntAE(0, 0, 0), *starts = new_IntAE(0, 0, 0),
+    *widths = new_IntAE(0, 0, 0);
+  DoubleAE *scores = new_DoubleAE(0, 0, 0);
+
+  while (n == NA_INTEGER || n_hits < n) {
+    if (cursor->blockPt >= cursor->blockEnd) {
+      if (!bbiCursorNextBlock(cursor))
+        break;
+      bwgSectionHeadFromMem(&cursor->blockPt, head, isSwapped);
+      cursor->fixedStart = head->start;
+    }
+    bits32 s, e;
+    switch (head->type) {
+    case bwgTypeBedGraph:
+      s = memReadBits32(&cursor->blockPt, isSwapped);
+      e = memReadBits32(&cursor->blockPt, isSwapped);
+      break;
+    case bwgTypeVariableStep:
+      s = memReadBits32(&cursor->blockPt, isSwapped);
+      e = s + head->itemSpan;
+      break;
+    case bwgTypeFixedStep:
+      s = cursor->fixedStart;
+      e = s + head->itemSpan;
+      cursor->fixedStart += head->itemStep;
+      break;
+    default:
+      /* internalErr() does not return, but is not declared so */
+      internalErr();
+      return R_NilValue;
+    }
+    IntAE_insert_at(chromIds, n_hits, head->chromId);
+    IntAE_insert_at(starts, n_hits, s + 1);
+    IntAE_insert_at(widths, n_hits, e - s);
+    DoubleAE_insert_at(scores, n_hits, memReadFloat(&cursor->blockPt, isSwapped));
+    ++n_hits;
+  }
+
+  if (n_hits == 0) {
+    popRHandlers();
+    return R_NilValue;
+  }
+
+  SEXP ans, ans_seqnames, ans_start, ans_width, ans_ranges;
+  PROTECT(ans_seqnames = allocVector(STRSXP, n_hits));
+  for (int i = 0; i < n_hits; i++)
+    SET_STRING_ELT(ans_seqnames, i,
+                   mkChar(bbiCursorChromName(cursor, chromIds->elts[i])));
+  PROTECT(ans_start = new_INTEGER_from_IntAE(starts));
+  PROTECT(ans_width = new_INTEGER_from_IntAE(widths));
+  PROTECT(ans_ranges = new_IRanges("IRanges", ans_start, ans_width,
+                                   R_NilValue));
+  PROTECT(ans = allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(ans, 0, ans_seqnames);
+  SET_VECTOR_ELT(ans, 1, ans_ranges);
+  SET_VECTOR_ELT(ans, 2, new_NUMERIC_from_DoubleAE(scores));
+  UNPROTECT(5);
   popRHandlers();
   return ans;
 }
@@ -362,9 +503,18 @@ SEXP BWGFile_fromWIG(SEXP r_infile, SEXP r_clip, SEXP r_seqlengths,
   return r_outfile;
 }
 
-SEXP R_udcCleanup(SEXP r_maxDays) {
-    double maxDays = asReal(r_maxDays);
-    bits64 size = udcCleanup(udcDefaultDir(), maxDays, FALSE);
+/* Removes files not used in r_maxDays (if not NA), then the least
+   recently used ones until the cache fits in r_maxBytes (if not NA) */
+SEXP R_udcCleanup(SEXP r_maxDays, SEXP r_maxBytes) {
+    char *dir = udcDefaultDir();
+    double maxDays = asReal(r_maxDays), maxBytes = asReal(r_maxBytes);
+    bits64 size = 0;
+    if (dir == NULL || !fileExists(dir))
+      return ScalarReal(0);
+    if (!ISNA(maxDays))
+      size += udcCleanup(dir, maxDays, FALSE);
+    if (!ISNA(maxBytes) && R_FINITE(maxBytes))
+      size += udcCacheTrim(dir, maxBytes);
     return ScalarReal(size);
 }
 
@@ -373,3 +523,258 @@ SEXP R_setUserUdcDir(SEXP r_dir) {
   udcSetDefaultDir(dir);
   return R_NilValue;
 }
+
+/* Returns the previous value; r_n of NULL only queries */
+SEXP R_udcFetchParallelism(SEXP r_n) {
+  int old = udcFetchParallelism();
+  if (r_n != R_NilValue)
+    udcSetFetchParallelism(asInteger(r_n));
+  return ScalarInteger(old);
+}
+
+SEXP R_udcKeepAlive(SEXP r_enable) {
+  Rboolean old = udcKeepAlive();
+  if (r_enable != R_NilValue)
+    udcSetKeepAlive(asLogical(r_enable));
+  return ScalarLogical(old);
+}
+
+static const char *udcCacheTypeNames[] = { "disk", "memory", "none" };
+
+SEXP R_udcCacheType(SEXP r_type) {
+  enum udcCacheType old = udcGetCacheType();
+  if (r_type != R_NilValue) {
+    const char *type = CHAR(asChar(r_type));
+    int i;
+    for (i = 0; i < 3; i++)
+      if (!strcmp(type, udcCacheTypeNames[i]))
+        udcSetCacheType(i);
+  }
+  return mkString(udcCacheTypeNames[old]);
+}
+
+/* Counts of bytes from R are held to at most MOST_BYTES, so they convert
+   and udc can add to them without overflow. Inf becomes MOST_BYTES. */
+#define MOST_BYTES ((bits64)1 << 62)
+
+static bits64 asBytes(SEXP r_bytes) {
+  double bytes = asReal(r_bytes);
+  return bytes < (double)MOST_BYTES ? (bits64)bytes : MOST_BYTES;
+}
+
+static SEXP bytesToR(bits64 bytes) {
+  return ScalarReal(bytes >= MOST_BYTES ? R_PosInf : bytes);
+}
+
+SEXP R_udcMemoryCacheBudget(SEXP r_bytes) {
+  bits64 old = udcMemoryCacheBudget();
+  if (r_bytes != R_NilValue)
+    udcSetMemoryCacheBudget(asBytes(r_bytes));
+  return bytesToR(old);
+}
+
+/* No limit is Inf in R and 0 in udc */
+SEXP R_udcDiskCacheBudget(SEXP r_bytes) {
+  bits64 old = udcDiskCacheBudget();
+  if (r_bytes != R_NilValue)
+    udcSetDiskCacheBudget(R_FINITE(asReal(r_bytes)) ? asBytes(r_bytes) : 0);
+  return ScalarReal(old == 0 ? R_PosInf : old);
+}
+
+static const char *udcAccessPatternNames[] = { "auto", "sequential", "random" };
+
+SEXP R_udcAccessPattern(SEXP r_pattern) {
+  enum udcAccessPattern old = udcDefaultAccessPattern();
+  if (r_pattern != R_NilValue) {
+    const char *pattern = CHAR(asChar(r_pattern));
+    int i;
+    for (i = 0; i < 3; i++)
+      if (!strcmp(pattern, udcAccessPatternNames[i]))
+        udcSetDefaultAccessPattern(i);
+  }
+  return mkString(udcAccessPatternNames[old]);
+}
+
+SEXP R_udcReadAheadMax(SEXP r_bytes) {
+  bits64 old = udcReadAheadMax();
+  if (r_bytes != R_NilValue)
+    udcSetReadAheadMax(asBytes(r_bytes));
+  return bytesToR(old);
+}
+
+static SEXP namedCounts(int n, const char **names, double *counts) {
+  SEXP ans = PROTECT(allocVector(REALSXP, n));
+  SEXP ans_names = allocVector(STRSXP, n);
+  setAttrib(ans, R_NamesSymbol, ans_names);
+  for (int i = 0; i < n; i++) {
+    REAL(ans)[i] = counts[i];
+    SET_STRING_ELT(ans_names, i, mkChar(names[i]));
+  }
+  UNPROTECT(1);
+  return ans;
+}
+
+/* Counters of the connection pool and of the memory cache, both shared
+   by all remote files, and what the disk cache holds */
+SEXP R_udcCacheStats(void) {
+  static const char *poolNames[] = { "new", "reused", "idle" };
+  static const char *memNames[] = { "bytes", "blocks", "evictions" };
+  static const char *diskNames[] = { "files", "bytes", "budget" };
+  bits64 numNew, numReused, memBytes, memBlocks, memEvictions;
+  bits64 diskFiles, diskBytes, diskBudget = udcDiskCacheBudget();
+  int numIdle;
+  udcConnectionPoolStats(&numNew, &numReused, &numIdle);
+  udcMemoryCacheStats(&memBytes, &memBlocks, &memEvictions);
+  udcCacheOccupancy(udcDefaultDir(), &diskFiles, &diskBytes);
+  double poolCounts[] = { numNew, numReused, numIdle };
+  double memCounts[] = { memBytes, memBlocks, memEvictions };
+  double diskCounts[] = { diskFiles, diskBytes,
+                          diskBudget == 0 ? R_PosInf : diskBudget };
+  SEXP ans = PROTECT(allocVector(VECSXP, 3)), ans_names;
+  SET_VECTOR_ELT(ans, 0, namedCounts(3, poolNames, poolCounts));
+  SET_VECTOR_ELT(ans, 1, namedCounts(3, memNames, memCounts));
+  SET_VECTOR_ELT(ans, 2, namedCounts(3, diskNames, diskCounts));
+  ans_names = allocVector(STRSXP, 3);
+  setAttrib(ans, R_NamesSymbol, ans_names);
+  SET_STRING_ELT(ans_names, 0, mkChar("connections"));
+  SET_STRING_ELT(ans_names, 1, mkChar("memory"));
+  SET_STRING_ELT(ans_names, 2, mkChar("disk"));
+  UNPROTECT(1);
+  return ans;
+}
+
+static const char *ioStatsNames[] = {
+  "seeks", "reads", "bytesRead", "writes", "bytesWritten"
+};
+
+static const char *iosNames[] = { "bitmap", "sparse", "udc", "net" };
+
+#define N_BBI_STATS 8
+
+static const char *bbiStatsNames[] = {
+  "blocksRead", "bytesRead", "bytesDecompressed", "decompressSeconds",
+  "indexNodesVisited", "readSeconds", "readWaitSeconds", "decodeSeconds"
+};
+
+/* Flattens ios in the order of iosNames, then ioStatsNames, then the
+   connection counts */
+static void iosCounts(struct ios *ios, double *counts) {
+  struct ioStats *stats[] = { &ios->bit, &ios->sparse, &ios->udc, &ios->net };
+  for (int i = 0; i < 4; i++) {
+    counts[i * 5] = stats[i]->numSeeks;
+    counts[i * 5 + 1] = stats[i]->numReads;
+    counts[i * 5 + 2] = stats[i]->bytesRead;
+    counts[i * 5 + 3] = stats[i]->numWrites;
+    counts[i * 5 + 4] = stats[i]->bytesWritten;
+  }
+  counts[20] = ios->numConnects;
+  counts[21] = ios->numReuse;
+}
+
+static void bbiStatsCounts(struct bbiStats *stats, double *counts) {
+  counts[0] = stats->blocksRead;
+  counts[1] = stats->bytesRead;
+  counts[2] = stats->bytesDecompressed;
+  counts[3] = stats->decompressMicros / 1e6;
+  counts[4] = stats->indexNodesVisited;
+  counts[5] = stats->readMicros / 1e6;
+  counts[6] = stats->readWaitMicros / 1e6;
+  counts[7] = stats->decodeMicros / 1e6;
+}
+
+/* A matrix with one row per handle; 'names' become the row names */
+static SEXP handleCounts(int nrow, int ncol, double *counts, SEXP names,
+                         SEXP colnames)
+{
+  SEXP ans = PROTECT(allocMatrix(REALSXP, nrow, ncol));
+  for (int i = 0; i < nrow; i++)
+    for (int j = 0; j < ncol; j++)
+      REAL(ans)[i + j * nrow] = counts[i * ncol + j];
+  SEXP dimnames = allocVector(VECSXP, 2);
+  setAttrib(ans, R_DimNamesSymbol, dimnames);
+  SET_VECTOR_ELT(dimnames, 0, names);
+  SET_VECTOR_ELT(dimnames, 1, colnames);
+  UNPROTECT(1);
+  return ans;
+}
+
+/* Cumulative and per open handle I/O counters of udc and the bbi reader */
+SEXP R_ioStats(void) {
+  struct ios totalIos;
+  struct bbiStats totalBbi;
+  udcTotalIoStats(&totalIos);
+  bbiTotalStats(&totalBbi);
+  struct udcFileIos *udcList = udcOpenFileIoStats(), *udcEl;
+  struct bbiFileStats *bbiList = bbiOpenFileStats(), *bbiEl;
+  int udcCount = slCount(udcList), bbiCount = slCount(bbiList), i;
+
+  SEXP ans = PROTECT(allocVector(VECSXP, 4)), ans_names;
+
+  double counts[22];
+  iosCounts(&totalIos, counts);
+  SEXP iosRowNames = PROTECT(allocVector(STRSXP, 4));
+  for (i = 0; i < 4; i++)
+    SET_STRING_ELT(iosRowNames, i, mkChar(iosNames[i]));
+  SEXP ioStatsColNames = PROTECT(allocVector(STRSXP, 5));
+  for (i = 0; i < 5; i++)
+    SET_STRING_ELT(ioStatsColNames, i, mkChar(ioStatsNames[i]));
+  SET_VECTOR_ELT(ans, 0, handleCounts(4, 5, counts, iosRowNames,
+                                      ioStatsColNames));
+  static const char *connNames[] = { "connects", "reuses" };
+  SET_VECTOR_ELT(ans, 1, namedCounts(2, connNames, counts + 20));
+  double bbiCounts[N_BBI_STATS];
+  bbiStatsCounts(&totalBbi, bbiCounts);
+  SET_VECTOR_ELT(ans, 2, namedCounts(N_BBI_STATS, bbiStatsNames, bbiCounts));
+
+  /* per handle: udc columns are "net.bytesRead" and so on */
+  SEXP handles = allocVector(VECSXP, 2);
+  SET_VECTOR_ELT(ans, 3, handles);
+  SEXP udcColNames = PROTECT(allocVector(STRSXP, 22));
+  for (i = 0; i < 20; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s.%s", iosNames[i / 5], ioStatsNames[i % 5]);
+    SET_STRING_ELT(udcColNames, i, mkChar(name));
+  }
+  SET_STRING_ELT(udcColNames, 20, mkChar(connNames[0]));
+  SET_STRING_ELT(udcColNames, 21, mkChar(connNames[1]));
+  SEXP udcUrls = PROTECT(allocVector(STRSXP, udcCount));
+  double *udcCounts = (double *) R_alloc(udcCount * 22 + 1, sizeof(double));
+  for (udcEl = udcList, i = 0; udcEl != NULL; udcEl = udcEl->next, i++) {
+    SET_STRING_ELT(udcUrls, i, mkChar(udcEl->url));
+    iosCounts(&udcEl->ios, udcCounts + i * 22);
+  }
+  SET_VECTOR_ELT(handles, 0, handleCounts(udcCount, 22, udcCounts, udcUrls,
+                                          udcColNames));
+  SEXP bbiColNames = PROTECT(allocVector(STRSXP, N_BBI_STATS));
+  for (i = 0; i < N_BBI_STATS; i++)
+    SET_STRING_ELT(bbiColNames, i, mkChar(bbiStatsNames[i]));
+  SEXP bbiFiles = PROTECT(allocVector(STRSXP, bbiCount));
+  double *bbiHandleCounts = (double *) R_alloc(bbiCount * N_BBI_STATS + 1, sizeof(double));
+  for (bbiEl = bbiList, i = 0; bbiEl != NULL; bbiEl = bbiEl->next, i++) {
+    SET_STRING_ELT(bbiFiles, i, mkChar(bbiEl->fileName));
+    bbiStatsCounts(&bbiEl->stats, bbiHandleCounts + i * N_BBI_STATS);
+  }
+  SET_VECTOR_ELT(handles, 1, handleCounts(bbiCount, N_BBI_STATS, bbiHandleCounts,
+                                          bbiFiles, bbiColNames));
+  udcFileIosFreeList(&udcList);
+  bbiFileStatsFreeList(&bbiList);
+
+  SEXP handles_names = allocVector(STRSXP, 2);
+  setAttrib(handles, R_NamesSymbol, handles_names);
+  SET_STRING_ELT(handles_names, 0, mkChar("udc"));
+  SET_STRING_ELT(handles_names, 1, mkChar("bbi"));
+  ans_names = allocVector(STRSXP, 4);
+  setAttrib(ans, R_NamesSymbol, ans_names);
+  SET_STRING_ELT(ans_names, 0, mkChar("udc"));
+  SET_STRING_ELT(ans_names, 1, mkChar("connections"));
+  SET_STRING_ELT(ans_names, 2, mkChar("bbi"));
+  SET_STRING_ELT(ans_names, 3, mkChar("handles"));
+  UNPROTECT(7);
+  return ans;
+}
+
+SEXP R_resetIoStats(void) {
+  udcResetIoStats();
+  bbiResetStats();
+  return R_NilValue;
+}
@@ -11,15 +11,37 @@ SEXP BWGSectionList_write(SEXP r_sections, SEXP r_seqlengths, SEXP r_compress,
                           SEXP r_fixed_summaries, SEXP r_file);
 SEXP BWGSectionList_cleanup(SEXP r_sections);
 SEXP BWGFile_query(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
-		   SEXP r_colnames, SEXP r_int_ranges);
+		   SEXP r_return_score, SEXP r_return_list, SEXP r_threads);
 SEXP BWGFile_seqlengths(SEXP r_filename);
+SEXP BWGFile_openCursor(SEXP r_filename);
+SEXP BWGCursor_read(SEXP r_cursor, SEXP r_n);
 SEXP BWGFile_summary(SEXP r_filename, SEXP r_chrom, SEXP r_ranges,
                      SEXP r_size, SEXP r_type, SEXP r_default_value);
 SEXP BWGFile_fromWIG(SEXP r_infile, SEXP r_clip, SEXP r_outfile,
 		     SEXP r_seqlengths);
 
-SEXP R_udcCleanup(SEXP r_maxDays);
+SEXP R_udcCleanup(SEXP r_maxDays, SEXP r_maxBytes);
 
 SEXP R_setUserUdcDir(SEXP dir);
 
+SEXP R_udcFetchParallelism(SEXP r_n);
+
+SEXP R_udcKeepAlive(SEXP r_enable);
+
+SEXP R_udcCacheType(SEXP r_type);
+
+SEXP R_udcMemoryCacheBudget(SEXP r_bytes);
+
+SEXP R_udcDiskCacheBudget(SEXP r_bytes);
+
+SEXP R_udcAccessPattern(SEXP r_pattern);
+
+SEXP R_udcReadAheadMax(SEXP r_bytes);
+
+SEXP R_udcCacheStats(void);
+
+SEXP R_ioStats(void);
+
+SEXP R_resetIoStats(void);
+
 #endif
@@ -0,0 +1,573 @@
+#include "ucsc/common.h"
+#include "ucsc/hash.h"
+#include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "chainIndex.h"
+
+/* A parsed Chain, with the search index of liftOver(), that loads by
+   mapping the file. The file starts with the header, then come the
+   exclude pattern, the names, the table of targets and the arrays of
+   each target, in native byte order. */
+
+#define CHAIN_INDEX_MAGIC 0x58444943 /* "CIDX" */
+#define CHAIN_INDEX_VERSION 1
+
+typedef struct {
+  bits32 magic, version;
+  bits32 n_targets, n_names;
+  double source_size, source_mtime; /* as file.info() gives them */
+  bits32 source_crc;                /* crc32() of the source file */
+  bits32 exclude_length;            /* ~0 when nothing was excluded */
+  bits64 names_offset, targets_offset;
+  bits64 size;                      /* of the whole file */
+} ChainIndexHeader;
+
+/* At 'names_offset', the offset of each name in the block of
+   zero-terminated names that follows */
+
+/* The arrays of a target, at 'offset', are the start, width and offset
+   of each block; the length, score, reversal, space (a name) of each
+   chain; then the first block and the start and end of each chain, the
+   first chain of each bin, the chains by bin and a byte telling
+   whether the blocks of each chain ascend, padded to 4 bytes */
+typedef struct {
+  bits32 name;
+  bits32 n_chains, n_blocks, n_bins;
+  bits32 level_first[CHAIN_INDEX_LEVELS + 1];
+  bits32 reserved;
+  bits64 offset;
+} ChainIndexTarget;
+
+static size_t targetArraysSize(const ChainIndexTarget *target) {
+  size_t n_ints = 3 * (size_t) target->n_blocks +
+    8 * (size_t) target->n_chains + target->n_bins + 2;
+  return n_ints * sizeof(int) + ((target->n_chains + 3) & ~3);
+}
+
+static bits32 fileChecksum(const char *path) {
+  FILE *f = fopen(path, "rb");
+  unsigned char *buf = (unsigned char *) R_alloc(1024 * 1024, 1);
+  uLong crc = crc32(0L, Z_NULL, 0);
+  size_t n;
+  if (f == NULL)
+    error("cannot open file '%s'", path);
+  while ((n = fread(buf, 1, 1024 * 1024, f)) > 0)
+    crc = crc32(crc, buf, n);
+  if (ferror(f)) {
+    fclose(f);
+    error("cannot read file '%s'", path);
+  }
+  fclose(f);
+  return crc;
+}
+
+/* .Call entry point */
+SEXP ChainFile_checksum(SEXP r_filename) {
+  return ScalarReal(fileChecksum(translateChar(asChar(r_filename))));
+}
+
+static int nameId(struct hash *hash, const char **names, int *n_names,
+                  const char *name) {
+  int id = hashIntValDefault(hash, (char *) name, -1);
+  if (id >= 0)
+    return id;
+  names[*n_names] = name;
+  hashAddInt(hash, (char *) name, *n_names);
+  return (*n_names)++;
+}
+
+static Rboolean writeAt(FILE *f, bits64 *pos, const void *data, size_t size,
+                        size_t align) {
+  static const char zeros[8] = { 0 };
+  size_t pad = (align - *pos % align) % align;
+  if ((pad && fwrite(zeros, 1, pad, f) != pad) ||
+      (size && fwrite(data, 1, size, f) != size))
+    return FALSE;
+  *pos += pad + size;
+  return TRUE;
+}
+
+/* .Call entry point */
+/* Writes the ChainBlocks 'r_blocks', a named list, and their search
+   index to 'r_filename'. 'r_source_info' holds the size and mtime of
+   the file 'r_source' they were read from. */
+SEXP Chain_writeIndex(SEXP r_blocks, SEXP r_filename, SEXP r_source,
+                      SEXP r_source_info, SEXP r_exclude) {
+  const char *filename = translateChar(asChar(r_filename));
+  int n_targets = length(r_blocks), n_chains = 0, n_names = 0;
+  SEXP r_names = getAttrib(r_blocks, R_NamesSymbol);
+  ChainIndex *indexes = (ChainIndex *) R_alloc(n_targets, sizeof(ChainIndex));
+  ChainIndexTarget *targets =
+    (ChainIndexTarget *) R_alloc(n_targets, sizeof(ChainIndexTarget));
+  ChainIndexHeader header;
+  struct hash *hash;
+  const char **names;
+  bits32 *name_offsets;
+  bits64 pos = 0, blob_size = 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = CHAIN_INDEX_MAGIC;
+  header.version = CHAIN_INDEX_VERSION;
+  header.n_targets = n_targets;
+  header.source_size = REAL(r_source_info)[0];
+  header.source_mtime = REAL(r_source_info)[1];
+  header.source_crc = fileChecksum(translateChar(asChar(r_source)));
+  header.exclude_length = length(r_exclude) ?
+    strlen(CHAR(STRING_ELT(r_exclude, 0))) : ~0u;
+
+  for (int i = 0; i < n_targets; i++) {
+    ChainIndex_build(indexes + i, VECTOR_ELT(r_blocks, i), 0);
+    n_chains += indexes[i].n_chains;
+  }
+  names = (const char **) R_alloc(n_targets + n_chains, sizeof(char *));
+  hash = hashNew(12);
+  for (int i = 0; i < n_targets; i++) {
+    SEXP r_space = GET_SLOT(VECTOR_ELT(r_blocks, i), install("space"));
+    ChainIndexTarget *target = targets + i;
+    memset(target, 0, sizeof(ChainIndexTarget));
+    target->name = nameId(hash, names, &n_names,
+                          CHAR(STRING_ELT(r_names, i)));
+    if (length(r_space) != indexes[i].n_chains)
+      error("malformed ChainBlock: slot lengths differ");
+    for (int c = 0; c < length(r_space); c++)
+      nameId(hash, names, &n_names, CHAR(STRING_ELT(r_space, c)));
+    target->n_chains = indexes[i].n_chains;
+    target->n_blocks = indexes[i].n_blocks;
+    target->n_bins = indexes[i].level_first[CHAIN_INDEX_LEVELS];
+    for (int l = 0; l <= CHAIN_INDEX_LEVELS; l++)
+      target->level_first[l] = indexes[i].level_first[l];
+  }
+  name_offsets = (bits32 *) R_alloc(n_names, sizeof(bits32));
+  for (int k = 0; k < n_names; k++) {
+    name_offsets[k] = blob_size;
+    blob_size += strlen(names[k]) + 1;
+  }
+  header.n_names = n_names;
+
+  /* lay the file out */
+  pos = sizeof(header);
+  if (length(r_exclude))
+    pos += header.exclude_length;
+  pos = (pos + 3) & ~3;
+  header.names_offset = pos;
+  pos += n_names * sizeof(bits32) + blob_size;
+  pos = (pos + 7) & ~7;
+  header.targets_offset = pos;
+  pos += n_targets * sizeof(ChainIndexTarget);
+  for (int i = 0; i < n_targets; i++) {
+    pos = (pos + 3) & ~3;
+    targets[i].offset = pos;
+    pos += targetArraysSize(targets + i);
+  }
+  header.size = pos;
+
+  /* written aside and renamed over 'filename', so other sessions never
+     see it half written */
+  size_t tmp_size = strlen(filename) + 32;
+  char *tmp = R_alloc(tmp_size, sizeof(char));
+  snprintf(tmp, tmp_size, "%s.%d.tmp", filename, (int) getpid());
+  FILE *f = fopen(tmp, "wb");
+  Rboolean ok;
+  if (f == NULL) {
+    hashFree(&hash);
+    error("cannot open file '%s'", tmp);
+  }
+  pos = 0;
+  ok = writeAt(f, &pos, &header, sizeof(header), 1);
+  if (length(r_exclude))
+    ok = ok && writeAt(f, &pos, CHAR(STRING_ELT(r_exclude, 0)),
+                       header.exclude_length, 1);
+  ok = ok && writeAt(f, &pos, name_offsets, n_names * sizeof(bits32), 4);
+  for (int k = 0; ok && k < n_names; k++)
+    ok = writeAt(f, &pos, names[k], strlen(names[k]) + 1, 1);
+  ok = ok && writeAt(f, &pos, targets, n_targets * sizeof(ChainIndexTarget),
+                     8);
+  for (int i = 0; ok && i < n_targets; i++) {
+    SEXP r_block = VECTOR_ELT(r_blocks, i);
+    SEXP r_space = GET_SLOT(r_block, install("space"));
+    const ChainIndex *index = indexes + i;
+    int n = index->n_chains;
+    int *space = (int *) R_alloc(n, sizeof(int));
+    for (int c = 0; c < n; c++)
+      space[c] = nameId(hash, names, &n_names, CHAR(STRING_ELT(r_space, c)));
+    ok = writeAt(f, &pos, index->start, index->n_blocks * sizeof(int), 4) &&
+      writeAt(f, &pos, index->width, index->n_blocks * sizeof(int), 1) &&
+      writeAt(f, &pos, index->offset, index->n_blocks * sizeof(int), 1) &&
+      writeAt(f, &pos, INTEGER(GET_SLOT(r_block, install("length"))),
+              n * sizeof(int), 1) &&
+      writeAt(f, &pos, INTEGER(GET_SLOT(r_block, install("score"))),
+              n * sizeof(int), 1) &&
+      writeAt(f, &pos, index->rev, n * sizeof(int), 1) &&
+      writeAt(f, &pos, space, n * sizeof(int), 1) &&
+      writeAt(f, &pos, index->chain_first, (n + 1) * sizeof(int), 1) &&
+      writeAt(f, &pos, index->chain_start, n * sizeof(int), 1) &&
+      writeAt(f, &pos, index->chain_end, n * sizeof(int), 1) &&
+      writeAt(f, &pos, index->bin_first,
+              (targets[i].n_bins + 1) * sizeof(int), 1) &&
+      writeAt(f, &pos, index->bin_chains, n * sizeof(int), 1) &&
+      writeAt(f, &pos, index->chain_sorted, n, 1) &&
+      writeAt(f, &pos, NULL, 0, 4);
+  }
+  hashFree(&hash);
+  if (fclose(f) != 0 || !ok) {
+    unlink(tmp);
+    error("cannot write file '%s'", tmp);
+  }
+#ifdef WIN32
+  /* rename() does not replace files there */
+  unlink(filename);
+#endif
+  if (rename(tmp, filename) != 0) {
+    unlink(tmp);
+    error("cannot rename '%s' to '%s'", tmp, filename);
+  }
+  return R_NilValue;
+}
+
+static Rboolean readHeader(const char *path, ChainIndexHeader *header,
+                           char *exclude, size_t exclude_size) {
+  FILE *f = fopen(path, "rb");
+  Rboolean ok;
+  if (f == NULL)
+    error("cannot open file '%s'", path);
+  ok = fread(header, sizeof(*header), 1, f) == 1 &&
+    header->magic == CHAIN_INDEX_MAGIC;
+  exclude[0] = '\0';
+  if (ok && header->exclude_length != ~0u) {
+    size_t n = min(header->exclude_length, exclude_size - 1);
+    ok = fread(exclude, 1, n, f) == n;
+    exclude[n] = '\0';
+  }
+  fclose(f);
+  return ok;
+}
+
+/* .Call entry point */
+/* Returns the version, exclude pattern and source file information of
+   the chain index 'r_filename', or NULL if it is not a chain index */
+SEXP ChainIndex_header(SEXP r_filename) {
+  ChainIndexHeader header;
+  char exclude[1024];
+  SEXP ans, ans_names;
+  const char *names[] = { "version", "supported", "exclude", "size",
+                          "mtime", "checksum" };
+  if (!readHeader(translateChar(asChar(r_filename)), &header, exclude,
+                  sizeof(exclude)))
+    return R_NilValue;
+  PROTECT(ans = allocVector(VECSXP, 6));
+  ans_names = allocVector(STRSXP, 6);
+  SET_NAMES(ans, ans_names);
+  for (int i = 0; i < 6; i++)
+    SET_STRING_ELT(ans_names, i, mkChar(names[i]));
+  SET_VECTOR_ELT(ans, 0, ScalarInteger(header.version));
+  SET_VECTOR_ELT(ans, 1,
+                 ScalarLogical(header.version == CHAIN_INDEX_VERSION));
+  SET_VECTOR_ELT(ans, 2, header.exclude_length == ~0u ?
+                 allocVector(STRSXP, 0) : mkString(exclude));
+  SET_VECTOR_ELT(ans, 3, ScalarReal(header.source_size));
+  SET_VECTOR_ELT(ans, 4, ScalarReal(header.source_mtime));
+  SET_VECTOR_ELT(ans, 5, ScalarReal(header.source_crc));
+  UNPROTECT(1);
+  return ans;
+}
+
+/* A loaded index, with the vectors made from each target, which tell
+   whether a ChainBlock is still the one loaded */
+typedef struct {
+  char *data;
+  size_t size;
+  Rboolean mapped;
+  int n_targets;
+  ChainIndex *indexes;
+  SEXP *vectors; /* start, width, offset, length, reversed of each */
+} LoadedChainIndex;
+
+#define N_VECTORS 5
+
+static void freeLoadedChainIndex(LoadedChainIndex *loaded) {
+#ifndef WIN32
+  if (loaded->mapped)
+    munmap(loaded->data, loaded->size);
+  else
+#endif
+    free(loaded->data);
+  free(loaded->indexes);
+  free(loaded->vectors);
+  free(loaded);
+}
+
+static void chainIndexFinalizer(SEXP r_index) {
+  LoadedChainIndex *loaded = R_ExternalPtrAddr(r_index);
+  if (loaded)
+    freeLoadedChainIndex(loaded);
+  R_ClearExternalPtr(r_index);
+}
+
+static LoadedChainIndex *mapChainIndex(const char *path) {
+  LoadedChainIndex *loaded = calloc(1, sizeof(LoadedChainIndex));
+  int flags = O_RDONLY;
+#ifdef WIN32
+  flags |= O_BINARY;
+#endif
+  int fd = open(path, flags);
+  struct stat st;
+  if (loaded == NULL || fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    free(loaded);
+    error("cannot open file '%s'", path);
+  }
+  loaded->size = st.st_size;
+#ifndef WIN32
+  if (loaded->size > 0) {
+    void *map = mmap(NULL, loaded->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      free(loaded);
+      error("cannot map file '%s'", path);
+    }
+    loaded->data = map;
+    loaded->mapped = TRUE;
+    return loaded;
+  }
+#endif
+  loaded->data = malloc(max(loaded->size, 1));
+  size_t done = 0;
+  while (loaded->data != NULL && done < loaded->size) {
+    ssize_t rd = read(fd, loaded->data + done, loaded->size - done);
+    if (rd < 0 && errno == EINTR)
+      continue;
+    if (rd <= 0)
+      break;
+    done += rd;
+  }
+  if (loaded->data == NULL || done != loaded->size) {
+    close(fd);
+    freeLoadedChainIndex(loaded);
+    error("cannot read file '%s'", path);
+  }
+  close(fd);
+  return loaded;
+}
+
+/* Whether the header, then the names and the table of targets come in
+   order within the 'size' bytes of the file. Each offset is checked
+   against 'size' before anything is added to it, so nothing wraps. */
+static Rboolean checkSections(const ChainIndexHeader *header, size_t size) {
+  bits64 names_end;
+  if (header->size != size ||
+      header->names_offset < sizeof(ChainIndexHeader) ||
+      header->names_offset > size || header->names_offset % 4 ||
+      header->n_names > (size - header->names_offset) / sizeof(bits32))
+    return FALSE;
+  names_end = header->names_offset + header->n_names * sizeof(bits32);
+  return header->targets_offset >= names_end &&
+    header->targets_offset <= size && header->targets_offset % 8 == 0 &&
+    header->n_targets <=
+    (size - header->targets_offset) / sizeof(ChainIndexTarget);
+}
+
+/* Whether the arrays of 'target' are consistent, so lifting over them
+   stays in bounds */
+static Rboolean checkTarget(const ChainIndexTarget *target,
+                            const ChainIndex *index, const int *space,
+                            bits32 n_names) {
+  int n_chains = target->n_chains, n_bins = target->n_bins;
+  if (index->chain_first[0] != 0 ||
+      index->chain_first[n_chains] != (int) target->n_blocks ||
+      target->level_first[0] != 0 ||
+      target->level_first[CHAIN_INDEX_LEVELS] != target->n_bins ||
+      index->bin_first[0] != 0 || index->bin_first[n_bins] != n_chains)
+    return FALSE;
+  for (int l = 0; l < CHAIN_INDEX_LEVELS; l++)
+    if (target->level_first[l] > target->level_first[l + 1])
+      return FALSE;
+  for (int c = 0; c < n_chains; c++)
+    if (index->chain_first[c] > index->chain_first[c + 1] ||
+        index->bin_chains[c] < 0 || index->bin_chains[c] >= n_chains ||
+        space[c] < 0 || (bits32) space[c] >= n_names)
+      return FALSE;
+  for (int b = 0; b < n_bins; b++)
+    if (index->bin_first[b] > index->bin_first[b + 1])
+      return FALSE;
+  return TRUE;
+}
+
+static SEXP newIntegers(const int *x, int n, SEXPTYPE type) {
+  SEXP ans = allocVector(type, n);
+  memcpy(type == LGLSXP ? LOGICAL(ans) : INTEGER(ans), x, n * sizeof(int));
+  return ans;
+}
+
+/* .Call entry point */
+/* Loads the chain index 'r_filename' as a Chain. Its metadata holds the
+   search index, for liftOver(). */
+SEXP ChainIndex_read(SEXP r_filename) {
+  const char *path = translateChar(asChar(r_filename));
+  LoadedChainIndex *loaded = mapChainIndex(path);
+  ChainIndexHeader header;
+  const ChainIndexTarget *targets;
+  const bits32 *name_offsets;
+  SEXP ans, ans_listData, ans_names, names, r_index, metadata, vectors;
+  SEXP chain_class, chainBlock_class;
+  const char *problem = NULL;
+
+  if (loaded->size < sizeof(header))
+    problem = "is not a chain index";
+  else {
+    memcpy(&header, loaded->data, sizeof(header));
+    if (header.magic != CHAIN_INDEX_MAGIC)
+      problem = "is not a chain index";
+    else if (header.version != CHAIN_INDEX_VERSION)
+      problem = "is a chain index of an unsupported version";
+    else if (!checkSections(&header, loaded->size))
+      problem = "is a truncated or corrupt chain index";
+  }
+  if (problem) {
+    freeLoadedChainIndex(loaded);
+    error("'%s' %s", path, problem);
+  }
+  targets = (const ChainIndexTarget *) (loaded->data + header.targets_offset);
+  name_offsets = (const bits32 *) (loaded->data + header.names_offset);
+  loaded->n_targets = header.n_targets;
+  loaded->indexes = calloc(max(header.n_targets, 1), sizeof(ChainIndex));
+  loaded->vectors = calloc(max(header.n_targets, 1) * N_VECTORS,
+                           sizeof(SEXP));
+  if (!loaded->indexes || !loaded->vectors) {
+    freeLoadedChainIndex(loaded);
+    error("cannot allocate memory for '%s'", path);
+  }
+  const char *blob = (const char *) (name_offsets + header.n_names);
+  size_t blob_size = loaded->data + header.targets_offset - blob;
+  for (bits32 k = 0; k < header.n_names && !problem; k++)
+    if (name_offsets[k] >= blob_size ||
+        !memchr(blob + name_offsets[k], '\0', blob_size - name_offsets[k]))
+      problem = "is a truncated or corrupt chain index";
+  for (bits32 i = 0; i < header.n_targets && !problem; i++) {
+    const ChainIndexTarget *target = targets + i;
+    ChainIndex *index = loaded->indexes + i;
+    int n_blocks = target->n_blocks, n_chains = target->n_chains;
+    if (target->offset % 4 || target->offset > loaded->size ||
+        targetArraysSize(target) > loaded->size - target->offset ||
+        target->name >= header.n_names) {
+      problem = "is a truncated or corrupt chain index";
+      break;
+    }
+    int *x = (int *) (loaded->data + target->offset);
+    index->n_blocks = n_blocks;
+    index->n_chains = n_chains;
+    x += 3 * n_blocks + 4 * n_chains;
+    index->chain_first = x;
+    index->chain_start = x += n_chains + 1;
+    index->chain_end = x += n_chains;
+    index->bin_first = x += n_chains;
+    index->bin_chains = x += target->n_bins + 1;
+    index->chain_sorted = (char *) (x + n_chains);
+    for (int l = 0; l <= CHAIN_INDEX_LEVELS; l++)
+      index->level_first[l] = target->level_first[l];
+    if (!checkTarget(target, index, index->chain_first - n_chains,
+                     header.n_names))
+      problem = "is a truncated or corrupt chain index";
+  }
+  if (problem) {
+    freeLoadedChainIndex(loaded);
+    error("'%s' %s", path, problem);
+  }
+
+  PROTECT(r_index = R_MakeExternalPtr(loaded, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(r_index, chainIndexFinalizer, TRUE);
+
+  PROTECT(names = allocVector(STRSXP, header.n_names));
+  for (bits32 k = 0; k < header.n_names; k++)
+    SET_STRING_ELT(names, k, mkChar(blob + name_offsets[k]));
+
+  PROTECT(chain_class = MAKE_CLASS("Chain"));
+  PROTECT(chainBlock_class = MAKE_CLASS("ChainBlock"));
+  PROTECT(vectors = allocVector(VECSXP, header.n_targets * N_VECTORS));
+  PROTECT(ans = NEW_OBJECT(chain_class));
+  ans_listData = allocVector(VECSXP, header.n_targets);
+  SET_SLOT(ans, install("listData"), ans_listData);
+  ans_names = allocVector(STRSXP, header.n_targets);
+  SET_NAMES(ans_listData, ans_names);
+  for (bits32 i = 0; i < header.n_targets; i++) {
+    const ChainIndexTarget *target = targets + i;
+    int n_blocks = target->n_blocks, n_chains = target->n_chains;
+    const int *x = (const int *) (loaded->data + target->offset);
+    SEXP block, start, width, space, *saved = loaded->vectors + i * N_VECTORS;
+    block = NEW_OBJECT(chainBlock_class);
+    SET_VECTOR_ELT(ans_listData, i, block);
+    PROTECT(start = newIntegers(x, n_blocks, INTSXP));
+    PROTECT(width = newIntegers(x + n_blocks, n_blocks, INTSXP));
+    SET_SLOT(block, install("ranges"),
+             new_IRanges("IRanges", start, width, R_NilValue));
+    UNPROTECT(2);
+    SET_SLOT(block, install("offset"),
+             newIntegers(x + 2 * n_blocks, n_blocks, INTSXP));
+    x += 3 * n_blocks;
+    SET_SLOT(block, install("length"), newIntegers(x, n_chains, INTSXP));
+    SET_SLOT(block, install("score"),
+             newIntegers(x + n_chains, n_chains, INTSXP));
+    SET_SLOT(block, install("reversed"),
+             newIntegers(x + 2 * n_chains, n_chains, LGLSXP));
+    space = allocVector(STRSXP, n_chains);
+    SET_SLOT(block, install("space"), space);
+    for (int c = 0; c < n_chains; c++)
+      SET_STRING_ELT(space, c, STRING_ELT(names, x[3 * n_chains + c]));
+    SET_STRING_ELT(ans_names, i, STRING_ELT(names, target->name));
+    saved[0] = get_IRanges_start(GET_SLOT(block, install("ranges")));
+    saved[1] = get_IRanges_width(GET_SLOT(block, install("ranges")));
+    saved[2] = GET_SLOT(block, install("offset"));
+    saved[3] = GET_SLOT(block, install("length"));
+    saved[4] = GET_SLOT(block, install("reversed"));
+    for (int k = 0; k < N_VECTORS; k++)
+      SET_VECTOR_ELT(vectors, i * N_VECTORS + k, saved[k]);
+  }
+  /* keeps the vectors alive, so their addresses stay theirs, and
+     shared, so they are copied before any change */
+  R_SetExternalPtrProtected(r_index, vectors);
+
+  PROTECT(metadata = allocVector(VECSXP, 1));
+  SET_NAMES(metadata, mkString("liftOverIndex"));
+  SET_VECTOR_ELT(metadata, 0, r_index);
+  SET_SLOT(ans, install("metadata"), metadata);
+
+  UNPROTECT(7);
+  return ans;
+}
+
+/* Fills 'index' from the loaded index 'r_index' when it has one for
+   'r_block', as loaded. Returns FALSE otherwise. */
+Rboolean ChainIndex_find(SEXP r_index, SEXP r_block, int chain_base,
+                         ChainIndex *index) {
+  LoadedChainIndex *loaded;
+  SEXP r_ranges, r_start;
+  if (TYPEOF(r_index) != EXTPTRSXP ||
+      (loaded = R_ExternalPtrAddr(r_index)) == NULL)
+    return FALSE;
+  r_ranges = GET_SLOT(r_block, install("ranges"));
+  r_start = get_IRanges_start(r_ranges);
+  for (int i = 0; i < loaded->n_targets; i++) {
+    SEXP *vectors = loaded->vectors + i * N_VECTORS;
+    if (vectors[0] != r_start ||
+        vectors[1] != get_IRanges_width(r_ranges) ||
+        vectors[2] != GET_SLOT(r_block, install("offset")) ||
+        vectors[3] != GET_SLOT(r_block, install("length")) ||
+        vectors[4] != GET_SLOT(r_block, install("reversed")))
+      continue;
+    *index = loaded->indexes[i];
+    index->start = INTEGER(vectors[0]);
+    index->width = INTEGER(vectors[1]);
+    index->offset = INTEGER(vectors[2]);
+    index->rev = LOGICAL(vectors[4]);
+    index->chain_base = chain_base;
+    return TRUE;
+  }
+  return FALSE;
+}
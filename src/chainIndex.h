@@ -0,0 +1,18 @@
+#ifndef CHAIN_INDEX_H
+#define CHAIN_INDEX_H
+
+#include "rtracklayer.h"
+#include "liftOver.h"
+
+Rboolean ChainIndex_find(SEXP r_index, SEXP r_block, int chain_base,
+                         ChainIndex *index);
+
+/* The .Call entry points */
+
+SEXP Chain_writeIndex(SEXP r_blocks, SEXP r_filename, SEXP r_source,
+                      SEXP r_source_info, SEXP r_exclude);
+SEXP ChainIndex_header(SEXP r_filename);
+SEXP ChainIndex_read(SEXP r_filename);
+SEXP ChainFile_checksum(SEXP r_filename);
+
+#endif
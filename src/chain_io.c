@@ -1,9 +1,15 @@
 #include "ucsc/common.h"
 #include "ucsc/hash.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #include "rtracklayer.h"
-
-#define LINEBUF_SIZE 20001
+#include "utils.h"
 
 /* hash these chain blocks by target and query name */
 typedef struct _ChainBlock {
@@ -14,118 +20,404 @@ typedef struct _ChainBlock {
   IntAE *length, *score;
   CharAE *rev; /* use CharAE until we have a bitset */
   CharAEAE *space;
+  int n_chains, n_blocks; /* counted before filling the buffers */
 } ChainBlock;
 
 #define HEADER_SIZE 11
 #define DATA_SIZE 3
 
-/* returns an array of ChainBlock pointers */
-ChainBlock **read_chain_file(FILE *stream, const char *exclude, int *nblocks) {
-  /* fgets() a line
-     if first or after blank, parse header
-       get names, use hash table to get existing block, ow create one
-       add score, get offsets for starts
-     ow parse a record for width, tstart, qstart
-  */
-  char linebuf[LINEBUF_SIZE];
-  char *header[HEADER_SIZE];
-  char *data[DATA_SIZE];
-  int tstart = 0, qstart = 0;
-  Rboolean new_block = TRUE, excluded = FALSE, trc = FALSE, qrc = FALSE;
-  ChainBlock *block = NULL, **result = NULL;
-  struct hash *hash = hashNew(6);
-  struct hashEl *hash_elements;
-  int line = 0, i = 0, header_line = 0;
-  while (fgets(linebuf, LINEBUF_SIZE, stream) != NULL) {
-    line++;
-    if (strlen(linebuf) == LINEBUF_SIZE - 1) {
-      error("line %d is too long", line);
-    }
-    if (linebuf[0] == '#') {
-	continue;
+/* The text of a chain file, mapped when it is uncompressed and
+   inflated into memory otherwise */
+typedef struct {
+  char *text;
+  size_t size;
+  Rboolean mapped;
+} ChainText;
+
+#define GZ_READ_SIZE (64 * 1024 * 1024)
+
+static void read_chain_text(const char *path, ChainText *text) {
+  unsigned char magic[2];
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    error("cannot open file '%s'", path);
+  }
+  text->text = NULL;
+  text->size = 0;
+  text->mapped = FALSE;
+#ifndef WIN32
+  if (st.st_size > 0 &&
+      !(read(fd, magic, 2) == 2 && magic[0] == 0x1f && magic[1] == 0x8b)) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+      error("cannot map file '%s'", path);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    text->text = map;
+    text->size = st.st_size;
+    text->mapped = TRUE;
+    return;
+  }
+#endif
+  close(fd);
+  /* gzread() passes uncompressed files through */
+  gzFile gz = gzopen(path, "rb");
+  size_t buflength = 0;
+  int n;
+  if (gz == NULL)
+    error("cannot open file '%s'", path);
+  gzbuffer(gz, 1024 * 1024);
+  do {
+    if (buflength - text->size < GZ_READ_SIZE) {
+      char *grown;
+      buflength = max(2 * buflength, text->size + GZ_READ_SIZE);
+      if ((grown = realloc(text->text, buflength)) == NULL) {
+        free(text->text);
+        gzclose(gz);
+        error("cannot allocate memory for '%s'", path);
+      }
+      text->text = grown;
     }
+    n = gzread(gz, text->text + text->size, GZ_READ_SIZE);
+    if (n > 0)
+      text->size += n;
+  } while (n > 0);
+  gzclose(gz);
+  if (n < 0) {
+    free(text->text);
+    error("cannot read compressed file '%s'", path);
+  }
+}
+
+static void free_chain_text(ChainText *text) {
+#ifndef WIN32
+  if (text->mapped) {
+    munmap(text->text, text->size);
+    return;
+  }
+#endif
+  free(text->text);
+}
+
+/* One chain, parsed; the names point into the text */
+typedef struct {
+  const char *tname, *qname;
+  int tname_len, qname_len;
+  int score, n_blocks;
+  char rev;
+  ChainBlock *block;
+} ChainRecord;
+
+/* The chains with a header in [start, end) of the text. A job parses
+   on its own thread, so it uses malloc() and keeps its error for the R
+   thread to raise. */
+struct chainJob
+{
+  const char *start, *end;
+  const char *exclude;
+  ChainRecord *chains;
+  int n_chains, max_chains;
+  int *block_start, *block_width, *block_offset;
+  int n_blocks, max_blocks;
+  const char *error_at;
+  char error[256];
+};
+
+static int grow_chain_job(struct chainJob *job, Rboolean blocks) {
+  if (!blocks) {
+    int max_chains = max(16, 2 * job->max_chains);
+    ChainRecord *chains = realloc(job->chains,
+                                  max_chains * sizeof(ChainRecord));
+    if (chains == NULL)
+      return 0;
+    job->chains = chains;
+    job->max_chains = max_chains;
+    return 1;
+  }
+  int max_blocks = max(1024, 2 * job->max_blocks);
+  int *a = realloc(job->block_start, max_blocks * sizeof(int));
+  if (a) job->block_start = a;
+  int *b = realloc(job->block_width, max_blocks * sizeof(int));
+  if (b) job->block_width = b;
+  int *c = realloc(job->block_offset, max_blocks * sizeof(int));
+  if (c) job->block_offset = c;
+  if (!a || !b || !c)
+    return 0;
+  job->max_blocks = max_blocks;
+  return 1;
+}
+
+static Rboolean is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Splits the line [p, end) at white space into at most 'n' words and
+   returns the number of words */
+static int chop_line(const char *p, const char *end, const char **words,
+                     int *lengths, int n) {
+  int count = 0;
+  while (count < n) {
+    while (p < end && is_blank(*p))
+      p++;
+    if (p == end)
+      break;
+    words[count] = p;
+    while (p < end && !is_blank(*p))
+      p++;
+    lengths[count] = p - words[count];
+    count++;
+  }
+  return count;
+}
+
+/* atoi() of a word that need not be terminated */
+static int parse_int(const char *p, int length) {
+  const char *end = p + length;
+  long long value = 0;
+  Rboolean negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+'))
+    p++;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    value = value * 10 + (*p - '0');
+  return (int) (negative ? -value : value);
+}
+
+static Rboolean word_has(const char *word, int length, const char *pattern) {
+  int n = strlen(pattern);
+  for (int i = 0; i + n <= length; i++)
+    if (memcmp(word + i, pattern, n) == 0)
+      return TRUE;
+  return FALSE;
+}
+
+static void *parse_chains(void *arg) {
+  struct chainJob *job = arg;
+  const char *words[HEADER_SIZE];
+  int lengths[HEADER_SIZE];
+  int tstart = 0, qstart = 0;
+  Rboolean in_chain = FALSE, excluded = FALSE, trc = FALSE, qrc = FALSE;
+  ChainRecord *chain = NULL;
+  const char *line, *next;
+
+  for (line = job->start; line < job->end; line = next) {
+    const char *eol = memchr(line, '\n', job->end - line);
+    if (eol == NULL)
+      eol = job->end;
+    next = eol + 1;
+    if (line[0] == '#')
+      continue;
+    int matches = chop_line(line, eol, words, lengths,
+                            in_chain ? DATA_SIZE : HEADER_SIZE);
     if (excluded) {
-      eraseWhiteSpace(linebuf);
-      if (!strlen(linebuf)) {
+      if (!matches)
         excluded = FALSE;
-        new_block = TRUE;
+    } else if (!in_chain) { /* have a header */
+      if (!matches)
+        continue;
+      if (matches < HEADER_SIZE) {
+        job->error_at = line;
+        snprintf(job->error, sizeof(job->error),
+                 "expected %d elements in header, got %d", HEADER_SIZE,
+                 matches);
+        return NULL;
       }
-    } else if (new_block) { /* have a header */
-      void *value;
-      int matches = chopByChar(linebuf, ' ', header, HEADER_SIZE);
-      if (matches < HEADER_SIZE)
-        error("expected %d elements in header, got %d, on line %d", HEADER_SIZE,
-              matches, line);
-      new_block = FALSE;
-      if (exclude && (strstr(header[2], exclude) || strstr(header[7], exclude)))
+      if (job->exclude && (word_has(words[2], lengths[2], job->exclude) ||
+                           word_has(words[7], lengths[7], job->exclude)))
         {
-          //Rprintf("excluding: [%s -> %s]\n", header[2], header[7]);
           excluded = TRUE;
           continue;
         }
-      value = hashFindVal(hash, header[2]);
-      if (!value) { /* new block */
-        int name_size = strlen(header[2])+1;
-        block = (ChainBlock *)S_alloc(1, sizeof(ChainBlock));
-        hashAdd(hash, header[2], block);
-        block->name = (char *)S_alloc(name_size, sizeof(char));
-        memcpy(block->name, header[2], name_size);
-        block->ranges = new_IntPairAE(0, 0);
-        block->offset = new_IntAE(0, 0, 0);
-        block->length = new_IntAE(0, 0, 0);
-        block->score = new_IntAE(0, 0, 0);
-        block->rev = new_CharAE(0);
-        block->space = new_CharAEAE(0, 0);
-      } else block = value;
-      IntAE_insert_at(block->score, IntAE_get_nelt(block->score),
-                      atoi(header[1]));
-      CharAEAE_append_string(block->space, header[7]);
-      header_line = line;
-      trc = strcmp("+", header[4]);
-      qrc = strcmp("+", header[9]);
-      CharAE_insert_at(block->rev, CharAE_get_nelt(block->rev),
-                       trc != qrc);
-      tstart = atoi(header[5]) + 1; /* 0-based -> 1-based */
+      if (job->n_chains == job->max_chains && !grow_chain_job(job, FALSE))
+        goto out_of_memory;
+      chain = job->chains + job->n_chains++;
+      chain->tname = words[2];
+      chain->tname_len = lengths[2];
+      chain->qname = words[7];
+      chain->qname_len = lengths[7];
+      chain->score = parse_int(words[1], lengths[1]);
+      chain->n_blocks = 0;
+      trc = lengths[4] != 1 || words[4][0] != '+';
+      qrc = lengths[9] != 1 || words[9][0] != '+';
+      chain->rev = trc != qrc;
+      tstart = parse_int(words[5], lengths[5]) + 1; /* 0-based -> 1-based */
       if (trc)
-        tstart = atoi(header[3]) - tstart + 2; /* start one too high */
-      qstart = atoi(header[10]) + 1;
+        tstart = parse_int(words[3], lengths[3]) - tstart + 2;
+      qstart = parse_int(words[10], lengths[10]) + 1;
       if (qrc)
-        qstart = atoi(header[8]) - qstart + 2;
+        qstart = parse_int(words[8], lengths[8]) - qstart + 2;
+      in_chain = TRUE;
     } else {
-      int matches = chopByWhite(linebuf, data, DATA_SIZE), width;
-      if (matches != 1 && matches != 3)
-        error("expecting 1 or 3 elements on line %d, got %d", line, matches);
-      width = atoi(data[0]);
+      int width;
+      if (matches != 1 && matches != 3) {
+        job->error_at = line;
+        snprintf(job->error, sizeof(job->error),
+                 "expecting 1 or 3 elements, got %d", matches);
+        return NULL;
+      }
+      if (job->n_blocks == job->max_blocks && !grow_chain_job(job, TRUE))
+        goto out_of_memory;
+      width = parse_int(words[0], lengths[0]);
       tstart -= (trc ? width : 0);
       qstart -= (qrc ? width : 0);
-      IntPairAE_insert_at(block->ranges, IntPairAE_get_nelt(block->ranges),
-                        tstart, width);
-      IntAE_insert_at(block->offset, IntAE_get_nelt(block->offset),
-                      tstart - qstart);
+      job->block_start[job->n_blocks] = tstart;
+      job->block_width[job->n_blocks] = width;
+      job->block_offset[job->n_blocks++] = tstart - qstart;
+      chain->n_blocks++;
       if (matches == 3) { /* normal line */
-        int dt = atoi(data[1]), dq = atoi(data[2]);
-        int tchange, qchange;
-        if (trc) /* width already subtracted above */
-          tchange = -dt;
-        else tchange = width + dt;
-        tstart += tchange;
-        if (qrc)
-          qchange = -dq;
-        else qchange = width + dq;
-        qstart += qchange;
-      } else {
-        new_block = TRUE;
-        IntAE_insert_at(block->length, IntAE_get_nelt(block->length),
-                        line-header_line);
-        //Rprintf("end of %s block, line: %d\n", block->name, line);
-        if (fgets(linebuf, LINEBUF_SIZE, stream) == NULL) /* skip empty line */
-	    error("incomplete block");
-        line++;
+        int dt = parse_int(words[1], lengths[1]);
+        int dq = parse_int(words[2], lengths[2]);
+        tstart += trc ? -dt : width + dt; /* width already subtracted */
+        qstart += qrc ? -dq : width + dq;
+      } else in_chain = FALSE;
+    }
+  }
+  if (in_chain) {
+    job->error_at = job->end;
+    snprintf(job->error, sizeof(job->error), "incomplete block");
+  }
+  return NULL;
+
+ out_of_memory:
+  job->error_at = line;
+  snprintf(job->error, sizeof(job->error), "cannot allocate memory");
+  return NULL;
+}
+
+/* Splits the text at chain headers into at most 'n' parts of about
+   the same size */
+static int split_chain_text(const ChainText *text, int n,
+                            struct chainJob *jobs) {
+  const char *end = text->text + text->size, *p = text->text;
+  int n_parts = 0;
+  for (int i = 0; i < n && p < end; i++) {
+    const char *q = text->text + (size_t) ((double) text->size * (i + 1) / n);
+    if (q < p)
+      q = p;
+    while (q < end && !(q > p && q[-1] == '\n' && end - q > 5 &&
+                        memcmp(q, "chain", 5) == 0 && is_blank(q[5]))) {
+      const char *eol = memchr(q, '\n', end - q);
+      q = eol ? eol + 1 : end;
+    }
+    memset(jobs + n_parts, 0, sizeof(struct chainJob));
+    jobs[n_parts].start = p;
+    jobs[n_parts++].end = q;
+    p = q;
+  }
+  return n_parts;
+}
+
+static void free_chain_jobs(struct chainJob *jobs, int n) {
+  for (int i = 0; i < n; i++) {
+    free(jobs[i].chains);
+    free(jobs[i].block_start);
+    free(jobs[i].block_width);
+    free(jobs[i].block_offset);
+  }
+}
+
+/* returns an array of ChainBlock pointers */
+ChainBlock **read_chain_file(const char *path, const char *exclude,
+                             int threads, int *nblocks) {
+  ChainText text;
+  struct chainJob *jobs =
+    (struct chainJob *) R_alloc(threads, sizeof(struct chainJob));
+  ChainBlock **result = NULL;
+  struct hash *hash;
+  struct hashEl *hash_elements;
+  char *name;
+  int n_jobs, i = 0, max_name = 0;
+
+  read_chain_text(path, &text);
+  n_jobs = split_chain_text(&text, threads, jobs);
+  for (int t = 0; t < n_jobs; t++)
+    jobs[t].exclude = exclude;
+  runJobs(parse_chains, jobs, sizeof(struct chainJob), n_jobs);
+
+  for (int t = 0; t < n_jobs; t++) {
+    if (jobs[t].error_at) {
+      char message[sizeof(jobs[t].error) + 32];
+      int line = 1;
+      for (const char *p = text.text; p < jobs[t].error_at; p++)
+        line += *p == '\n';
+      snprintf(message, sizeof(message), "%s, on line %d", jobs[t].error,
+               line);
+      free_chain_jobs(jobs, n_jobs);
+      free_chain_text(&text);
+      error("%s", message);
+    }
+    for (int k = 0; k < jobs[t].n_chains; k++) {
+      ChainRecord *chain = jobs[t].chains + k;
+      max_name = max(max_name, max(chain->tname_len, chain->qname_len));
+    }
+  }
+
+  /* count the chains and blocks of each target, then fill buffers of
+     just that size, in file order */
+  name = R_alloc(max_name + 1, sizeof(char));
+  hash = hashNew(6);
+  for (int t = 0; t < n_jobs; t++)
+    for (int k = 0; k < jobs[t].n_chains; k++) {
+      ChainRecord *chain = jobs[t].chains + k;
+      ChainBlock *block;
+      memcpy(name, chain->tname, chain->tname_len);
+      name[chain->tname_len] = '\0';
+      block = hashFindVal(hash, name);
+      if (!block) { /* new block */
+        block = (ChainBlock *)S_alloc(1, sizeof(ChainBlock));
+        hashAdd(hash, name, block);
+        block->name = R_alloc(chain->tname_len + 1, sizeof(char));
+        memcpy(block->name, name, chain->tname_len + 1);
       }
+      block->n_chains++;
+      block->n_blocks += chain->n_blocks;
+      chain->block = block;
+    }
+  hash_elements = hashElListHash(hash);
+  for (struct hashEl *h = hash_elements; h; h = h->next) {
+    ChainBlock *block = h->val;
+    block->ranges = new_IntPairAE(block->n_blocks, 0);
+    block->offset = new_IntAE(block->n_blocks, 0, 0);
+    block->length = new_IntAE(block->n_chains, 0, 0);
+    block->score = new_IntAE(block->n_chains, 0, 0);
+    block->rev = new_CharAE(block->n_chains);
+    block->space = new_CharAEAE(block->n_chains, 0);
+  }
+  for (int t = 0; t < n_jobs; t++) {
+    const int *start = jobs[t].block_start, *width = jobs[t].block_width;
+    const int *offset = jobs[t].block_offset;
+    for (int k = 0; k < jobs[t].n_chains; k++) {
+      ChainRecord *chain = jobs[t].chains + k;
+      ChainBlock *block = chain->block;
+      size_t nelt = IntAE_get_nelt(block->offset);
+      IntAE_set_nelt(block->ranges->a, nelt + chain->n_blocks);
+      IntAE_set_nelt(block->ranges->b, nelt + chain->n_blocks);
+      IntAE_set_nelt(block->offset, nelt + chain->n_blocks);
+      memcpy(block->ranges->a->elts + nelt, start,
+             chain->n_blocks * sizeof(int));
+      memcpy(block->ranges->b->elts + nelt, width,
+             chain->n_blocks * sizeof(int));
+      memcpy(block->offset->elts + nelt, offset,
+             chain->n_blocks * sizeof(int));
+      start += chain->n_blocks;
+      width += chain->n_blocks;
+      offset += chain->n_blocks;
+      IntAE_insert_at(block->score, IntAE_get_nelt(block->score),
+                      chain->score);
+      IntAE_insert_at(block->length, IntAE_get_nelt(block->length),
+                      chain->n_blocks);
+      CharAE_insert_at(block->rev, CharAE_get_nelt(block->rev), chain->rev);
+      memcpy(name, chain->qname, chain->qname_len);
+      name[chain->qname_len] = '\0';
+      CharAEAE_append_string(block->space, name);
     }
   }
+  free_chain_jobs(jobs, n_jobs);
+  free_chain_text(&text);
+
   result = (ChainBlock **)S_alloc(hashNumEntries(hash), sizeof(ChainBlock *));
-  hash_elements = hashElListHash(hash);
   for (struct hashEl *h = hash_elements; h; h = h->next, i++) {
     result[i] = h->val;
   }
@@ -136,22 +428,20 @@ ChainBlock **read_chain_file(FILE *stream, const char *exclude, int *nblocks) {
 }
 
 /* parse the chain file format from UCSC for representing alignments */
-SEXP readChain(SEXP r_path, SEXP r_exclude) {
+SEXP readChain(SEXP r_path, SEXP r_exclude, SEXP r_threads) {
   const char *path, *exclude;
-  FILE *stream;
   SEXP ans, ans_names, ans_listData, chain_class, chainBlock_class;
   ChainBlock **chains;
   int i, nblocks;
 
   path = translateChar(STRING_ELT(r_path, 0));
-  if ((stream = fopen(path, "r")) == NULL)
-    error("cannot open file '%s'", path);
-  exclude = r_exclude == R_NilValue ? NULL : CHAR(STRING_ELT(r_exclude, 0));
-  chains = read_chain_file(stream, exclude, &nblocks);
+  exclude = length(r_exclude) == 0 ? NULL : CHAR(STRING_ELT(r_exclude, 0));
+  chains = read_chain_file(path, exclude, clampThreads(asInteger(r_threads)),
+                           &nblocks);
 
   PROTECT(chain_class = MAKE_CLASS("Chain"));
   PROTECT(chainBlock_class = MAKE_CLASS("ChainBlock"));
-  
+
   PROTECT(ans = NEW_OBJECT(chain_class));
   ans_listData = allocVector(VECSXP, nblocks);
   SET_SLOT(ans, install("listData"), ans_listData);
@@ -0,0 +1,320 @@
+#include "ucsc/common.h"
+#include <limits.h>
+
+#include "liftOver.h"
+#include "chainIndex.h"
+#include "utils.h"
+
+/* Chains are binned like the UCSC browser bins its features: a chain
+   goes in the smallest bin that holds its whole target span, and a
+   range looks in every bin it touches, on each level. The top level
+   has a single bin. */
+static const int binShifts[CHAIN_INDEX_LEVELS] = {17, 20, 23, 26, 29, 31};
+
+static int chainLevel(int start, int end) {
+  int l = 0;
+  while (((start - 1) >> binShifts[l]) != ((end - 1) >> binShifts[l]))
+    l++;
+  return l;
+}
+
+/* Indexes the ChainBlock 'r_block'. The arrays come from R_alloc(), so
+   this runs on the R thread. */
+void ChainIndex_build(ChainIndex *index, SEXP r_block, int chain_base) {
+  SEXP r_ranges = GET_SLOT(r_block, install("ranges"));
+  SEXP r_length = GET_SLOT(r_block, install("length"));
+  int n_chains = length(r_length), n_blocks = get_IRanges_length(r_ranges);
+  const int *chain_length = INTEGER(r_length);
+  const int *start, *width;
+  int max_end = 1, n_bins = 0;
+
+  index->n_blocks = n_blocks;
+  index->n_chains = n_chains;
+  index->start = start = INTEGER(get_IRanges_start(r_ranges));
+  index->width = width = INTEGER(get_IRanges_width(r_ranges));
+  index->offset = INTEGER(GET_SLOT(r_block, install("offset")));
+  index->rev = LOGICAL(GET_SLOT(r_block, install("reversed")));
+  index->chain_base = chain_base;
+  if (length(GET_SLOT(r_block, install("offset"))) != n_blocks ||
+      length(GET_SLOT(r_block, install("reversed"))) != n_chains)
+    error("malformed ChainBlock: slot lengths differ");
+
+  index->chain_first = (int *) R_alloc(n_chains + 1, sizeof(int));
+  index->chain_start = (int *) R_alloc(n_chains, sizeof(int));
+  index->chain_end = (int *) R_alloc(n_chains, sizeof(int));
+  index->chain_sorted = R_alloc(n_chains, sizeof(char));
+  int j = 0;
+  for (int c = 0; c < n_chains; c++) {
+    int first = j, lo = INT_MAX, hi = 0;
+    char sorted = TRUE;
+    if (chain_length[c] < 0 || chain_length[c] > n_blocks - j)
+      error("malformed ChainBlock: chain lengths do not add up to the "
+            "blocks");
+    index->chain_first[c] = first;
+    for (j = first; j < first + chain_length[c]; j++) {
+      int end = start[j] + width[j] - 1;
+      if (j > first && start[j] <= start[j - 1] + width[j - 1] - 1)
+        sorted = FALSE;
+      lo = min(lo, start[j]);
+      hi = max(hi, end);
+    }
+    /* an empty chain spans nothing and is never looked at */
+    index->chain_start[c] = hi ? max(lo, 1) : 1;
+    index->chain_end[c] = hi;
+    index->chain_sorted[c] = sorted;
+    max_end = max(max_end, hi);
+  }
+  if (j != n_blocks)
+    error("malformed ChainBlock: chain lengths do not add up to the blocks");
+  index->chain_first[n_chains] = n_blocks;
+
+  for (int l = 0; l < CHAIN_INDEX_LEVELS; l++) {
+    index->level_first[l] = n_bins;
+    n_bins += ((max_end - 1) >> binShifts[l]) + 1;
+  }
+  index->level_first[CHAIN_INDEX_LEVELS] = n_bins;
+
+  /* counting sort of the chains by bin, in chain order within a bin */
+  int *bin_of = (int *) R_alloc(n_chains, sizeof(int));
+  index->bin_first = (int *) R_alloc(n_bins + 1, sizeof(int));
+  index->bin_chains = (int *) R_alloc(n_chains, sizeof(int));
+  memset(index->bin_first, 0, (n_bins + 1) * sizeof(int));
+  for (int c = 0; c < n_chains; c++) {
+    int lo = index->chain_start[c], hi = max(lo, index->chain_end[c]);
+    int l = chainLevel(lo, hi);
+    bin_of[c] = index->level_first[l] + ((lo - 1) >> binShifts[l]);
+    index->bin_first[bin_of[c] + 1]++;
+  }
+  for (int b = 0; b < n_bins; b++)
+    index->bin_first[b + 1] += index->bin_first[b];
+  int *fill = (int *) R_alloc(n_bins, sizeof(int));
+  memcpy(fill, index->bin_first, n_bins * sizeof(int));
+  for (int c = 0; c < n_chains; c++)
+    index->bin_chains[fill[bin_of[c]]++] = c;
+}
+
+/* Finds the blocks of chain 'c' that range ['start', 'end'] hits, and
+   stores them in 'hits' unless it is NULL. A zero-width range, with
+   'end' one less than 'start', hits a block only when the block holds
+   the bases on both sides of it, as with findOverlaps(): one at the
+   edge of a block, even next to another block, hits nothing. */
+static int chainHits(const ChainIndex *index, int c, int start, int end,
+                     int *hits) {
+  const int *bstart = index->start, *bwidth = index->width;
+  int j = index->chain_first[c], last = index->chain_first[c + 1], n = 0;
+  char sorted = index->chain_sorted[c];
+  if (sorted) {
+    /* the first block ending at or after 'start' */
+    int a = j, b = last;
+    while (a < b) {
+      int m = a + (b - a) / 2;
+      if (bstart[m] + bwidth[m] - 1 < start)
+        a = m + 1;
+      else b = m;
+    }
+    j = a;
+  }
+  for (; j < last; j++) {
+    int bs = bstart[j], be = bs + bwidth[j] - 1;
+    if (bs > end) {
+      if (sorted)
+        break;
+      continue;
+    }
+    if (be < start)
+      continue;
+    if (hits)
+      hits[n] = j;
+    n++;
+  }
+  return n;
+}
+
+static int findBlocks(const ChainIndex *index, int start, int width,
+                      int *hits) {
+  int end = start + width - 1, n = 0;
+  int lo = min(start, end), hi = max(start, end);
+  if (lo < 1 && (width == 0 || hi < 1))
+    return 0;
+  lo = max(lo, 1);
+  for (int l = 0; l < CHAIN_INDEX_LEVELS; l++) {
+    int first_bin = index->level_first[l];
+    int last_bin = index->level_first[l + 1] - 1;
+    int b1 = min(first_bin + ((hi - 1) >> binShifts[l]), last_bin);
+    for (int b = first_bin + ((lo - 1) >> binShifts[l]); b <= b1; b++)
+      for (int k = index->bin_first[b]; k < index->bin_first[b + 1]; k++) {
+        int c = index->bin_chains[k];
+        if (index->chain_start[c] <= hi && index->chain_end[c] >= lo)
+          n += chainHits(index, c, start, end, hits ? hits + n : NULL);
+      }
+  }
+  return n;
+}
+
+static int compareInts(const void *a, const void *b) {
+  int x = *(const int *) a, y = *(const int *) b;
+  return (x > y) - (x < y);
+}
+
+/* The bins come in level order, not block order */
+static void sortHits(int *hits, int n) {
+  if (n > 16) {
+    qsort(hits, n, sizeof(int), compareInts);
+    return;
+  }
+  for (int i = 1; i < n; i++) {
+    int h = hits[i], k = i;
+    for (; k > 0 && hits[k - 1] > h; k--)
+      hits[k] = hits[k - 1];
+    hits[k] = h;
+  }
+}
+
+struct liftJob
+{
+  const ChainIndex *indexes;
+  const int *elt, *start, *width;   /* of each range */
+  const int *order;                 /* ranges, by ChainBlock */
+  int first, last;                  /* part of 'order' for this job */
+  int *count;                       /* hits of each range */
+  const int *pos;                   /* first hit of each range, or NULL */
+  int *ans_query, *ans_chain, *ans_start, *ans_width, *ans_rev;
+};
+
+/* Counts the hits of each range when 'pos' is NULL, lifts them
+   otherwise */
+static void *liftRanges(void *arg) {
+  struct liftJob *job = arg;
+  for (int i = job->first; i < job->last; i++) {
+    int q = job->order[i];
+    const ChainIndex *index = job->indexes + job->elt[q] - 1;
+    if (!job->pos) {
+      job->count[q] = findBlocks(index, job->start[q], job->width[q], NULL);
+      continue;
+    }
+    int n = job->count[q], p = job->pos[q];
+    int *hits = job->ans_start + p;
+    if (n == 0)
+      continue;
+    findBlocks(index, job->start[q], job->width[q], hits);
+    sortHits(hits, n);
+    int start = job->start[q], end = start + job->width[q] - 1;
+    for (int k = p; k < p + n; k++) {
+      int j = hits[k - p], c;
+      int bs = index->start[j], be = bs + index->width[j] - 1;
+      int os = max(start, bs), oe = min(end, be);
+      if (start > end)
+        os = start, oe = end;
+      /* the chain holding block j */
+      int a = 0, b = index->n_chains - 1;
+      while (a < b) {
+        int m = a + (b - a + 1) / 2;
+        if (index->chain_first[m] <= j)
+          a = m;
+        else b = m - 1;
+      }
+      c = a;
+      job->ans_query[k] = q + 1;
+      job->ans_chain[k] = index->chain_base + c + 1;
+      job->ans_rev[k] = index->rev[c];
+      job->ans_width[k] = oe - os + 1;
+      job->ans_start[k] = (index->rev[c] ? bs + be - oe : os) -
+        index->offset[j];
+    }
+  }
+  return NULL;
+}
+
+/* .Call entry point */
+/* Lifts the ranges 'r_start', 'r_width' over the list of ChainBlock
+   'r_blocks'. 'r_elt' gives the ChainBlock of each range, NA for none.
+   The blocks are indexed unless 'r_index', the index loaded with the
+   Chain, still holds them. Returns the range, chain, start, width and
+   reversal of each lifted piece, ordered by range and then block. */
+SEXP Chain_liftOver(SEXP r_blocks, SEXP r_elt, SEXP r_start, SEXP r_width,
+                    SEXP r_threads, SEXP r_index) {
+  int n_elts = length(r_blocks), n = length(r_elt);
+  int threads = clampThreads(asInteger(r_threads));
+  const int *elt = INTEGER(r_elt);
+  ChainIndex *indexes = (ChainIndex *) R_alloc(n_elts, sizeof(ChainIndex));
+  int chain_base = 0;
+
+  /* the ranges by ChainBlock, so a job works on few indexes */
+  int *elt_first = (int *) R_alloc(n_elts + 1, sizeof(int));
+  memset(elt_first, 0, (n_elts + 1) * sizeof(int));
+  for (int q = 0; q < n; q++) {
+    if (elt[q] == NA_INTEGER)
+      continue;
+    if (elt[q] < 1 || elt[q] > n_elts)
+      error("ChainBlock index out of bounds");
+    elt_first[elt[q]]++;
+  }
+  for (int e = 0; e < n_elts; e++)
+    elt_first[e + 1] += elt_first[e];
+  int n_order = elt_first[n_elts];
+  int *order = (int *) R_alloc(n_order, sizeof(int));
+  int *fill = (int *) R_alloc(n_elts, sizeof(int));
+  memcpy(fill, elt_first, n_elts * sizeof(int));
+  for (int q = 0; q < n; q++)
+    if (elt[q] != NA_INTEGER)
+      order[fill[elt[q] - 1]++] = q;
+
+  for (int e = 0; e < n_elts; e++) {
+    SEXP r_block = VECTOR_ELT(r_blocks, e);
+    if (elt_first[e + 1] > elt_first[e] &&
+        !ChainIndex_find(r_index, r_block, chain_base, indexes + e))
+      ChainIndex_build(indexes + e, r_block, chain_base);
+    chain_base += length(GET_SLOT(r_block, install("length")));
+  }
+
+  /* the indexes are read only, so the jobs split the ranges evenly */
+  threads = max(1, min(threads, n_order));
+  struct liftJob *jobs =
+    (struct liftJob *) R_alloc(threads, sizeof(struct liftJob));
+  int *count = (int *) R_alloc(n, sizeof(int));
+  memset(count, 0, n * sizeof(int));
+  for (int t = 0; t < threads; t++) {
+    struct liftJob *job = jobs + t;
+    memset(job, 0, sizeof(struct liftJob));
+    job->indexes = indexes;
+    job->elt = elt;
+    job->start = INTEGER(r_start);
+    job->width = INTEGER(r_width);
+    job->order = order;
+    job->first = (int) ((double) n_order * t / threads);
+    job->last = (int) ((double) n_order * (t + 1) / threads);
+    job->count = count;
+  }
+  runJobs(liftRanges, jobs, sizeof(struct liftJob), threads);
+
+  int *pos = (int *) R_alloc(n, sizeof(int));
+  double total = 0;
+  for (int q = 0; q < n; q++) {
+    pos[q] = total;
+    total += count[q];
+    if (total > INT_MAX)
+      error("too many lifted ranges");
+  }
+
+  SEXP ans, ans_names;
+  PROTECT(ans = allocVector(VECSXP, 5));
+  const char *names[] = { "query", "chain", "start", "width", "reversed" };
+  ans_names = allocVector(STRSXP, 5);
+  SET_NAMES(ans, ans_names);
+  for (int i = 0; i < 5; i++) {
+    SET_STRING_ELT(ans_names, i, mkChar(names[i]));
+    SET_VECTOR_ELT(ans, i, allocVector(i == 4 ? LGLSXP : INTSXP, total));
+  }
+  for (int t = 0; t < threads; t++) {
+    jobs[t].pos = pos;
+    jobs[t].ans_query = INTEGER(VECTOR_ELT(ans, 0));
+    jobs[t].ans_chain = INTEGER(VECTOR_ELT(ans, 1));
+    jobs[t].ans_start = INTEGER(VECTOR_ELT(ans, 2));
+    jobs[t].ans_width = INTEGER(VECTOR_ELT(ans, 3));
+    jobs[t].ans_rev = LOGICAL(VECTOR_ELT(ans, 4));
+  }
+  runJobs(liftRanges, jobs, sizeof(struct liftJob), threads);
+
+  UNPROTECT(1);
+  return ans;
+}
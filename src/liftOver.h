@@ -0,0 +1,31 @@
+#ifndef LIFT_OVER_H
+#define LIFT_OVER_H
+
+#include "rtracklayer.h"
+
+/* Levels of the chain bins, the last holding the chains that fit no
+   smaller bin */
+#define CHAIN_INDEX_LEVELS 6
+
+/* The search index over the blocks of one ChainBlock */
+typedef struct _ChainIndex {
+  int n_blocks, n_chains;
+  const int *start, *width, *offset; /* per block, from the ChainBlock */
+  const int *rev;                    /* per chain */
+  int *chain_first;         /* first block of each chain, and the end */
+  int *chain_start, *chain_end;      /* target span of each chain */
+  char *chain_sorted;       /* blocks of the chain ascend without overlap */
+  int level_first[CHAIN_INDEX_LEVELS + 1]; /* first bin of each level */
+  int *bin_first;           /* first entry of each bin in 'bin_chains' */
+  int *bin_chains;          /* chains, by bin */
+  int chain_base;           /* chains in the Chain before this ChainBlock */
+} ChainIndex;
+
+void ChainIndex_build(ChainIndex *index, SEXP r_block, int chain_base);
+
+/* The .Call entry point */
+
+SEXP Chain_liftOver(SEXP r_blocks, SEXP r_elt, SEXP r_start, SEXP r_width,
+                    SEXP r_threads, SEXP r_index);
+
+#endif
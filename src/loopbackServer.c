@@ -0,0 +1,425 @@
+/* A small HTTP/1.1 file server on 127.0.0.1, running on background
+   threads, so that the remote code paths (udc cache, range requests,
+   keep-alive, read-ahead) can be tested and benchmarked without a
+   network. It serves GET and HEAD with single byte ranges and
+   keep-alive, and can wait a fixed latency before each response and
+   limit the bandwidth of each connection. A path starting with
+   /redirect/ gets a 302 to the rest of the path. It counts what it
+   serves, to tell how many round trips and bytes a remote read
+   takes. One server per process. */
+
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+#include "loopbackServer.h"
+
+#ifndef WIN32
+
+#define MAX_CONNECTIONS 256
+#define MAX_REQUEST_SIZE 8192
+#define BODY_CHUNK_SIZE 65536
+#define REDIRECT_PREFIX "/redirect/"
+
+struct loopbackServer {
+  int sd;                       /* listening socket */
+  int port;
+  char *root;                   /* directory files are served from */
+  int latencyMs;                /* wait before each response */
+  double bandwidth;             /* body bytes/s per connection, 0 if unlimited */
+  pthread_t acceptThread;
+  volatile int stopping;
+  pthread_mutex_t mutex;        /* protects conns and the counters */
+  int conns[MAX_CONNECTIONS];   /* open client sockets, -1 if free */
+  double connections, requests, redirects, bytesSent;
+};
+
+static struct loopbackServer *server = NULL;
+
+static int sendAll(int sd, const char *buf, size_t size) {
+  while (size > 0) {
+#ifdef MSG_NOSIGNAL
+    ssize_t wr = send(sd, buf, size, MSG_NOSIGNAL);
+#else
+    ssize_t wr = write(sd, buf, size);
+#endif
+    if (wr <= 0)
+      return 0;
+    buf += wr;
+    size -= wr;
+  }
+  return 1;
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void count(struct loopbackServer *srv, int requests, int redirects,
+                  double bytes)
+{
+  pthread_mutex_lock(&srv->mutex);
+  srv->requests += requests;
+  srv->redirects += redirects;
+  srv->bytesSent += bytes;
+  pthread_mutex_unlock(&srv->mutex);
+}
+
+static int registerConnection(struct loopbackServer *srv, int sd) {
+  int ok = 0;
+  pthread_mutex_lock(&srv->mutex);
+  for (int i = 0; i < MAX_CONNECTIONS && !ok; i++)
+    if (srv->conns[i] < 0) {
+      srv->conns[i] = sd;
+      ok = 1;
+    }
+  srv->connections += ok;
+  pthread_mutex_unlock(&srv->mutex);
+  return ok;
+}
+
+static void unregisterConnection(struct loopbackServer *srv, int sd) {
+  pthread_mutex_lock(&srv->mutex);
+  for (int i = 0; i < MAX_CONNECTIONS; i++)
+    if (srv->conns[i] == sd)
+      srv->conns[i] = -1;
+  pthread_mutex_unlock(&srv->mutex);
+}
+
+static int sendStatus(int sd, int status, const char *reason, int keepAlive) {
+  char header[256];
+  int n = snprintf(header, sizeof(header),
+                   "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n"
+                   "Connection: %s\r\n\r\n",
+                   status, reason, keepAlive ? "keep-alive" : "close");
+  return sendAll(sd, header, n);
+}
+
+static int sendRedirect(struct loopbackServer *srv, int sd, const char *path,
+                        int keepAlive)
+{
+  char header[4352];
+  int n = snprintf(header, sizeof(header),
+                   "HTTP/1.1 302 Found\r\nLocation: http://127.0.0.1:%d/%s\r\n"
+                   "Content-Length: 0\r\nConnection: %s\r\n\r\n",
+                   srv->port, path, keepAlive ? "keep-alive" : "close");
+  return sendAll(sd, header, n);
+}
+
+/* Sends size bytes of fd from start, no faster than the bandwidth */
+static int sendBody(struct loopbackServer *srv, int sd, int fd,
+                    long long start, long long size)
+{
+  long long chunkSize = BODY_CHUNK_SIZE;
+  if (srv->bandwidth > 0 && srv->bandwidth / 50 < chunkSize)
+    chunkSize = srv->bandwidth / 50 > 1024 ? srv->bandwidth / 50 : 1024;
+  char *buf = malloc(chunkSize);
+  double began = now();
+  long long sent = 0;
+  int ok = 1;
+  while (ok && sent < size) {
+    long long want = size - sent;
+    if (want > chunkSize)
+      want = chunkSize;
+    ssize_t rd = pread(fd, buf, want, start + sent);
+    ok = rd > 0 && sendAll(sd, buf, rd);
+    if (!ok)
+      break;
+    sent += rd;
+    if (srv->bandwidth > 0) {
+      double ahead = sent / srv->bandwidth - (now() - began);
+      if (ahead > 0)
+        usleep(ahead * 1e6);
+    }
+  }
+  free(buf);
+  return ok;
+}
+
+/* Answers one request; returns 0 if the connection should be closed */
+static int respond(struct loopbackServer *srv, int sd, const char *method,
+                   char *path, const char *range, int keepAlive)
+{
+  char *query = strpbrk(path, "?#");
+  if (query != NULL)
+    *query = '\0';
+  if (!strncmp(path, REDIRECT_PREFIX, strlen(REDIRECT_PREFIX))) {
+    count(srv, 1, 1, 0);
+    return sendRedirect(srv, sd, path + strlen(REDIRECT_PREFIX), keepAlive) &&
+      keepAlive;
+  }
+  count(srv, 1, 0, 0);
+  if (strcmp(method, "GET") && strcmp(method, "HEAD"))
+    return sendStatus(sd, 405, "Method Not Allowed", keepAlive) && keepAlive;
+  if (path[0] != '/' || strstr(path, "..") != NULL)
+    return sendStatus(sd, 403, "Forbidden", keepAlive) && keepAlive;
+
+  size_t fileNameSize = strlen(srv->root) + strlen(path) + 1;
+  char *fileName = malloc(fileNameSize);
+  snprintf(fileName, fileNameSize, "%s%s", srv->root, path);
+  int fd = open(fileName, O_RDONLY);
+  free(fileName);
+  struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+    if (fd >= 0)
+      close(fd);
+    return sendStatus(sd, 404, "Not Found", keepAlive) && keepAlive;
+  }
+
+  long long size = status.st_size, start = 0, end = size - 1;
+  int partial = 0;
+  if (range != NULL && sscanf(range, "bytes=%lld-", &start) == 1) {
+    const char *dash = strchr(range, '-');
+    if (dash[1] != '\0' && dash[1] != ',')
+      end = atoll(dash + 1);
+    if (end > size - 1)
+      end = size - 1;
+    if (start >= size || start > end) {
+      close(fd);
+      return sendStatus(sd, 416, "Range Not Satisfiable", keepAlive) &&
+        keepAlive;
+    }
+    partial = 1;
+  }
+
+  char lastModified[64];
+  struct tm tm;
+  strftime(lastModified, sizeof(lastModified), "%a, %d %b %Y %H:%M:%S GMT",
+           gmtime_r(&status.st_mtime, &tm));
+  char header[512];
+  int n = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\n"
+                   "Content-Length: %lld\r\nLast-Modified: %s\r\n"
+                   "Accept-Ranges: bytes\r\nConnection: %s\r\n",
+                   partial ? "206 Partial Content" : "200 OK",
+                   end - start + 1, lastModified,
+                   keepAlive ? "keep-alive" : "close");
+  if (partial)
+    n += snprintf(header + n, sizeof(header) - n,
+                  "Content-Range: bytes %lld-%lld/%lld\r\n", start, end, size);
+  n += snprintf(header + n, sizeof(header) - n, "\r\n");
+  int ok = sendAll(sd, header, n);
+
+  if (ok && !strcmp(method, "GET")) {
+    ok = sendBody(srv, sd, fd, start, end - start + 1);
+    if (ok)
+      count(srv, 0, 0, end - start + 1);
+  }
+  close(fd);
+  return ok && keepAlive;
+}
+
+static void *serveConnection(void *data) {
+  int sd = (int)(intptr_t)data;
+  struct loopbackServer *srv = server;
+  char req[MAX_REQUEST_SIZE];
+  int used = 0;
+  for (;;) {
+    char *headerEnd;
+    req[used] = '\0';
+    while ((headerEnd = strstr(req, "\r\n\r\n")) == NULL) {
+      if (used == MAX_REQUEST_SIZE - 1)
+        goto done;
+      ssize_t rd = read(sd, req + used, MAX_REQUEST_SIZE - 1 - used);
+      if (rd <= 0)
+        goto done;
+      used += rd;
+      req[used] = '\0';
+    }
+    *headerEnd = '\0';
+    int consumed = headerEnd + 4 - req;
+
+    /* request line, then the headers we need */
+    char method[16], path[4096], version[16];
+    if (sscanf(req, "%15s %4095s %15s", method, path, version) != 3)
+      goto done;
+    int keepAlive = !strcmp(version, "HTTP/1.1");
+    const char *range = NULL;
+    char *line = strstr(req, "\r\n");
+    while (line != NULL) {
+      line += 2;
+      char *next = strstr(line, "\r\n");
+      if (next != NULL)
+        *next = '\0';
+      if (!strncasecmp(line, "Range:", 6))
+        range = line + 6 + strspn(line + 6, " ");
+      else if (!strncasecmp(line, "Connection:", 11)) {
+        const char *value = line + 11 + strspn(line + 11, " ");
+        keepAlive = !strncasecmp(value, "keep-alive", 10);
+      }
+      line = next;
+    }
+
+    if (srv->latencyMs > 0)
+      usleep(srv->latencyMs * 1000);
+    if (!respond(srv, sd, method, path, range, keepAlive))
+      break;
+    memmove(req, req + consumed, used - consumed);
+    used -= consumed;
+  }
+ done:
+  unregisterConnection(srv, sd);
+  close(sd);
+  return NULL;
+}
+
+static void *acceptConnections(void *data) {
+  struct loopbackServer *srv = data;
+  while (!srv->stopping) {
+    int sd = accept(srv->sd, NULL, NULL);
+    if (sd < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    int one = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_t thread;
+    if (srv->stopping || !registerConnection(srv, sd)) {
+      close(sd);
+      continue;
+    }
+    if (pthread_create(&thread, NULL, serveConnection,
+                       (void *)(intptr_t)sd) != 0) {
+      unregisterConnection(srv, sd);
+      close(sd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+static void freeServer(struct loopbackServer *srv) {
+  pthread_mutex_destroy(&srv->mutex);
+  free(srv->root);
+  free(srv);
+}
+
+#endif
+
+/* --- .Call ENTRY POINT --- */
+SEXP LoopbackServer_start(SEXP r_root, SEXP r_latency, SEXP r_bandwidth) {
+#ifdef WIN32
+  error("the loopback server is not supported on Windows");
+  return R_NilValue;
+#else
+  if (server != NULL)
+    error("a loopback server is already running on port %d", server->port);
+  struct loopbackServer *srv = calloc(1, sizeof(*srv));
+  srv->root = strdup(CHAR(asChar(r_root)));
+  srv->latencyMs = (int)(asReal(r_latency) * 1000);
+  srv->bandwidth = R_FINITE(asReal(r_bandwidth)) ? asReal(r_bandwidth) : 0;
+  pthread_mutex_init(&srv->mutex, NULL);
+  for (int i = 0; i < MAX_CONNECTIONS; i++)
+    srv->conns[i] = -1;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addrLen = sizeof(addr);
+  int one = 1;
+  srv->sd = socket(AF_INET, SOCK_STREAM, 0);
+  if (srv->sd < 0 ||
+      setsockopt(srv->sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(srv->sd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(srv->sd, 64) != 0 ||
+      getsockname(srv->sd, (struct sockaddr *)&addr, &addrLen) != 0)
+  {
+    int err = errno;
+    if (srv->sd >= 0)
+      close(srv->sd);
+    freeServer(srv);
+    error("cannot listen on the loopback interface: %s", strerror(err));
+  }
+  srv->port = ntohs(addr.sin_port);
+  server = srv;
+  if (pthread_create(&srv->acceptThread, NULL, acceptConnections, srv) != 0) {
+    server = NULL;
+    close(srv->sd);
+    freeServer(srv);
+    error("cannot start the loopback server thread");
+  }
+  return ScalarInteger(srv->port);
+#endif
+}
+
+/* --- .Call ENTRY POINT ---
+ * What the server answered since it started or was last reset: client
+ * connections, requests (redirects included) and body bytes sent.
+ */
+SEXP LoopbackServer_stats(SEXP r_reset) {
+  static const char *names[] = {
+    "connections", "requests", "redirects", "bytes"
+  };
+  SEXP ans = PROTECT(allocVector(REALSXP, 4));
+  SEXP ans_names = allocVector(STRSXP, 4);
+  setAttrib(ans, R_NamesSymbol, ans_names);
+  for (int i = 0; i < 4; i++)
+    SET_STRING_ELT(ans_names, i, mkChar(names[i]));
+  memset(REAL(ans), 0, 4 * sizeof(double));
+#ifndef WIN32
+  struct loopbackServer *srv = server;
+  if (srv != NULL) {
+    pthread_mutex_lock(&srv->mutex);
+    REAL(ans)[0] = srv->connections;
+    REAL(ans)[1] = srv->requests;
+    REAL(ans)[2] = srv->redirects;
+    REAL(ans)[3] = srv->bytesSent;
+    if (asLogical(r_reset))
+      srv->connections = srv->requests = srv->redirects = srv->bytesSent = 0;
+    pthread_mutex_unlock(&srv->mutex);
+  }
+#endif
+  UNPROTECT(1);
+  return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP LoopbackServer_stop(void) {
+#ifndef WIN32
+  struct loopbackServer *srv = server;
+  if (srv == NULL)
+    return ScalarLogical(FALSE);
+  srv->stopping = 1;
+  shutdown(srv->sd, SHUT_RDWR);
+  close(srv->sd);
+  pthread_join(srv->acceptThread, NULL);
+
+  /* wake up the connection threads and wait until they are gone */
+  int open;
+  do {
+    open = 0;
+    pthread_mutex_lock(&srv->mutex);
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+      if (srv->conns[i] >= 0) {
+        shutdown(srv->conns[i], SHUT_RDWR);
+        open++;
+      }
+    pthread_mutex_unlock(&srv->mutex);
+    if (open > 0)
+      usleep(1000);
+  } while (open > 0);
+  server = NULL;
+  freeServer(srv);
+#endif
+  return ScalarLogical(TRUE);
+}
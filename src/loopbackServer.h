@@ -0,0 +1,12 @@
+#ifndef LOOPBACK_SERVER_H
+#define LOOPBACK_SERVER_H
+
+#include "rtracklayer.h"
+
+/* The .Call entry points */
+
+SEXP LoopbackServer_start(SEXP r_root, SEXP r_latency, SEXP r_bandwidth);
+SEXP LoopbackServer_stats(SEXP r_reset);
+SEXP LoopbackServer_stop(void);
+
+#endif
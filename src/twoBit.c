@@ -1,9 +1,13 @@
 #include "ucsc/common.h"
 #include "ucsc/dnaseq.h"
 #include "ucsc/twoBit.h"
+#include "ucsc/hash.h"
+#include "ucsc/errCatch.h"
+#include <zlib.h>
 
 #include "twoBit.h"
 #include "handlers.h"
+#include "utils.h"
 
 /* .Call entry point */
 SEXP DNAString_to_twoBit(SEXP r_dna, SEXP r_mask, SEXP r_seqname) {
@@ -61,6 +65,503 @@ SEXP TwoBits_write(SEXP r_twoBits, SEXP r_filename) {
   return R_NilValue;
 }
 
+/* Writing of a DNAStringSet as a 2bit file. The sequences are scanned
+   for blocks of N in slices, on several threads, so the index can be
+   written first. Each sequence is then packed a chunk at a time, each
+   chunk split over the threads, and written. Only the blocks of N and
+   one packed chunk are held in memory. Nothing run on the threads may
+   errAbort, so they only count blocks first, for the calling thread to
+   allocate room for them. */
+
+#define SCAN_SLICE (16 * 1024 * 1024)   /* Bases scanned by a job at once */
+#define PACK_CHUNK (64 * 1024 * 1024)   /* Bases packed at once, by 4 */
+#define MIN_PACK_PART (1024 * 1024)     /* Fewest bases packed by a job */
+
+struct nScanSlice
+{
+  const unsigned char *seq;     /* Whole sequence */
+  int seq_size, start, end;     /* Blocks starting in [start, end) */
+  bits32 count;                 /* Blocks found */
+  bits32 *starts, *sizes;       /* Where to store them, NULL to count */
+};
+
+struct nScanJob
+{
+  struct nScanSlice *slices;
+  int n_slices, first, step;
+  const char *isN;
+};
+
+static void *nScanSlices(void *arg)
+{
+  struct nScanJob *job = arg;
+  const char *isN = job->isN;
+  for (int k = job->first; k < job->n_slices; k += job->step) {
+    struct nScanSlice *slice = job->slices + k;
+    const unsigned char *seq = slice->seq;
+    bits32 count = 0;
+    int i = slice->start;
+    /* a block going on from the slice before is that slice's */
+    while (i < slice->end && i > 0 && isN[seq[i - 1]] && isN[seq[i]])
+      i++;
+    while (i < slice->end) {
+      if (!isN[seq[i]]) {
+        i++;
+        continue;
+      }
+      int start = i;
+      while (i < slice->seq_size && isN[seq[i]])
+        i++;
+      if (slice->starts != NULL) {
+        slice->starts[count] = start;
+        slice->sizes[count] = i - start;
+      }
+      count++;
+    }
+    slice->count = count;
+  }
+  return NULL;
+}
+
+struct packJob
+{
+  const unsigned char *seq;
+  int start, end;               /* Bases to pack, start by 4 */
+  UBYTE *out;                   /* Where to pack them */
+  const UBYTE *val;             /* 2bit value of each byte of seq */
+};
+
+static void *packBases(void *arg)
+{
+  struct packJob *job = arg;
+  const unsigned char *seq = job->seq;
+  const UBYTE *val = job->val;
+  UBYTE *out = job->out;
+  int i = job->start, end4 = job->end - ((job->end - job->start) & 3);
+  for (; i < end4; i += 4)
+    *out++ = (val[seq[i]] << 6) | (val[seq[i + 1]] << 4) |
+      (val[seq[i + 2]] << 2) | val[seq[i + 3]];
+  if (i < job->end) {
+    /* the last few bases, padded with T like twoBitFromDnaSeq() */
+    UBYTE b = 0;
+    for (int k = 0; i < job->end; i++, k++)
+      b |= val[seq[i]] << (6 - k - k);
+    *out = b;
+  }
+  return NULL;
+}
+
+/* Packs the 'size' bases of 'seq' into 'out', split over at most
+   'threads' jobs */
+static void packBasesOnThreads(const unsigned char *seq, int size,
+                               const UBYTE *val, int threads, UBYTE *out)
+{
+  int part = max(MIN_PACK_PART, ((size + threads - 1) / threads + 3) & ~3);
+  struct packJob *jobs;
+  int n_parts = 0;
+  AllocArray(jobs, max(1, (size + part - 1) / part));
+  for (int s = 0; s < size; s += part, n_parts++) {
+    jobs[n_parts].seq = seq;
+    jobs[n_parts].start = s;
+    jobs[n_parts].end = min(size, s + part);
+    jobs[n_parts].out = out + s / 4;
+    jobs[n_parts].val = val;
+  }
+  runJobs(packBases, jobs, sizeof(struct packJob), n_parts);
+  freeMem(jobs);
+}
+
+/* .Call entry point */
+/* Writes the DNAStringSet 'r_seqs' to 'r_filename', using 'r_threads'
+   threads. 'lkup' converts the DNAString codes to letters. */
+SEXP TwoBitFile_write(SEXP r_filename, SEXP r_seqs, SEXP r_seqnames,
+                      SEXP r_threads, SEXP lkup) {
+  pushRHandlers();
+  dnaUtilOpen();
+  XVectorList_holder seqs_holder = hold_XVectorList(r_seqs);
+  int n_seqs = length(r_seqnames);
+  int threads = clampThreads(asInteger(r_threads));
+
+  /* the 2bit value and N-ness of each DNAString code */
+  UBYTE val[256];
+  char isN[256];
+  for (int c = 0; c < 256; c++) {
+    int letter = c < LENGTH(lkup) ? INTEGER(lkup)[c] : NA_INTEGER;
+    val[c] = letter == NA_INTEGER ? 0 : ntValNoN[letter];
+    isN[c] = letter == 'N';
+  }
+
+  const unsigned char **seqs =
+    (const unsigned char **) R_alloc(n_seqs, sizeof(unsigned char *));
+  int *sizes = (int *) R_alloc(n_seqs, sizeof(int));
+  int n_slices = 0;
+  for (int i = 0; i < n_seqs; i++) {
+    Chars_holder seq = get_elt_from_XRawList_holder(&seqs_holder, i);
+    seqs[i] = (const unsigned char *) seq.ptr;
+    sizes[i] = seq.length;
+    n_slices += (seq.length + SCAN_SLICE - 1) / SCAN_SLICE;
+  }
+
+  /* find the blocks of N: count them, then store them */
+  struct nScanSlice *slices =
+    (struct nScanSlice *) R_alloc(n_slices, sizeof(struct nScanSlice));
+  int *first_slice = (int *) R_alloc(n_seqs + 1, sizeof(int));
+  int k = 0;
+  for (int i = 0; i < n_seqs; i++) {
+    first_slice[i] = k;
+    for (int start = 0; start < sizes[i]; start += SCAN_SLICE, k++) {
+      slices[k].seq = seqs[i];
+      slices[k].seq_size = sizes[i];
+      slices[k].start = start;
+      slices[k].end = min(sizes[i], start + SCAN_SLICE);
+      slices[k].starts = slices[k].sizes = NULL;
+    }
+  }
+  first_slice[n_seqs] = k;
+  int n_jobs = min(threads, n_slices);
+  struct nScanJob *scan_jobs =
+    (struct nScanJob *) R_alloc(max(1, n_jobs), sizeof(struct nScanJob));
+  for (int j = 0; j < n_jobs; j++) {
+    scan_jobs[j].slices = slices;
+    scan_jobs[j].n_slices = n_slices;
+    scan_jobs[j].first = j;
+    scan_jobs[j].step = n_jobs;
+    scan_jobs[j].isN = isN;
+  }
+  runJobs(nScanSlices, scan_jobs, sizeof(struct nScanJob), n_jobs);
+  bits32 *n_counts = (bits32 *) R_alloc(n_seqs, sizeof(bits32));
+  bits32 **n_starts = (bits32 **) R_alloc(n_seqs, sizeof(bits32 *));
+  bits32 **n_sizes = (bits32 **) R_alloc(n_seqs, sizeof(bits32 *));
+  bits64 *record_sizes = (bits64 *) R_alloc(n_seqs, sizeof(bits64));
+  for (int i = 0; i < n_seqs; i++) {
+    bits32 count = 0;
+    for (k = first_slice[i]; k < first_slice[i + 1]; k++)
+      count += slices[k].count;
+    n_counts[i] = count;
+    n_starts[i] = (bits32 *) R_alloc(count, sizeof(bits32));
+    n_sizes[i] = (bits32 *) R_alloc(count, sizeof(bits32));
+    count = 0;
+    for (k = first_slice[i]; k < first_slice[i + 1]; k++) {
+      slices[k].starts = n_starts[i] + count;
+      slices[k].sizes = n_sizes[i] + count;
+      count += slices[k].count;
+    }
+    record_sizes[i] = twoBitRecordSize(sizes[i], n_counts[i], 0);
+  }
+  runJobs(nScanSlices, scan_jobs, sizeof(struct nScanJob), n_jobs);
+
+  char **names = (char **) R_alloc(n_seqs, sizeof(char *));
+  for (int i = 0; i < n_seqs; i++)
+    names[i] = (char *) CHAR(STRING_ELT(r_seqnames, i));
+  FILE *file = mustOpen((char *)CHAR(asChar(r_filename)), "wb");
+  twoBitWriteIndex(file, n_seqs, names, record_sizes);
+
+  /* pack and write the sequences, a chunk at a time */
+  UBYTE *packed = (UBYTE *) R_alloc(PACK_CHUNK / 4, sizeof(UBYTE));
+  for (int i = 0; i < n_seqs; i++) {
+    twoBitWriteRecordHead(file, sizes[i], n_counts[i], n_starts[i],
+                          n_sizes[i], 0, NULL, NULL);
+    for (int start = 0; start < sizes[i]; start += PACK_CHUNK) {
+      int end = min(sizes[i], start + PACK_CHUNK);
+      packBasesOnThreads(seqs[i] + start, end - start, val, threads, packed);
+      mustWrite(file, packed, (end - start + 3) / 4);
+    }
+  }
+  carefulClose(&file);
+  popRHandlers();
+
+  return R_NilValue;
+}
+
+/* Conversion of a FASTA file, gzipped or not, to 2bit in one pass over
+   it. The letters of a sequence are gathered a chunk at a time, noting
+   the blocks of N and of lower case as they go by, and each chunk is
+   packed on several threads and spooled to a temporary file. The index
+   and the blocks, only known at the end, are then written, each record
+   followed by its bases copied back from the spool. Only the blocks and
+   one chunk are held in memory. */
+
+#define FA_READ_SIZE (1024 * 1024)      /* Bytes of FASTA read at once */
+
+enum { FA_LETTER = 1, FA_N = 2, FA_LOWER = 4 };
+
+struct faBlocks
+{
+  bits32 count, alloc;
+  bits32 *starts, *sizes;
+};
+
+struct faRecord
+{
+  struct faRecord *next;
+  char *name;                   /* Owned by the hash of names */
+  bits64 size;
+  struct faBlocks n, mask;
+};
+
+struct faToTwoBit
+{
+  struct faRecord *records;     /* Last read first */
+  struct hash *names;
+  unsigned char *chunk;         /* Letters of the last record not yet packed */
+  int chunk_size;
+  UBYTE *packed;
+  gzFile in;                    /* The handles live here rather than in */
+  FILE *spool, *out;            /* locals, as they outlive an errCatch */
+  char *out_name;               /* Output being written, NULL once done */
+  int threads;
+  UBYTE val[256];               /* 2bit value of each letter */
+  char class[256];              /* FA_LETTER, FA_N and FA_LOWER of each byte */
+  bits64 n_start, mask_start;   /* Starts of the open blocks */
+  int in_n, in_mask;
+};
+
+static void faBlocksAdd(struct faBlocks *blocks, bits64 start, bits64 end)
+{
+  if (blocks->count == blocks->alloc) {
+    bits32 alloc = max(64, 2 * blocks->alloc);
+    ExpandArray(blocks->starts, blocks->alloc, alloc);
+    ExpandArray(blocks->sizes, blocks->alloc, alloc);
+    blocks->alloc = alloc;
+  }
+  blocks->starts[blocks->count] = start;
+  blocks->sizes[blocks->count] = end - start;
+  blocks->count++;
+}
+
+/* Packs the letters of the chunk and appends them to the spool */
+static void faPackChunk(struct faToTwoBit *fa)
+{
+  int size = fa->chunk_size;
+  packBasesOnThreads(fa->chunk, size, fa->val, fa->threads, fa->packed);
+  mustWrite(fa->spool, fa->packed, (size + 3) / 4);
+  fa->chunk_size = 0;
+}
+
+static void faEndRecord(struct faToTwoBit *fa)
+{
+  struct faRecord *record = fa->records;
+  if (record == NULL)
+    return;
+  if (fa->chunk_size > 0)
+    faPackChunk(fa);
+  if (fa->in_n)
+    faBlocksAdd(&record->n, fa->n_start, record->size);
+  if (fa->in_mask)
+    faBlocksAdd(&record->mask, fa->mask_start, record->size);
+  fa->in_n = fa->in_mask = 0;
+}
+
+static void faStartRecord(struct faToTwoBit *fa, char *header, char *path)
+{
+  char *name = header + strspn(header, " \t");
+  name[strcspn(name, " \t\r")] = '\0';
+  if (*name == '\0')
+    errAbort("sequence without a name in %s", path);
+  if (hashLookup(fa->names, name) != NULL)
+    errAbort("duplicate sequence name %s in %s", name, path);
+  faEndRecord(fa);
+  struct faRecord *record;
+  AllocVar(record);
+  record->name = hashAdd(fa->names, name, record)->name;
+  slAddHead(&fa->records, record);
+}
+
+/* Reads the FASTA records, spooling their bases */
+static void faToTwoBitRead(struct faToTwoBit *fa, gzFile in, char *path)
+{
+  unsigned char *buf = needLargeMem(FA_READ_SIZE);
+  struct dyString *header = dyStringNew(256);
+  int line_start = 1, in_header = 0, nread;
+  while ((nread = gzread(in, buf, FA_READ_SIZE)) > 0) {
+    unsigned char *p = buf, *end = buf + nread;
+    while (p < end) {
+      if (in_header) {
+        unsigned char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+          eol = end;
+        dyStringAppendN(header, (char *)p, eol - p);
+        p = eol;
+        if (p < end) {
+          p++;
+          in_header = 0;
+          line_start = 1;
+          faStartRecord(fa, header->string, path);
+        }
+        continue;
+      }
+      if (*p == '>' && line_start) {
+        p++;
+        in_header = 1;
+        dyStringClear(header);
+        continue;
+      }
+      /* the letters, up to the next header */
+      struct faRecord *record = fa->records;
+      for (; p < end; p++) {
+        unsigned char c = *p;
+        int class = fa->class[c];
+        if (!(class & FA_LETTER)) {
+          if (c == '>' && line_start)
+            break;
+          line_start = c == '\n';
+          continue;
+        }
+        line_start = 0;
+        if (record == NULL)
+          errAbort("%s does not start with a '>' line", path);
+        if (fa->chunk_size == PACK_CHUNK) {
+          if (record->size > UINT_MAX)
+            errAbort("sequence %s is too long for a 2bit file", record->name);
+          faPackChunk(fa);
+        }
+        fa->chunk[fa->chunk_size++] = c;
+        bits64 pos = record->size++;
+        int is_n = (class & FA_N) != 0, is_lower = (class & FA_LOWER) != 0;
+        if (is_n != fa->in_n) {
+          if (is_n)
+            fa->n_start = pos;
+          else
+            faBlocksAdd(&record->n, fa->n_start, pos);
+          fa->in_n = is_n;
+        }
+        if (is_lower != fa->in_mask) {
+          if (is_lower)
+            fa->mask_start = pos;
+          else
+            faBlocksAdd(&record->mask, fa->mask_start, pos);
+          fa->in_mask = is_lower;
+        }
+      }
+    }
+  }
+  if (nread < 0) {
+    int errnum;
+    errAbort("cannot read %s: %s", path, gzerror(in, &errnum));
+  }
+  if (in_header)
+    faStartRecord(fa, header->string, path);
+  if (fa->records != NULL && fa->records->size > UINT_MAX)
+    errAbort("sequence %s is too long for a 2bit file", fa->records->name);
+  faEndRecord(fa);
+  dyStringFree(&header);
+  freeMem(buf);
+}
+
+/* Writes the index and the records, copying the bases from the spool */
+static void faToTwoBitWrite(struct faToTwoBit *fa, FILE *file)
+{
+  slReverse(&fa->records);
+  int n_records = slCount(fa->records);
+  char **names;
+  bits64 *record_sizes;
+  AllocArray(names, max(1, n_records));
+  AllocArray(record_sizes, max(1, n_records));
+  int i = 0;
+  for (struct faRecord *record = fa->records; record != NULL;
+       record = record->next, i++) {
+    names[i] = record->name;
+    record_sizes[i] = twoBitRecordSize(record->size, record->n.count,
+                                       record->mask.count);
+  }
+  twoBitWriteIndex(file, n_records, names, record_sizes);
+  freeMem(names);
+  freeMem(record_sizes);
+
+  rewind(fa->spool);
+  for (struct faRecord *record = fa->records; record != NULL;
+       record = record->next) {
+    twoBitWriteRecordHead(file, record->size, record->n.count,
+                          record->n.starts, record->n.sizes,
+                          record->mask.count, record->mask.starts,
+                          record->mask.sizes);
+    for (bits64 left = (record->size + 3) / 4; left > 0;) {
+      size_t size = min(left, PACK_CHUNK / 4);
+      mustRead(fa->spool, fa->packed, size);
+      mustWrite(file, fa->packed, size);
+      left -= size;
+    }
+  }
+}
+
+static void faToTwoBitFree(struct faToTwoBit *fa)
+{
+  struct faRecord *record;
+  while ((record = slPopHead(&fa->records)) != NULL) {
+    freeMem(record->n.starts);
+    freeMem(record->n.sizes);
+    freeMem(record->mask.starts);
+    freeMem(record->mask.sizes);
+    freeMem(record);
+  }
+  hashFree(&fa->names);
+  freez(&fa->chunk);
+  freez(&fa->packed);
+}
+
+/* .Call entry point */
+/* Converts the FASTA file 'r_fasta', which may be gzipped, to the 2bit
+   file 'r_twobit', packing on 'r_threads' threads. The bases are spooled
+   to the file 'r_spool' on the way, which is left for the caller to
+   remove. */
+SEXP FastaFile_to_twoBit(SEXP r_fasta, SEXP r_twobit, SEXP r_spool,
+                         SEXP r_threads) {
+  pushRHandlers();
+  dnaUtilOpen();
+  char *fasta = (char *) CHAR(asChar(r_fasta));
+  struct faToTwoBit fa;
+  memset(&fa, 0, sizeof(fa));
+  fa.threads = clampThreads(asInteger(r_threads));
+  /* like faToTwoBit, letters other than A, C, G, T and U are N */
+  for (int c = 0; c < 256; c++) {
+    fa.val[c] = ntValNoN[c];
+    if (isalpha(c))
+      fa.class[c] = FA_LETTER | (ntVal[c] < 0 ? FA_N : 0) |
+        (islower(c) ? FA_LOWER : 0);
+  }
+  fa.names = hashNew(0);
+  fa.chunk = needLargeMem(PACK_CHUNK);
+  fa.packed = needLargeMem(PACK_CHUNK / 4);
+
+  char *twobit = (char *) CHAR(asChar(r_twobit));
+  struct errCatch *errCatch = errCatchNew();
+  if (errCatchStart(errCatch)) {
+    if ((fa.in = gzopen(fasta, "rb")) == NULL)
+      errAbort("cannot open %s", fasta);
+    gzbuffer(fa.in, FA_READ_SIZE);
+    fa.spool = mustOpen((char *) CHAR(asChar(r_spool)), "w+b");
+    faToTwoBitRead(&fa, fa.in, fasta);
+    fa.out = mustOpen(twobit, "wb");
+    fa.out_name = twobit;
+    faToTwoBitWrite(&fa, fa.out);
+    FILE *f = fa.out;
+    fa.out = NULL;
+    carefulClose(&f);
+    fa.out_name = NULL;
+  }
+  errCatchEnd(errCatch);
+  if (fa.in != NULL)
+    gzclose(fa.in);
+  if (fa.out != NULL)
+    fclose(fa.out);
+  if (fa.spool != NULL)
+    fclose(fa.spool);
+  /* no truncated 2bit file is left behind */
+  if (fa.out_name != NULL)
+    unlink(fa.out_name);
+  faToTwoBitFree(&fa);
+  if (errCatch->gotError) {
+    char message[1024];
+    safef(message, sizeof(message), "%s", errCatch->message->string);
+    errCatchFree(&errCatch);
+    errAbort("%s", message);
+  }
+  errCatchFree(&errCatch);
+  popRHandlers();
+
+  return R_NilValue;
+}
+
 /* .Call entry point */
 SEXP TwoBitFile_seqlengths(SEXP r_filename) {
   pushRHandlers();
@@ -85,7 +586,21 @@ SEXP TwoBitFile_seqlengths(SEXP r_filename) {
   return r_seqlengths;
 }
 
-SEXP TwoBitFile_read(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges, SEXP lkup)
+/* Codes of the DNAString encoding for the bases of a 2bit file, taken
+   from the 'lkup' table of the character conversion */
+static void twoBitCodesFromLkup(struct twoBitCodes *codes, SEXP lkup)
+{
+  char base[4];
+  for (int v = 0; v < 4; v++)
+    base[v] = INTEGER(lkup)[(unsigned char) valToNt[v]];
+  twoBitCodesInit(codes, base, INTEGER(lkup)['N']);
+}
+
+/* .Call entry point */
+/* Reads the ranges into a DNAStringSet, reverse complementing those with
+   'r_rc' TRUE ('r_rc' may be NULL) */
+SEXP TwoBitFile_read(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
+                     SEXP r_rc, SEXP lkup)
 {
   pushRHandlers();
   struct twoBitFile *file = twoBitOpen((char *)CHAR(asChar(r_filename)));
@@ -94,29 +609,110 @@ SEXP TwoBitFile_read(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges, SEXP lkup)
   int frag_count = get_IRanges_length(r_ranges);
   SEXP r_ans_width, r_ans;
   XVectorList_holder r_ans_holder;
+  struct twoBitCodes codes;
 
+  dnaUtilOpen();
+  twoBitCodesFromLkup(&codes, lkup);
   PROTECT(r_ans_width = duplicate(get_IRanges_width(r_ranges)));
   PROTECT(r_ans = alloc_XRawList("DNAStringSet", "DNAString", r_ans_width));
   r_ans_holder = hold_XVectorList(r_ans);
+  /* read in order of position in the file, each into its element */
+  struct twoBitFrag *frags =
+    (struct twoBitFrag *) R_alloc(frag_count, sizeof(struct twoBitFrag));
+  int n_frags = 0;
   for (int i = 0; i < frag_count; i++) {
     if (frag_width[i]) { // UCSC library does not like zero width ranges
-      struct dnaSeq *frag =
-        twoBitReadSeqFrag(file, (char *)CHAR(STRING_ELT(r_seqnames, i)),
-                          frag_start[i] - 1, frag_start[i] + frag_width[i] - 1);
       Chars_holder r_ans_elt_holder =
         get_elt_from_XRawList_holder(&r_ans_holder, i);
-      /* r_ans_elt_holder.ptr is a const char * so we need to cast it to
-         char * before we can write to it */
-      Ocopy_bytes_to_i1i2_with_lkup(0, r_ans_elt_holder.length - 1,
-        (char *)r_ans_elt_holder.ptr, r_ans_elt_holder.length,
-        frag->dna, frag->size,
-        INTEGER(lkup), LENGTH(lkup));
-      freeDnaSeq(&frag);
+      frags[n_frags].name = (char *)CHAR(STRING_ELT(r_seqnames, i));
+      frags[n_frags].start = frag_start[i] - 1;
+      frags[n_frags].end = frag_start[i] + frag_width[i] - 1;
+      frags[n_frags].rc = r_rc != R_NilValue && LOGICAL(r_rc)[i] == TRUE;
+      /* r_ans_elt_holder.ptr is a const char * */
+      frags[n_frags].out = (char *)r_ans_elt_holder.ptr;
+      n_frags++;
     }
   }
+  twoBitReadFragsCodes(file, frags, n_frags, &codes);
   twoBitClose(&file);
   popRHandlers();
 
   UNPROTECT(2);
   return r_ans;
 }
+
+/* .Call entry point */
+/* Writes the sequences of the 2bit file 'r_twobit' to the FASTA file
+   'r_fasta', 'r_width' bases per line, masked blocks in lower case */
+SEXP TwoBitFile_to_fasta(SEXP r_twobit, SEXP r_fasta, SEXP r_width)
+{
+  pushRHandlers();
+  dnaUtilOpen();
+  struct twoBitFile *tbf = twoBitOpen((char *)CHAR(asChar(r_twobit)));
+  FILE *file = mustOpen((char *)CHAR(asChar(r_fasta)), "wb");
+  int width = asInteger(r_width);
+  for (struct twoBitIndex *index = tbf->indexList; index != NULL;
+       index = index->next)
+    twoBitWriteSeqFa(tbf, index->name, width, file);
+  carefulClose(&file);
+  twoBitClose(&tbf);
+  popRHandlers();
+
+  return R_NilValue;
+}
+
+/* .Call entry point */
+/* Counts the bases of each range, as A, C, G, T and N, and if 'r_pairs'
+   is TRUE the pairs of adjacent bases outside blocks of N, as AA, AC,
+   ..., TT, into an integer matrix with a row per range. The bases are
+   counted in their packed form and never unpacked. */
+SEXP TwoBitFile_composition(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
+                            SEXP r_pairs)
+{
+  pushRHandlers();
+  struct twoBitFile *file = twoBitOpen((char *)CHAR(asChar(r_filename)));
+  int *frag_start = INTEGER(get_IRanges_start(r_ranges));
+  int *frag_width = INTEGER(get_IRanges_width(r_ranges));
+  int frag_count = get_IRanges_length(r_ranges);
+  int pairs = asLogical(r_pairs) == TRUE;
+  int n_cols = twoBitBaseCountSize + (pairs ? twoBitPairCountSize : 0);
+
+  struct twoBitFrag *frags =
+    (struct twoBitFrag *) R_alloc(frag_count, sizeof(struct twoBitFrag));
+  int *frag_ix = (int *) R_alloc(frag_count, sizeof(int));
+  int n_frags = 0;
+  for (int i = 0; i < frag_count; i++) {
+    if (frag_width[i]) {
+      frags[n_frags].name = (char *)CHAR(STRING_ELT(r_seqnames, i));
+      frags[n_frags].start = frag_start[i] - 1;
+      frags[n_frags].end = frag_start[i] + frag_width[i] - 1;
+      frags[n_frags].rc = FALSE;
+      frags[n_frags].out = NULL;
+      frag_ix[n_frags++] = i;
+    }
+  }
+  bits32 *base_counts =
+    (bits32 *) R_alloc((size_t) n_frags * twoBitBaseCountSize, sizeof(bits32));
+  bits32 *pair_counts = pairs ?
+    (bits32 *) R_alloc((size_t) n_frags * twoBitPairCountSize, sizeof(bits32)) :
+    NULL;
+  twoBitCountFrags(file, frags, n_frags, base_counts, pair_counts);
+  twoBitClose(&file);
+  popRHandlers();
+
+  /* a column per count, zero for empty ranges */
+  SEXP ans = PROTECT(allocMatrix(INTSXP, frag_count, n_cols));
+  int *ans_p = INTEGER(ans);
+  memset(ans_p, 0, sizeof(int) * (size_t) frag_count * n_cols);
+  for (int k = 0; k < n_frags; k++) {
+    int *row = ans_p + frag_ix[k];
+    for (int j = 0; j < twoBitBaseCountSize; j++)
+      row[(size_t) j * frag_count] =
+        base_counts[(size_t) k * twoBitBaseCountSize + j];
+    for (int j = 0; pairs && j < twoBitPairCountSize; j++)
+      row[(size_t) (twoBitBaseCountSize + j) * frag_count] =
+        pair_counts[(size_t) k * twoBitPairCountSize + j];
+  }
+  UNPROTECT(1);
+  return ans;
+}
@@ -7,8 +7,15 @@
 
 SEXP DNAString_to_twoBit(SEXP r_dna, SEXP r_mask, SEXP r_seqname);
 SEXP TwoBits_write(SEXP r_twoBits, SEXP r_filename);
+SEXP TwoBitFile_write(SEXP r_filename, SEXP r_seqs, SEXP r_seqnames,
+                      SEXP r_threads, SEXP lkup);
+SEXP FastaFile_to_twoBit(SEXP r_fasta, SEXP r_twobit, SEXP r_spool,
+                         SEXP r_threads);
 SEXP TwoBitFile_seqlengths(SEXP r_filename);
 SEXP TwoBitFile_read(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
-                     SEXP lkup);
+                     SEXP r_rc, SEXP lkup);
+SEXP TwoBitFile_to_fasta(SEXP r_twobit, SEXP r_fasta, SEXP r_width);
+SEXP TwoBitFile_composition(SEXP r_filename, SEXP r_seqnames, SEXP r_ranges,
+                            SEXP r_pairs);
 
 #endif
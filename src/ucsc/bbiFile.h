@@ -101,6 +101,19 @@ struct bbiZoomLevel *bbiBestZoom(struct bbiZoomLevel *levelList, int desiredRedu
 /* Return zoom level that is the closest one that is less than or equal to 
  * desiredReduction. */
 
+struct bbiStats
+/* Counts of the work done reading data blocks of a bbiFile. */
+    {
+    bits64 blocksRead;		/* Number of data blocks read. */
+    bits64 bytesRead;		/* Bytes in those blocks as stored in file. */
+    bits64 bytesDecompressed;	/* Bytes out of decompressing those blocks. */
+    bits64 decompressMicros;	/* Microseconds spent decompressing. */
+    bits64 indexNodesVisited;	/* Number of r-tree index nodes read to find blocks. */
+    bits64 readMicros;		/* Microseconds spent reading blocks. */
+    bits64 readWaitMicros;	/* Microseconds decoding waited for blocks to be read. */
+    bits64 decodeMicros;	/* Microseconds spent decompressing and decoding blocks. */
+    };
+
 struct bbiFile 
 /* An open bbiFile */
     {
@@ -129,6 +142,11 @@ struct bbiFile
     bits16 extensionSize;   /* Size of extension block */
     bits16 extraIndexCount; /* Number of extra indexes (on fields other than chrom,start,end */ 
     bits64 extraIndexListOffset;    /* Offset to list of extra indexes */
+
+    struct bbiStats stats;	/* Work done reading this file so far. */
+    struct bbiFile *openPrev, *openNext;	/* Neighbours in list of open files. */
+    char *uncompressBuf;	/* Scratch space for uncompressing blocks, may be NULL. */
+    struct bbiFile *shared;	/* File whose header and zoom levels this shares, or NULL. */
     };
 
 
@@ -138,6 +156,75 @@ struct bbiFile *bbiFileOpen(char *fileName, bits32 sig, char *typeName);
 void bbiFileClose(struct bbiFile **pBwf);
 /* Close down a big wig/big bed file. */
 
+struct bbiFile *bbiFileOpenShared(struct bbiFile *bbi);
+/* Open another handle on the file of bbi for use on another thread.  The new
+ * handle shares the header and zoom levels of bbi, which do not change, and
+ * has its own udcFile, index handles, scratch space and stats, so queries on
+ * it may run at the same time as queries on bbi and its other handles.  Call
+ * this on the thread that uses bbi, and close the handle before bbi. */
+
+char *bbiUncompressBuf(struct bbiFile *bbi);
+/* Return scratch space of bbi to uncompress a block into, or NULL if the blocks
+ * are not compressed. */
+
+char *bbiBlockData(struct bbiFile *bbi, char *blockBuf, bits64 blockSize,
+	char *uncompressBuf, char **retEnd);
+/* Return start of the data of a block read from bbi into blockBuf, uncompressing
+ * it into uncompressBuf first if that is non-NULL, and put the end of the data
+ * in *retEnd.  Counts the block in bbi->stats. */
+
+struct bbiBlockRun
+/* A run of data blocks next to each other in the file, read in one go. */
+    {
+    struct fileOffsetSize *blockList;	/* First block of run. */
+    struct fileOffsetSize *afterGap;	/* Block after the last one of run, may be NULL. */
+    char *data;				/* Data of the blocks one after the other. */
+    void *alloc;			/* Memory to free when done, NULL if data is mapped. */
+    };
+
+struct bbiBlockReader *bbiBlockReaderNew(struct bbiFile *bbi, struct fileOffsetSize *blockList);
+/* Start reading the blocks in blockList, which is sorted by offset, as runs of
+ * blocks without gaps.  For remote files a thread reads runs ahead of the
+ * ones handed out by bbiBlockReaderNext, so reading overlaps decoding.  The
+ * bbi's udcFile must not be used otherwise until bbiBlockReaderFree. */
+
+struct bbiBlockRun *bbiBlockReaderNext(struct bbiBlockReader *reader);
+/* Return next run of blocks, or NULL when all are done.  The run returned
+ * before is freed. */
+
+void bbiBlockReaderFree(struct bbiBlockReader **pReader);
+/* Stop reading, free reader and the runs left, and add the time spent to
+ * the bbi's stats. */
+
+struct errCatch;
+
+void bbiBlockReaderEnd(struct bbiBlockReader **pReader, struct errCatch **pErrCatch);
+/* End errCatch started around decoding the runs of reader, free reader, and
+ * then pass on any error or warning caught.  Decoding may errAbort, for
+ * instance on a corrupt block, and the reader must be stopped even then. */
+
+void bbiTotalStats(struct bbiStats *retStats);
+/* Put sum of stats of all bbiFiles, open or closed, since the last
+ * bbiResetStats into retStats. */
+
+struct bbiFileStats
+/* Stats of one open bbiFile. */
+    {
+    struct bbiFileStats *next;	/* Next in list. */
+    char *fileName;		/* Name of file. */
+    struct bbiStats stats;	/* Stats so far. */
+    };
+
+struct bbiFileStats *bbiOpenFileStats();
+/* Return stats of each bbiFile now open, in order of opening.  Free with
+ * bbiFileStatsFreeList. */
+
+void bbiFileStatsFreeList(struct bbiFileStats **pList);
+/* Free a list from bbiOpenFileStats. */
+
+void bbiResetStats();
+/* Zero the stats of all open bbiFiles and the sums of closed ones. */
+
 struct fileOffsetSize *bbiOverlappingBlocks(struct bbiFile *bbi, struct cirTreeFile *ctf,
 	char *chrom, bits32 start, bits32 end, bits32 *retChromId);
 /* Fetch list of file blocks that contain items overlapping chromosome range. */
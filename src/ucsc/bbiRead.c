@@ -14,6 +14,415 @@
 #include "cirTree.h"
 #include "udc.h"
 #include "bbiFile.h"
+#include "errCatch.h"
+#include <pthread.h>
+#include <time.h>
+
+static struct bbiFile *openHead = NULL, *openTail = NULL;	/* Open files, oldest first. */
+static struct bbiStats closedStats;	/* Sums of stats of files closed since reset. */
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;	/* Protects the above. */
+
+static void bbiStatsAdd(struct bbiStats *sum, struct bbiStats *stats)
+/* Add stats into sum. */
+{
+sum->blocksRead += stats->blocksRead;
+sum->bytesRead += stats->bytesRead;
+sum->bytesDecompressed += stats->bytesDecompressed;
+sum->decompressMicros += stats->decompressMicros;
+sum->indexNodesVisited += stats->indexNodesVisited;
+sum->readMicros += stats->readMicros;
+sum->readWaitMicros += stats->readWaitMicros;
+sum->decodeMicros += stats->decodeMicros;
+}
+
+static void statsAddOpen(struct bbiFile *bbi)
+/* Put bbi on the list of open files. */
+{
+pthread_mutex_lock(&statsMutex);
+bbi->openPrev = openTail;
+bbi->openNext = NULL;
+if (openTail != NULL)
+    openTail->openNext = bbi;
+else
+    openHead = bbi;
+openTail = bbi;
+pthread_mutex_unlock(&statsMutex);
+}
+
+static void statsRemoveOpen(struct bbiFile *bbi)
+/* Take bbi off the list of open files, adding its stats to closedStats. */
+{
+pthread_mutex_lock(&statsMutex);
+if (bbi->openPrev != NULL)
+    bbi->openPrev->openNext = bbi->openNext;
+else
+    openHead = bbi->openNext;
+if (bbi->openNext != NULL)
+    bbi->openNext->openPrev = bbi->openPrev;
+else
+    openTail = bbi->openPrev;
+bbiStatsAdd(&closedStats, &bbi->stats);
+pthread_mutex_unlock(&statsMutex);
+}
+
+void bbiTotalStats(struct bbiStats *retStats)
+/* Put sum of stats of all bbiFiles, open or closed, since the last
+ * bbiResetStats into retStats. */
+{
+pthread_mutex_lock(&statsMutex);
+*retStats = closedStats;
+struct bbiFile *bbi;
+for (bbi = openHead; bbi != NULL; bbi = bbi->openNext)
+    bbiStatsAdd(retStats, &bbi->stats);
+pthread_mutex_unlock(&statsMutex);
+}
+
+struct bbiFileStats *bbiOpenFileStats()
+/* Return stats of each bbiFile now open, in order of opening.  Free with
+ * bbiFileStatsFreeList. */
+{
+struct bbiFileStats *list = NULL, *el;
+pthread_mutex_lock(&statsMutex);
+struct bbiFile *bbi;
+for (bbi = openHead; bbi != NULL; bbi = bbi->openNext)
+    {
+    AllocVar(el);
+    el->fileName = cloneString(bbi->fileName);
+    el->stats = bbi->stats;
+    slAddHead(&list, el);
+    }
+pthread_mutex_unlock(&statsMutex);
+slReverse(&list);
+return list;
+}
+
+void bbiFileStatsFreeList(struct bbiFileStats **pList)
+/* Free a list from bbiOpenFileStats. */
+{
+struct bbiFileStats *el, *next;
+for (el = *pList; el != NULL; el = next)
+    {
+    next = el->next;
+    freeMem(el->fileName);
+    freeMem(el);
+    }
+*pList = NULL;
+}
+
+void bbiResetStats()
+/* Zero the stats of all open bbiFiles and the sums of closed ones. */
+{
+pthread_mutex_lock(&statsMutex);
+ZeroVar(&closedStats);
+struct bbiFile *bbi;
+for (bbi = openHead; bbi != NULL; bbi = bbi->openNext)
+    ZeroVar(&bbi->stats);
+pthread_mutex_unlock(&statsMutex);
+}
+
+static bits64 microsNow()
+/* Return a monotonic time in microseconds. */
+{
+struct timespec ts;
+clock_gettime(CLOCK_MONOTONIC, &ts);
+return (bits64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+char *bbiBlockData(struct bbiFile *bbi, char *blockBuf, bits64 blockSize,
+	char *uncompressBuf, char **retEnd)
+/* Return start of the data of a block read from bbi into blockBuf, uncompressing
+ * it into uncompressBuf first if that is non-NULL, and put the end of the data
+ * in *retEnd.  Counts the block in bbi->stats. */
+{
+bbi->stats.blocksRead += 1;
+bbi->stats.bytesRead += blockSize;
+if (uncompressBuf == NULL)
+    {
+    *retEnd = blockBuf + blockSize;
+    return blockBuf;
+    }
+bits64 startTime = microsNow();
+int uncSize = zUncompress(blockBuf, blockSize, uncompressBuf, bbi->uncompressBufSize);
+bbi->stats.decompressMicros += microsNow() - startTime;
+bbi->stats.bytesDecompressed += uncSize;
+*retEnd = uncompressBuf + uncSize;
+return uncompressBuf;
+}
+
+/* The block reader hands out runs of blocks to decode, which a thread reads
+ * ahead for remote files.  It fetches missing blocks a batch of runs at a
+ * time, so decoding can start before all of them are in the cache. */
+
+#define bbiReadAheadRuns 4		/* Most runs read and not yet handed out. */
+#define bbiMaxRemoteRunSize (512*1024)	/* Remote runs are split to overlap beyond this. */
+#define bbiFetchBatchSize (1024*1024)	/* Bytes of runs fetched remotely at once. */
+
+struct bbiBlockReader
+/* Reads runs of blocks of a bbiFile, maybe on a thread of its own. */
+    {
+    struct bbiFile *bbi;		/* File read from. */
+    struct bbiBlockRun *runs;		/* Runs in file order. */
+    int runCount;			/* Number of runs. */
+    int readCount;			/* Runs read so far. */
+    int takenCount;			/* Runs handed out so far. */
+    boolean threaded;			/* If TRUE runs are read by thread. */
+    pthread_t thread;			/* Thread reading runs. */
+    pthread_mutex_t mutex;		/* Protects counts, cancel and errMessage. */
+    pthread_cond_t cond;		/* Signalled when any of them changes. */
+    boolean cancel;			/* Set to make thread stop early. */
+    char *errMessage;			/* Error reading, NULL if none. */
+    bits64 readMicros;			/* Time spent reading. */
+    bits64 readWaitMicros;		/* Time spent waiting for reads. */
+    bits64 decodeMicros;		/* Time spent between handing out runs. */
+    bits64 takenTime;			/* When last run was handed out, 0 if it is done. */
+    };
+
+static void bbiReadRun(struct bbiBlockReader *reader, struct bbiBlockRun *run)
+/* Read data of run. */
+{
+struct udcFile *udc = reader->bbi->udc;
+struct fileOffsetSize *last = run->blockList;
+while (last->next != run->afterGap)
+    last = last->next;
+bits64 offset = run->blockList->offset;
+udcSeek(udc, offset);
+run->data = udcReadOrMap(udc, last->offset + last->size - offset, &run->alloc);
+}
+
+static void bbiFetchBatch(struct bbiBlockReader *reader, int startRun, int endRun)
+/* Fetch missing blocks of runs from startRun to endRun into the cache. */
+{
+struct fileOffsetSize *first = reader->runs[startRun].blockList;
+struct fileOffsetSize *last = first;
+while (last->next != reader->runs[endRun-1].afterGap)
+    last = last->next;
+/* Cut list after the batch while it is prefetched.  Those blocks are not handed
+ * out yet, so nothing else looks at them. */
+struct fileOffsetSize *after = last->next;
+last->next = NULL;
+udcPrefetch(reader->bbi->udc, first);
+last->next = after;
+}
+
+static int bbiBatchEnd(struct bbiBlockReader *reader, int startRun)
+/* Return end of batch of runs fetched together starting at startRun. */
+{
+bits64 size = 0;
+int i;
+for (i = startRun; i < reader->runCount && (i == startRun || size < bbiFetchBatchSize); ++i)
+    {
+    struct bbiBlockRun *run = &reader->runs[i];
+    struct fileOffsetSize *block;
+    for (block = run->blockList; block != run->afterGap; block = block->next)
+	size += block->size;
+    }
+return i;
+}
+
+static char *bbiReadRunCatching(struct bbiBlockReader *reader, int i, int *pBatchEnd)
+/* Read run i, first fetching the batch it starts if it starts one.  Return the
+ * message of any errAbort, caught here as the default handler of a new thread
+ * would exit, or NULL. */
+{
+struct errCatch *errCatch = errCatchNew();
+if (errCatchStart(errCatch))
+    {
+    if (i == *pBatchEnd)
+	{
+	*pBatchEnd = bbiBatchEnd(reader, i);
+	bbiFetchBatch(reader, i, *pBatchEnd);
+	}
+    bbiReadRun(reader, &reader->runs[i]);
+    }
+errCatchEnd(errCatch);
+char *errMessage = NULL;
+if (errCatch->gotError)
+    errMessage = cloneString(trimSpaces(errCatch->message->string));
+errCatchFree(&errCatch);
+return errMessage;
+}
+
+static void *bbiBlockReaderThread(void *v)
+/* Read runs until all are read, canceled, or an error. */
+{
+struct bbiBlockReader *reader = v;
+int i, batchEnd = 0;
+for (i = 0; i < reader->runCount; ++i)
+    {
+    pthread_mutex_lock(&reader->mutex);
+    while (!reader->cancel && i - reader->takenCount >= bbiReadAheadRuns)
+	pthread_cond_wait(&reader->cond, &reader->mutex);
+    boolean cancel = reader->cancel;
+    pthread_mutex_unlock(&reader->mutex);
+    if (cancel)
+	break;
+
+    bits64 startTime = microsNow();
+    char *errMessage = bbiReadRunCatching(reader, i, &batchEnd);
+    bits64 elapsed = microsNow() - startTime;
+
+    pthread_mutex_lock(&reader->mutex);
+    reader->readMicros += elapsed;
+    if (errMessage != NULL)
+	reader->errMessage = errMessage;
+    else
+	reader->readCount = i + 1;
+    pthread_cond_signal(&reader->cond);
+    pthread_mutex_unlock(&reader->mutex);
+    if (errMessage != NULL)
+	break;
+    }
+return NULL;
+}
+
+struct bbiBlockReader *bbiBlockReaderNew(struct bbiFile *bbi, struct fileOffsetSize *blockList)
+/* Start reading the blocks in blockList, which is sorted by offset, as runs of
+ * blocks without gaps.  For remote files a thread reads runs ahead of the
+ * ones handed out by bbiBlockReaderNext, so reading overlaps decoding.  The
+ * bbi's udcFile must not be used otherwise until bbiBlockReaderFree. */
+{
+struct bbiBlockReader *reader;
+AllocVar(reader);
+reader->bbi = bbi;
+
+/* Local files are mapped, so reads cost nothing and the kernel reads ahead
+ * after udcPrefetch.  Remote runs are split so there is something to read
+ * ahead of even in one big run. */
+boolean remote = !udcIsLocal(bbi->fileName);
+AllocArray(reader->runs, slCount(blockList) + 1);
+struct fileOffsetSize *block;
+bits64 runStart = 0, runEnd = 0;
+for (block = blockList; block != NULL; block = block->next)
+    {
+    if (reader->runCount == 0 || block->offset != runEnd ||
+	(remote && runEnd - runStart + block->size > bbiMaxRemoteRunSize))
+	{
+	if (reader->runCount > 0)
+	    reader->runs[reader->runCount-1].afterGap = block;
+	reader->runs[reader->runCount++].blockList = block;
+	runStart = block->offset;
+	}
+    runEnd = block->offset + block->size;
+    }
+
+/* It's only worth a thread for more than one remote run. */
+if (reader->runCount > 1 && remote)
+    {
+    pthread_mutex_init(&reader->mutex, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+    if (pthread_create(&reader->thread, NULL, bbiBlockReaderThread, reader) == 0)
+	reader->threaded = TRUE;
+    else
+	{
+	pthread_cond_destroy(&reader->cond);
+	pthread_mutex_destroy(&reader->mutex);
+	}
+    }
+if (!reader->threaded)
+    udcPrefetch(bbi->udc, blockList);
+return reader;
+}
+
+static void bbiBlockReaderStop(struct bbiBlockReader *reader)
+/* Cancel thread if any and wait for it to finish. */
+{
+if (!reader->threaded)
+    return;
+pthread_mutex_lock(&reader->mutex);
+reader->cancel = TRUE;
+pthread_cond_signal(&reader->cond);
+pthread_mutex_unlock(&reader->mutex);
+pthread_join(reader->thread, NULL);
+pthread_cond_destroy(&reader->cond);
+pthread_mutex_destroy(&reader->mutex);
+reader->threaded = FALSE;
+}
+
+struct bbiBlockRun *bbiBlockReaderNext(struct bbiBlockReader *reader)
+/* Return next run of blocks, or NULL when all are done.  The run returned
+ * before is freed. */
+{
+bits64 now = microsNow();
+if (reader->takenTime != 0)
+    {
+    reader->decodeMicros += now - reader->takenTime;
+    reader->takenTime = 0;
+    freez(&reader->runs[reader->takenCount-1].alloc);
+    }
+if (reader->takenCount >= reader->runCount)
+    return NULL;
+struct bbiBlockRun *run = &reader->runs[reader->takenCount];
+if (reader->threaded)
+    {
+    pthread_mutex_lock(&reader->mutex);
+    while (reader->readCount <= reader->takenCount && reader->errMessage == NULL)
+	pthread_cond_wait(&reader->cond, &reader->mutex);
+    char *errMessage = reader->errMessage;
+    reader->errMessage = NULL;
+    if (errMessage == NULL)
+	{
+	reader->takenCount += 1;
+	pthread_cond_signal(&reader->cond);
+	}
+    pthread_mutex_unlock(&reader->mutex);
+    if (errMessage != NULL)
+	{
+	bbiBlockReaderStop(reader);
+	char message[1024];
+	safef(message, sizeof(message), "%s", errMessage);
+	freeMem(errMessage);
+	errAbort("%s", message);
+	}
+    }
+else
+    {
+    bbiReadRun(reader, run);
+    reader->readMicros += microsNow() - now;
+    reader->takenCount += 1;
+    }
+reader->takenTime = microsNow();
+reader->readWaitMicros += reader->takenTime - now;
+return run;
+}
+
+void bbiBlockReaderFree(struct bbiBlockReader **pReader)
+/* Stop reading, free reader and the runs left, and add the time spent to
+ * the bbi's stats. */
+{
+struct bbiBlockReader *reader = *pReader;
+if (reader == NULL)
+    return;
+if (reader->takenTime != 0)
+    reader->decodeMicros += microsNow() - reader->takenTime;
+bbiBlockReaderStop(reader);
+int i;
+for (i = 0; i < reader->runCount; ++i)
+    freeMem(reader->runs[i].alloc);
+reader->bbi->stats.readMicros += reader->readMicros;
+reader->bbi->stats.readWaitMicros += reader->readWaitMicros;
+reader->bbi->stats.decodeMicros += reader->decodeMicros;
+freeMem(reader->runs);
+freez(pReader);
+}
+
+void bbiBlockReaderEnd(struct bbiBlockReader **pReader, struct errCatch **pErrCatch)
+/* End errCatch started around decoding the runs of reader, free reader, and
+ * then pass on any error or warning caught.  This way the reading thread is
+ * stopped before the bbi's udcFile can be closed by whoever handles the error. */
+{
+struct errCatch *errCatch = *pErrCatch;
+errCatchEnd(errCatch);
+bbiBlockReaderFree(pReader);
+if (errCatch->gotError)
+    {
+    char message[1024];
+    safef(message, sizeof(message), "%s", trimSpaces(errCatch->message->string));
+    errCatchFree(pErrCatch);
+    errAbort("%s", message);
+    }
+errCatchReWarn(errCatch);
+errCatchFree(pErrCatch);
+}
 
 struct bbiZoomLevel *bbiBestZoom(struct bbiZoomLevel *levelList, int desiredReduction)
 /* Return zoom level that is the closest one that is less than or equal to 
@@ -147,6 +556,7 @@ if (bbi->extensionOffset != 0)
 udcSeek(udc, bbi->chromTreeOffset);
 bbi->chromBpt =  bptFileAttach(fileName, udc);
 
+statsAddOpen(bbi);
 return bbi;
 }
 
@@ -156,16 +566,54 @@ void bbiFileClose(struct bbiFile **pBwf)
 struct bbiFile *bwf = *pBwf;
 if (bwf != NULL)
     {
+    statsRemoveOpen(bwf);
     cirTreeFileDetach(&bwf->unzoomedCir);
-    slFreeList(&bwf->levelList);
-    slFreeList(&bwf->levelList);
+    if (bwf->shared == NULL)
+	slFreeList(&bwf->levelList);
     bptFileDetach(&bwf->chromBpt);
     udcFileClose(&bwf->udc);
+    freeMem(bwf->uncompressBuf);
     freeMem(bwf->fileName);
     freez(pBwf);
     }
 }
 
+struct bbiFile *bbiFileOpenShared(struct bbiFile *bbi)
+/* Open another handle on the file of bbi for use on another thread.  The new
+ * handle shares the header and zoom levels of bbi, which do not change, and
+ * has its own udcFile, index handles, scratch space and stats, so queries on
+ * it may run at the same time as queries on bbi and its other handles.  Call
+ * this on the thread that uses bbi, and close the handle before bbi. */
+{
+/* Attach the index here, so handles only ever read it. */
+bbiAttachUnzoomedCir(bbi);
+struct bbiFile *dup = CloneVar(bbi);
+dup->next = NULL;
+dup->shared = (bbi->shared != NULL ? bbi->shared : bbi);
+dup->fileName = cloneString(bbi->fileName);
+dup->udc = udcFileOpen(dup->fileName, udcDefaultDir());
+dup->chromBpt = CloneVar(bbi->chromBpt);
+dup->chromBpt->fileName = dup->fileName;
+dup->chromBpt->udc = dup->udc;
+dup->unzoomedCir = CloneVar(bbi->unzoomedCir);
+dup->unzoomedCir->fileName = dup->fileName;
+dup->unzoomedCir->udc = dup->udc;
+dup->unzoomedCir->nodesVisited = 0;
+dup->uncompressBuf = NULL;
+ZeroVar(&dup->stats);
+statsAddOpen(dup);
+return dup;
+}
+
+char *bbiUncompressBuf(struct bbiFile *bbi)
+/* Return scratch space of bbi to uncompress a block into, or NULL if the blocks
+ * are not compressed. */
+{
+if (bbi->uncompressBufSize > 0 && bbi->uncompressBuf == NULL)
+    bbi->uncompressBuf = needLargeMem(bbi->uncompressBufSize);
+return bbi->uncompressBuf;
+}
+
 static void chromIdSizeHandleSwapped(boolean isSwapped, struct bbiChromIdSize *idSize)
 /* Swap bytes in chromosome Id and Size as needed. */
 {
@@ -187,7 +635,10 @@ if (!bptFileFind(bbi->chromBpt, chrom, strlen(chrom), &idSize, sizeof(idSize)))
 chromIdSizeHandleSwapped(bbi->isSwapped, &idSize);
 if (retChromId != NULL)
     *retChromId = idSize.chromId;
-return cirTreeFindOverlappingBlocks(ctf, idSize.chromId, start, end);
+bits64 nodesBefore = ctf->nodesVisited;
+struct fileOffsetSize *blockList = cirTreeFindOverlappingBlocks(ctf, idSize.chromId, start, end);
+bbi->stats.indexNodesVisited += ctf->nodesVisited - nodesBefore;
+return blockList;
 }
 
 struct chromNameCallbackContext
@@ -311,52 +762,28 @@ out->sumSquares = in->sumSquares;
 return out;
 }
 
-struct bbiSummary *bbiSummariesInRegion(struct bbiZoomLevel *zoom, struct bbiFile *bbi, 
-	int chromId, bits32 start, bits32 end)
-/* Return list of all summaries in region at given zoom level of bbiFile. */
+static struct bbiSummary *bbiDecodeSummaryRuns(struct bbiFile *bbi,
+	struct bbiBlockReader *reader, int chromId, bits32 start, bits32 end)
+/* Decode the runs of blocks handed out by reader into a list, in reverse order,
+ * of the summaries overlapping chromId:start-end. */
 {
 struct bbiSummary *sumList = NULL, *sum;
-struct udcFile *udc = bbi->udc;
-udcSeek(udc, zoom->indexOffset);
-struct cirTreeFile *ctf = cirTreeFileAttach(bbi->fileName, bbi->udc);
-struct fileOffsetSize *blockList = cirTreeFindOverlappingBlocks(ctf, chromId, start, end);
-struct fileOffsetSize *block, *beforeGap, *afterGap;
+struct fileOffsetSize *block;
 
 /* Set up for uncompression optionally. */
-char *uncompressBuf = NULL;
-if (bbi->uncompressBufSize > 0)
-    uncompressBuf = needLargeMem(bbi->uncompressBufSize);
+char *uncompressBuf = bbiUncompressBuf(bbi);
 
-
-/* This loop is a little complicated because we merge the read requests for efficiency, but we 
- * have to then go back through the data one unmerged block at a time. */
-for (block = blockList; block != NULL; )
+struct bbiBlockRun *run;
+while ((run = bbiBlockReaderNext(reader)) != NULL)
     {
-    /* Find contigious blocks and read them into mergedBuf. */
-    fileOffsetSizeFindGap(block, &beforeGap, &afterGap);
-    bits64 mergedOffset = block->offset;
-    bits64 mergedSize = beforeGap->offset + beforeGap->size - mergedOffset;
-    udcSeek(udc, mergedOffset);
-    char *mergedBuf = needLargeMem(mergedSize);
-    udcMustRead(udc, mergedBuf, mergedSize);
-    char *blockBuf = mergedBuf;
+    char *blockBuf = run->data;
 
     /* Loop through individual blocks within merged section. */
-    for (;block != afterGap; block = block->next)
-        {
+    for (block = run->blockList; block != run->afterGap; block = block->next)
+	{
 	/* Uncompress if necessary. */
-	char *blockPt, *blockEnd;
-	if (uncompressBuf)
-	    {
-	    blockPt = uncompressBuf;
-	    int uncSize = zUncompress(blockBuf, block->size, uncompressBuf, bbi->uncompressBufSize);
-	    blockEnd = blockPt + uncSize;
-	    }
-	else
-	    {
-	    blockPt = blockBuf;
-	    blockEnd = blockPt + block->size;
-	    }
+	char *blockEnd;
+	char *blockPt = bbiBlockData(bbi, blockBuf, block->size, uncompressBuf, &blockEnd);
 
 	/* Figure out bounds and number of items in block. */
 	int blockSize = blockEnd - blockPt;
@@ -369,7 +796,10 @@ for (block = blockList; block != NULL; )
 	int i;
 	for (i=0; i<itemCount; ++i)
 	    {
-	    dSum = (void *)blockPt;
+	    /* Swap a copy, the block may be a read-only mapping of the file. */
+	    struct bbiSummaryOnDisk onDisk;
+	    memcpy(&onDisk, blockPt, sizeof(onDisk));
+	    dSum = &onDisk;
 	    blockPt += sizeof(*dSum);
 	    bbiSummaryHandleSwapped(bbi, dSum);
 	    if (dSum->chromId == chromId)
@@ -385,10 +815,29 @@ for (block = blockList; block != NULL; )
 	    }
 	assert(blockPt == blockEnd);
 	blockBuf += block->size;
-        }
-    freeMem(mergedBuf);
+	}
     }
-freeMem(uncompressBuf);
+return sumList;
+}
+
+struct bbiSummary *bbiSummariesInRegion(struct bbiZoomLevel *zoom, struct bbiFile *bbi, 
+	int chromId, bits32 start, bits32 end)
+/* Return list of all summaries in region at given zoom level of bbiFile. */
+{
+struct bbiSummary *sumList = NULL;
+struct udcFile *udc = bbi->udc;
+udcSeek(udc, zoom->indexOffset);
+struct cirTreeFile *ctf = cirTreeFileAttach(bbi->fileName, bbi->udc);
+struct fileOffsetSize *blockList = cirTreeFindOverlappingBlocks(ctf, chromId, start, end);
+bbi->stats.indexNodesVisited += ctf->nodesVisited;
+
+/* The reader merges the read requests for efficiency, and reads ahead while we
+ * go back through the data one unmerged block at a time. */
+struct bbiBlockReader *reader = bbiBlockReaderNew(bbi, blockList);
+struct errCatch *errCatch = errCatchNew();
+if (errCatchStart(errCatch))
+    sumList = bbiDecodeSummaryRuns(bbi, reader, chromId, start, end);
+bbiBlockReaderEnd(&reader, &errCatch);
 slFreeList(&blockList);
 cirTreeFileDetach(&ctf);
 slReverse(&sumList);
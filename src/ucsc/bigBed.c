@@ -18,6 +18,7 @@
 #include "sig.h"
 #include "udc.h"
 #include "bbiFile.h"
+#include "errCatch.h"
 #include "bigBed.h"
 
 struct bbiFile *bigBedFileOpen(char *fileName)
@@ -27,57 +28,32 @@ return bbiFileOpen(fileName, bigBedSig, "big bed");
 }
 
 
-struct bigBedInterval *bigBedIntervalQuery(struct bbiFile *bbi, char *chrom,
-	bits32 start, bits32 end, int maxItems, struct lm *lm)
-/* Get data for interval.  Return list allocated out of lm.  Set maxItems to maximum
- * number of items to return, or to 0 for all items. */
+static struct bigBedInterval *bigBedDecodeRuns(struct bbiFile *bbi,
+	struct bbiBlockReader *reader, bits32 chromId, bits32 start, bits32 end,
+	int maxItems, struct lm *lm)
+/* Decode the runs of blocks handed out by reader into a list, in reverse order,
+ * of the items in chromId:start-end.  Set maxItems to maximum number of items
+ * to return, or to 0 for all items. */
 {
 struct bigBedInterval *el, *list = NULL;
 int itemCount = 0;
-bbiAttachUnzoomedCir(bbi);
-// Find blocks with padded start and end to make sure we include zero-length insertions:
-bits32 paddedStart = (start > 0) ? start-1 : start;
-bits32 paddedEnd = end+1;
-bits32 chromId;
-struct fileOffsetSize *blockList = bbiOverlappingBlocks(bbi, bbi->unzoomedCir,
-	chrom, paddedStart, paddedEnd, &chromId);
-struct fileOffsetSize *block, *beforeGap, *afterGap;
-struct udcFile *udc = bbi->udc;
+struct fileOffsetSize *block;
 boolean isSwapped = bbi->isSwapped;
 
 /* Set up for uncompression optionally. */
-char *uncompressBuf = NULL;
-if (bbi->uncompressBufSize > 0)
-    uncompressBuf = needLargeMem(bbi->uncompressBufSize);
+char *uncompressBuf = bbiUncompressBuf(bbi);
 
-char *mergedBuf = NULL;
-for (block = blockList; block != NULL; )
+struct bbiBlockRun *run;
+while ((run = bbiBlockReaderNext(reader)) != NULL)
     {
-    /* Find contigious blocks and read them into mergedBuf. */
-    fileOffsetSizeFindGap(block, &beforeGap, &afterGap);
-    bits64 mergedOffset = block->offset;
-    bits64 mergedSize = beforeGap->offset + beforeGap->size - mergedOffset;
-    udcSeek(udc, mergedOffset);
-    mergedBuf = needLargeMem(mergedSize);
-    udcMustRead(udc, mergedBuf, mergedSize);
-    char *blockBuf = mergedBuf;
+    char *blockBuf = run->data;
 
     /* Loop through individual blocks within merged section. */
-    for (;block != afterGap; block = block->next)
-        {
+    for (block = run->blockList; block != run->afterGap; block = block->next)
+	{
 	/* Uncompress if necessary. */
-	char *blockPt, *blockEnd;
-	if (uncompressBuf)
-	    {
-	    blockPt = uncompressBuf;
-	    int uncSize = zUncompress(blockBuf, block->size, uncompressBuf, bbi->uncompressBufSize);
-	    blockEnd = blockPt + uncSize;
-	    }
-	else
-	    {
-	    blockPt = blockBuf;
-	    blockEnd = blockPt + block->size;
-	    }
+	char *blockEnd;
+	char *blockPt = bbiBlockData(bbi, blockBuf, block->size, uncompressBuf, &blockEnd);
 
 	while (blockPt < blockEnd)
 	    {
@@ -91,9 +67,9 @@ for (block = blockList; block != NULL; )
 
 	    /* If we're actually in range then copy it into a new  element and add to list. */
 	    if (chr == chromId &&
-                ((s < end && e > start)
-                // Make sure to include zero-length insertion elements at start or end:
-                 || (s == e && (s == end || e == start))))
+		((s < end && e > start)
+		// Make sure to include zero-length insertion elements at start or end:
+		 || (s == e && (s == end || e == start))))
 		{
 		++itemCount;
 		if (maxItems > 0 && itemCount > maxItems)
@@ -114,13 +90,35 @@ for (block = blockList; block != NULL; )
 	if (maxItems > 0 && itemCount > maxItems)
 	    break;
 	blockBuf += block->size;
-        }
+	}
     if (maxItems > 0 && itemCount > maxItems)
-        break;
-    freez(&mergedBuf);
+	break;
     }
-freez(&mergedBuf);
-freeMem(uncompressBuf);
+return list;
+}
+
+struct bigBedInterval *bigBedIntervalQuery(struct bbiFile *bbi, char *chrom,
+	bits32 start, bits32 end, int maxItems, struct lm *lm)
+/* Get data for interval.  Return list allocated out of lm.  Set maxItems to maximum
+ * number of items to return, or to 0 for all items. */
+{
+struct bigBedInterval *list = NULL;
+bbiAttachUnzoomedCir(bbi);
+// Find blocks with padded start and end to make sure we include zero-length insertions:
+bits32 paddedStart = (start > 0) ? start-1 : start;
+bits32 paddedEnd = end+1;
+bits32 chromId;
+struct fileOffsetSize *blockList = bbiOverlappingBlocks(bbi, bbi->unzoomedCir,
+	chrom, paddedStart, paddedEnd, &chromId);
+
+/* Go through runs of contiguous blocks, read ahead by the reader.  Decoding
+ * is done by a function of its own, so no local here is changed under the
+ * errCatch. */
+struct bbiBlockReader *reader = bbiBlockReaderNew(bbi, blockList);
+struct errCatch *errCatch = errCatchNew();
+if (errCatchStart(errCatch))
+    list = bigBedDecodeRuns(bbi, reader, chromId, start, end, maxItems, lm);
+bbiBlockReaderEnd(&reader, &errCatch);
 slFreeList(&blockList);
 slReverse(&list);
 return list;
@@ -336,23 +334,18 @@ for (fos = fosList; fos != NULL; fos = fos->next)
     {
     /* Read in raw data */
     udcSeek(bbi->udc, fos->offset);
-    char *rawData = needLargeMem(fos->size);
-    udcRead(bbi->udc, rawData, fos->size);
+    void *rawAlloc;
+    char *rawData = udcReadOrMap(bbi->udc, fos->size, &rawAlloc);
 
     /* Optionally uncompress data, and set data pointer to uncompressed version. */
     char *uncompressedData = NULL;
     char *data = NULL;
     int dataSize = 0;
     if (bbi->uncompressBufSize > 0)
-	{
-	data = uncompressedData = needLargeMem(bbi->uncompressBufSize);
-	dataSize = zUncompress(rawData, fos->size, uncompressedData, bbi->uncompressBufSize);
-	}
-    else
-	{
-        data = rawData;
-	dataSize = fos->size;
-	}
+	uncompressedData = needLargeMem(bbi->uncompressBufSize);
+    char *dataEnd;
+    data = bbiBlockData(bbi, rawData, fos->size, uncompressedData, &dataEnd);
+    dataSize = dataEnd - data;
 
     /* Set up for "memRead" routines to more or less treat memory block like file */
     char *blockPt = data, *blockEnd = data + dataSize;
@@ -388,7 +381,7 @@ for (fos = fosList; fos != NULL; fos = fos->next)
     /* Clean up temporary buffers. */
     dyStringFree(&dy);
     freez(&uncompressedData);
-    freez(&rawData);
+    freez(&rawAlloc);
     }
 slReverse(&intervalList);
 return intervalList;
@@ -17,6 +17,7 @@
 #include "udc.h"
 #include "zlibFace.h"
 #include "bbiFile.h"
+#include "errCatch.h"
 #include "bwgInternal.h"
 #include "bigWig.h"
 #include "bigBed.h"
@@ -123,56 +124,31 @@ assert( (maxCount != 0 && outCount >= maxCount) || (blockPt == blockEnd));
 return outCount;
 }
 
-struct bbiInterval *bigWigIntervalQuery(struct bbiFile *bwf, char *chrom, bits32 start, bits32 end,
-	struct lm *lm)
-/* Get data for interval.  Return list allocated out of lm. */
+static struct bbiInterval *bigWigDecodeRuns(struct bbiFile *bwf,
+	struct bbiBlockReader *reader, bits32 start, bits32 end, struct lm *lm)
+/* Decode the runs of blocks handed out by reader into a list, in reverse order,
+ * of the intervals clipped to start-end. */
 {
-if (bwf->typeSig != bigWigSig)
-   errAbort("Trying to do bigWigIntervalQuery on a non big-wig file.");
-bbiAttachUnzoomedCir(bwf);
 struct bbiInterval *el, *list = NULL;
-struct fileOffsetSize *blockList = bbiOverlappingBlocks(bwf, bwf->unzoomedCir, 
-	chrom, start, end, NULL);
-struct fileOffsetSize *block, *beforeGap, *afterGap;
-struct udcFile *udc = bwf->udc;
+struct fileOffsetSize *block;
 boolean isSwapped = bwf->isSwapped;
 float val;
 int i;
 
 /* Set up for uncompression optionally. */
-char *uncompressBuf = NULL;
-if (bwf->uncompressBufSize > 0)
-    uncompressBuf = needLargeMem(bwf->uncompressBufSize);
+char *uncompressBuf = bbiUncompressBuf(bwf);
 
-/* This loop is a little complicated because we merge the read requests for efficiency, but we 
- * have to then go back through the data one unmerged block at a time. */
-for (block = blockList; block != NULL; )
+struct bbiBlockRun *run;
+while ((run = bbiBlockReaderNext(reader)) != NULL)
     {
-    /* Find contigious blocks and read them into mergedBuf. */
-    fileOffsetSizeFindGap(block, &beforeGap, &afterGap);
-    bits64 mergedOffset = block->offset;
-    bits64 mergedSize = beforeGap->offset + beforeGap->size - mergedOffset;
-    udcSeek(udc, mergedOffset);
-    char *mergedBuf = needLargeMem(mergedSize);
-    udcMustRead(udc, mergedBuf, mergedSize);
-    char *blockBuf = mergedBuf;
+    char *blockBuf = run->data;
 
     /* Loop through individual blocks within merged section. */
-    for (;block != afterGap; block = block->next)
-        {
+    for (block = run->blockList; block != run->afterGap; block = block->next)
+	{
 	/* Uncompress if necessary. */
-	char *blockPt, *blockEnd;
-	if (uncompressBuf)
-	    {
-	    blockPt = uncompressBuf;
-	    int uncSize = zUncompress(blockBuf, block->size, uncompressBuf, bwf->uncompressBufSize);
-	    blockEnd = blockPt + uncSize;
-	    }
-	else
-	    {
-	    blockPt = blockBuf;
-	    blockEnd = blockPt + block->size;
-	    }
+	char *blockEnd;
+	char *blockPt = bbiBlockData(bwf, blockBuf, block->size, uncompressBuf, &blockEnd);
 
 	/* Deal with insides of block. */
 	struct bwgSectionHead head;
@@ -249,9 +225,28 @@ for (block = blockList; block != NULL; )
 	assert(blockPt == blockEnd);
 	blockBuf += block->size;
 	}
-    freeMem(mergedBuf);
     }
-freeMem(uncompressBuf);
+return list;
+}
+
+struct bbiInterval *bigWigIntervalQuery(struct bbiFile *bwf, char *chrom, bits32 start, bits32 end,
+	struct lm *lm)
+/* Get data for interval.  Return list allocated out of lm. */
+{
+if (bwf->typeSig != bigWigSig)
+   errAbort("Trying to do bigWigIntervalQuery on a non big-wig file.");
+bbiAttachUnzoomedCir(bwf);
+struct bbiInterval *list = NULL;
+struct fileOffsetSize *blockList = bbiOverlappingBlocks(bwf, bwf->unzoomedCir, 
+	chrom, start, end, NULL);
+
+/* The reader merges the read requests for efficiency, and reads ahead while we
+ * go back through the data one unmerged block at a time. */
+struct bbiBlockReader *reader = bbiBlockReaderNew(bwf, blockList);
+struct errCatch *errCatch = errCatchNew();
+if (errCatchStart(errCatch))
+    list = bigWigDecodeRuns(bwf, reader, start, end, lm);
+bbiBlockReaderEnd(&reader, &errCatch);
 slFreeList(&blockList);
 slReverse(&list);
 return list;
@@ -464,6 +464,7 @@ udcMustReadOne(udc, isLeaf);
 udcMustReadOne(udc, reserved);
 boolean isSwapped = crt->isSwapped;
 childCount = udcReadBits16(udc, isSwapped);
+crt->nodesVisited += 1;
 
 verbose(3, "rFindOverlappingBlocks %llu %u:%u-%u.  childCount %d. isLeaf %d\n", indexFileOffset, chromIx, start, end, (int)childCount, (int)isLeaf);
 
@@ -585,3 +586,13 @@ else
 	}
     }
 }
+
+struct fileOffsetSize *cirTreeEnumerateBlocks(struct cirTreeFile *crt)
+/* Return list of all file blocks indexed by r-tree, in the order they appear in
+ * the file.  When done, use slListFree to dispose of the result. */
+{
+struct fileOffsetSize *blockList = NULL;
+rEnumerateBlocks(crt, 0, crt->rootOffset, &blockList);
+slReverse(&blockList);
+return blockList;
+}
@@ -27,6 +27,7 @@ struct cirTreeFile
     bits32 endBase;		/* Ending base position. */
     bits64 fileSize;		/* Total size of index file. */
     bits32 itemsPerSlot;	/* Max number of items to put in each index slot at lowest level. */
+    bits64 nodesVisited;	/* Number of nodes read by cirTreeFindOverlappingBlocks. */
     };
 
 
@@ -43,6 +44,10 @@ struct fileOffsetSize *cirTreeFindOverlappingBlocks(struct cirTreeFile *crf,
  * start/end on chromIx.  Also there will be likely some non-overlapping items
  * in these blocks too. When done, use slListFree to dispose of the result. */
 
+struct fileOffsetSize *cirTreeEnumerateBlocks(struct cirTreeFile *crt);
+/* Return list of all file blocks indexed by r-tree, in the order they appear in
+ * the file.  When done, use slListFree to dispose of the result. */
+
 
 struct cirTreeRange
 /* A chromosome id and an interval inside it. */
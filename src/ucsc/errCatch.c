@@ -0,0 +1,137 @@
+/* errCatch - help catch errors so that errAborts aren't
+ * fatal, and warn's don't necessarily get printed immediately.
+ * Note that error conditions caught this way will tend to
+ * leak resources unless there are additional wrappers.
+ *
+ * Typical usage is
+ * errCatch = errCatchNew();
+ * if (errCatchStart(errCatch))
+ *     doFlakyStuff();
+ * errCatchEnd(errCatch);
+ * if (errCatch->gotError)
+ *     warn(errCatch->message->string);
+ * errCatchFree(&errCatch);
+ * cleanupFlakyStuff();
+ *
+ * This file is copyright 2002 Jim Kent, but license is hereby
+ * granted for all use - public, private or commercial. */
+
+#include "common.h"
+#include "errAbort.h"
+#include "errCatch.h"
+#include "dystring.h"
+#include "hash.h"
+#include <pthread.h>
+
+
+struct errCatch *errCatchNew()
+/* Return new error catching structure. */
+{
+struct errCatch *errCatch;
+AllocVar(errCatch);
+errCatch->message = dyStringNew(0);
+return errCatch;
+}
+
+void errCatchFree(struct errCatch **pErrCatch)
+/* Free up resources associated with errCatch */
+{
+struct errCatch *errCatch = *pErrCatch;
+if (errCatch != NULL)
+    {
+    dyStringFree(&errCatch->message);
+    freez(pErrCatch);
+    }
+}
+
+static struct errCatch **getStack()
+/* Return a pointer to the errCatch object stack for the current pthread. */
+{
+static pthread_mutex_t getStackMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hash *perThreadStacks = NULL;
+pthread_t pid = pthread_self(); //  pthread_t can be a pointer or a number, implementation-dependent.
+
+// Convert the pid into a string for the hash key
+char pidStr[64];
+safef(pidStr, sizeof(pidStr), "%lld",  ptrToLL(pid));
+pthread_mutex_lock( &getStackMutex );
+if (perThreadStacks == NULL)
+    perThreadStacks = hashNew(0);
+struct hashEl *hel = hashLookup(perThreadStacks, pidStr);
+if (hel == NULL)
+    {
+    // if it is the first time, initialize the stack for this thread
+    struct errCatch **pStack;
+    AllocVar(pStack);
+    *pStack = NULL;
+    hel = hashAdd(perThreadStacks, pidStr, pStack);
+    }
+pthread_mutex_unlock( &getStackMutex );
+return (struct errCatch **)(hel->val);
+}
+
+static void errCatchAbortHandler()
+/* semiAbort */
+{
+struct errCatch **pErrCatchStack = getStack(), *errCatchStack = *pErrCatchStack;
+errCatchStack->gotError = TRUE;
+longjmp(errCatchStack->jmpBuf, -1);
+}
+
+static void errCatchWarnHandler(char *format, va_list args)
+/* Write an error to top of errCatchStack. */
+{
+struct errCatch **pErrCatchStack = getStack(), *errCatchStack = *pErrCatchStack;
+dyStringVaPrintf(errCatchStack->message, format, args);
+dyStringAppendC(errCatchStack->message, '\n');
+errCatchStack->gotWarning = TRUE;
+}
+
+boolean errCatchPushHandlers(struct errCatch *errCatch)
+/* Push error handlers.  Not usually called directly. */
+{
+pushAbortHandler(errCatchAbortHandler);
+pushWarnHandler(errCatchWarnHandler);
+struct errCatch **pErrCatchStack = getStack();
+slAddHead(pErrCatchStack, errCatch);
+return TRUE;
+}
+
+void errCatchEnd(struct errCatch *errCatch)
+/* Restore error handlers and pop self off of catching stack. */
+{
+popWarnHandler();
+popAbortHandler();
+struct errCatch **pErrCatchStack = getStack(), *errCatchStack = *pErrCatchStack;
+if (errCatch != errCatchStack)
+   errAbort("Mismatch between errCatch and errCatchStack");
+*pErrCatchStack = errCatch->next;
+}
+
+void errCatchReWarn(struct errCatch *errCatch)
+/* Re-warn any warnings that happened even though no abort happened
+ * to make them visible. */
+{
+if (errCatch->gotWarning && !errCatch->gotError)
+    warn("%s", errCatch->message->string);
+}
+
+boolean errCatchFinish(struct errCatch **pErrCatch)
+/* Finish up error catching.  Report error if there is a
+ * problem and return FALSE.  If no problem return TRUE.
+ * This handles errCatchEnd and errCatchFree. */
+{
+struct errCatch *errCatch = *pErrCatch;
+boolean ok = TRUE;
+if (errCatch != NULL)
+    {
+    errCatchEnd(errCatch);
+    if (errCatch->gotError)
+	{
+	ok = FALSE;
+	warn("%s", errCatch->message->string);
+	}
+    errCatchFree(pErrCatch);
+    }
+return ok;
+}
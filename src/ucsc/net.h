@@ -90,6 +90,9 @@ void netParseUrl(char *url, struct netParsedUrl *parsed);
 char *urlFromNetParsedUrl(struct netParsedUrl *npu);
 /* Build URL from netParsedUrl structure */
 
+void setAuthorization(struct netParsedUrl npu, char *authHeader, struct dyString *dy);
+/* Set the specified authorization header with BASIC auth base64-encoded user and password */
+
 int netUrlOpen(char *url);
 /* Return socket descriptor (low-level file handle) for read()ing url data,
  * or -1 if error.  Just close(result) when done. Errors from this routine
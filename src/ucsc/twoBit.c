@@ -37,6 +37,11 @@ static void udcMustReadWrap(void *file, void *buf, size_t size)
 udcMustRead((struct udcFile *)file, buf, size);
 }
 
+static void *udcReadOrMapWrap(void *file, size_t size, void **retBuf)
+{
+return udcReadOrMap((struct udcFile *)file, size, retBuf);
+}
+
 static void udcFileCloseWrap(void *pFile)
 {
 udcFileClose((struct udcFile **)pFile);
@@ -47,6 +52,11 @@ static bits32 udcReadBits32Wrap(void *f, boolean isSwapped)
 return udcReadBits32((struct udcFile *)f, isSwapped);
 }
 
+static bits64 udcReadBits64Wrap(void *f, boolean isSwapped)
+{
+return udcReadBits64((struct udcFile *)f, isSwapped);
+}
+
 static boolean udcFastReadStringWrap(void *f, char buf[256])
 {
 return udcFastReadString((struct udcFile *)f, buf);
@@ -68,6 +78,13 @@ static void mustReadWrap(void *file, void *buf, size_t size)
 mustRead((FILE *)file, buf, size);
 }
 
+static void *readOrMapWrap(void *file, size_t size, void **retBuf)
+{
+*retBuf = needLargeMem(size);
+mustRead((FILE *)file, *retBuf, size);
+return *retBuf;
+}
+
 static void fileCloseWrap(void *pFile)
 {
 carefulClose((FILE **)pFile);
@@ -78,6 +95,13 @@ static bits32 readBits32Wrap(void *f, boolean isSwapped)
 return readBits32((FILE *)f, isSwapped);
 }
 
+static bits64 readBits64Wrap(void *f, boolean isSwapped)
+{
+bits64 val;
+mustReadOne((FILE *)f, val);
+return (isSwapped ? byteSwap64(val) : val);
+}
+
 static boolean fastReadStringWrap(void *f, char buf[256])
 {
 return fastReadString((FILE *)f, buf);
@@ -93,18 +117,22 @@ if (useUdc)
     tbf->ourSeekCur = udcSeekCurWrap;
     tbf->ourSeek = udcSeekWrap;
     tbf->ourReadBits32 = udcReadBits32Wrap;
+    tbf->ourReadBits64 = udcReadBits64Wrap;
     tbf->ourFastReadString = udcFastReadStringWrap;
     tbf->ourClose = udcFileCloseWrap;
     tbf->ourMustRead = udcMustReadWrap;
+    tbf->ourReadOrMap = udcReadOrMapWrap;
     }
 else
     {
     tbf->ourSeekCur = seekCurWrap;
     tbf->ourSeek = seekWrap;
     tbf->ourReadBits32 = readBits32Wrap;
+    tbf->ourReadBits64 = readBits64Wrap;
     tbf->ourFastReadString = fastReadStringWrap;
     tbf->ourClose = fileCloseWrap;
     tbf->ourMustRead = mustReadWrap;
+    tbf->ourReadOrMap = readOrMapWrap;
     }
 }
 
@@ -271,90 +299,129 @@ return twoBit;
 }
 
 
-static int twoBitSizeInFile(struct twoBit *twoBit)
+bits64 twoBitRecordSize(bits32 size, bits32 nBlockCount, bits32 maskBlockCount)
+/* Return size in file of the record of a sequence of size bases, with that
+ * many blocks of N and masked blocks. */
+{
+return packedSize(size)
+	+ sizeof(bits32)			/* size */
+	+ sizeof(bits32) + 2*sizeof(bits32)*(bits64)nBlockCount
+	+ sizeof(bits32) + 2*sizeof(bits32)*(bits64)maskBlockCount
+	+ sizeof(bits32);			/* reserved */
+}
+
+static bits64 twoBitSizeInFile(struct twoBit *twoBit)
 /* Figure out size structure will take in file. */
 {
-return packedSize(twoBit->size) 
-	+ sizeof(twoBit->size)
-	+ sizeof(twoBit->nBlockCount)
-	+ sizeof(twoBit->nStarts[0]) * twoBit->nBlockCount
-	+ sizeof(twoBit->nSizes[0]) * twoBit->nBlockCount
-	+ sizeof(twoBit->maskBlockCount)
-	+ sizeof(twoBit->maskStarts[0]) * twoBit->maskBlockCount
-	+ sizeof(twoBit->maskSizes[0]) * twoBit->maskBlockCount
-	+ sizeof(twoBit->reserved);
+return twoBitRecordSize(twoBit->size, twoBit->nBlockCount, twoBit->maskBlockCount);
 }
 
-void twoBitWriteOne(struct twoBit *twoBit, FILE *f)
-/* Write out one twoBit sequence to binary file. 
- * Note this does not include the name, which is
- * stored only in index. */
+void twoBitWriteRecordHead(FILE *f, bits32 size,
+	bits32 nBlockCount, bits32 *nStarts, bits32 *nSizes,
+	bits32 maskBlockCount, bits32 *maskStarts, bits32 *maskSizes)
+/* Write the part of the record of a sequence that comes before its packed
+ * bases: size, blocks of N, masked blocks and reserved word. */
 {
-writeOne(f, twoBit->size);
-writeOne(f, twoBit->nBlockCount);
-if (twoBit->nBlockCount > 0)
+bits32 reserved = 0;
+writeOne(f, size);
+writeOne(f, nBlockCount);
+if (nBlockCount > 0)
     {
-    fwrite(twoBit->nStarts, sizeof(twoBit->nStarts[0]), 
-    	twoBit->nBlockCount, f);
-    fwrite(twoBit->nSizes, sizeof(twoBit->nSizes[0]), 
-    	twoBit->nBlockCount, f);
+    fwrite(nStarts, sizeof(nStarts[0]), nBlockCount, f);
+    fwrite(nSizes, sizeof(nSizes[0]), nBlockCount, f);
     }
-writeOne(f, twoBit->maskBlockCount);
-if (twoBit->maskBlockCount > 0)
+writeOne(f, maskBlockCount);
+if (maskBlockCount > 0)
     {
-    fwrite(twoBit->maskStarts, sizeof(twoBit->maskStarts[0]), 
-    	twoBit->maskBlockCount, f);
-    fwrite(twoBit->maskSizes, sizeof(twoBit->maskSizes[0]), 
-    	twoBit->maskBlockCount, f);
+    fwrite(maskStarts, sizeof(maskStarts[0]), maskBlockCount, f);
+    fwrite(maskSizes, sizeof(maskSizes[0]), maskBlockCount, f);
     }
-writeOne(f, twoBit->reserved);
+writeOne(f, reserved);
+}
+
+void twoBitWriteOne(struct twoBit *twoBit, FILE *f)
+/* Write out one twoBit sequence to binary file. 
+ * Note this does not include the name, which is
+ * stored only in index. */
+{
+twoBitWriteRecordHead(f, twoBit->size, twoBit->nBlockCount, twoBit->nStarts,
+	twoBit->nSizes, twoBit->maskBlockCount, twoBit->maskStarts, twoBit->maskSizes);
 mustWrite(f, twoBit->data, packedSize(twoBit->size));
 }
 
-void twoBitWriteHeader(struct twoBit *twoBitList, FILE *f)
-/* Write out header portion of twoBit file, including initial
- * index */
+void twoBitWriteIndex(FILE *f, int seqCount, char **names, bits64 *recordSizes)
+/* Write out header portion of twoBit file, including index, for sequences
+ * whose records, written after it in the same order, take recordSizes
+ * bytes.  If a record would start past 4Gb, this writes version 1, with
+ * 64-bit offsets, instead of version 0. */
 {
 bits32 sig = twoBitSig;
 bits32 version = 0;
-bits32 seqCount = slCount(twoBitList);
 bits32 reserved = 0;
-bits32 offset = 0;
-struct twoBit *twoBit;
-long long counter = 0; /* check for 32 bit overflow */
+bits64 indexSize = 0, offset = 0;
+int i;
+
+/* Figure out location of first byte past index.
+ * Each index entry contains 4 bytes of offset information, 8 in
+ * version 1, and the name of the sequence, which is variable length. */
+for (i=0; i<seqCount; ++i)
+    {
+    int nameLen = strlen(names[i]);
+    if (nameLen > 255)
+        errAbort("name %s too long", names[i]);
+    indexSize += nameLen + 1;
+    }
+offset = sizeof(sig) + sizeof(version) + sizeof(bits32) + sizeof(reserved)
+    + indexSize + seqCount * sizeof(bits32);
+bits64 lastOffset = offset;
+for (i=0; i<seqCount - 1; ++i)
+    lastOffset += recordSizes[i];
+if (lastOffset > UINT_MAX)
+    {
+    version = 1;
+    offset += seqCount * sizeof(bits32);
+    }
 
 /* Write out fixed parts of header. */
+bits32 count = seqCount;
 writeOne(f, sig);
 writeOne(f, version);
-writeOne(f, seqCount);
+writeOne(f, count);
 writeOne(f, reserved);
 
-/* Figure out location of first byte past index.
- * Each index entry contains 4 bytes of offset information
- * and the name of the sequence, which is variable length. */
-offset = sizeof(sig) + sizeof(version) + sizeof(seqCount) + sizeof(reserved);
-for (twoBit = twoBitList; twoBit != NULL; twoBit = twoBit->next)
+/* Write out index. */
+for (i=0; i<seqCount; ++i)
     {
-    int nameLen = strlen(twoBit->name);
-    if (nameLen > 255)
-        errAbort("name %s too long", twoBit->name);
-    offset += nameLen + 1 + sizeof(bits32);
+    writeString(f, names[i]);
+    if (version == 1)
+        writeOne(f, offset);
+    else
+        {
+        bits32 offset32 = offset;
+        writeOne(f, offset32);
+        }
+    offset += recordSizes[i];
     }
+}
 
-/* Write out index. */
-for (twoBit = twoBitList; twoBit != NULL; twoBit = twoBit->next)
+void twoBitWriteHeader(struct twoBit *twoBitList, FILE *f)
+/* Write out header portion of twoBit file, including initial
+ * index */
+{
+int i, seqCount = slCount(twoBitList);
+char **names;
+bits64 *recordSizes;
+struct twoBit *twoBit;
+AllocArray(names, seqCount+1);
+AllocArray(recordSizes, seqCount+1);
+for (twoBit = twoBitList, i = 0; twoBit != NULL; twoBit = twoBit->next, ++i)
     {
-    int size = twoBitSizeInFile(twoBit);
-    writeString(f, twoBit->name);
-    writeOne(f, offset);
-    offset += size;
-    counter += (long long)size;
-    if (counter > UINT_MAX )
-        errAbort("Error in faToTwoBit, index overflow at %s. The 2bit format "
-                "does not support indexes larger than %dGb, \n"
-                "please split up into smaller files.\n", 
-                twoBit->name, UINT_MAX/1000000000);
+    names[i] = twoBit->name;
+    recordSizes[i] = twoBitSizeInFile(twoBit);
     }
+twoBitWriteIndex(f, seqCount, names, recordSizes);
+freeMem(names);
+freeMem(recordSizes);
 }
 
 void twoBitClose(struct twoBitFile **pTbf)
@@ -421,9 +488,9 @@ if (!twoBitSigRead(tbf, &isSwapped))
 tbf->isSwapped = isSwapped;
 tbf->fileName = cloneString(fileName);
 tbf->version = (*tbf->ourReadBits32)(tbf->f, isSwapped);
-if (tbf->version != 0)
+if (tbf->version != 0 && tbf->version != 1)
     {
-    errAbort("Can only handle version 0 of this file. This is version %d",
+    errAbort("Can only handle versions 0 and 1 of this file. This is version %d",
     	(int)tbf->version);
     }
 tbf->seqCount = (*tbf->ourReadBits32)(tbf->f, isSwapped);
@@ -436,9 +503,9 @@ struct twoBitFile *twoBitOpen(char *fileName)
 /* Open file, read in header and index.  
  * Squawk and die if there is a problem. */
 {
-boolean useUdc = FALSE;
-if (hasProtocol(fileName))
-    useUdc = TRUE;
+/* Local files go through udc too, which maps them into memory so that
+ * sequence reads need not copy the packed bases. */
+boolean useUdc = TRUE;
 struct twoBitFile *tbf = twoBitOpenReadHeader(fileName, useUdc);
 struct twoBitIndex *index;
 boolean isSwapped = tbf->isSwapped;
@@ -454,7 +521,10 @@ for (i=0; i<tbf->seqCount; ++i)
     if (!(*tbf->ourFastReadString)(f, name))
         errAbort("%s is truncated", fileName);
     lmAllocVar(hash->lm, index);
-    index->offset = (*tbf->ourReadBits32)(f, isSwapped);
+    if (tbf->version == 1)
+	index->offset = (*tbf->ourReadBits64)(f, isSwapped);
+    else
+	index->offset = (*tbf->ourReadBits32)(f, isSwapped);
     hashAddSaveName(hash, name, index, &index->name);
     slAddHead(&tbf->indexList, index);
     }
@@ -489,23 +559,26 @@ for (;;)
     }
 }
 
-static void twoBitSeekTo(struct twoBitFile *tbf, char *name)
-/* Seek to start of named record.  Abort if can't find it. */
+static bits64 twoBitSeqOffset(struct twoBitFile *tbf, char *name)
+/* Return offset of named record.  Abort if can't find it. */
 {
 if (tbf->bpt)
     {
     bits32 offset;
     if (!bptFileFind(tbf->bpt, name, strlen(name), &offset, sizeof(offset)))
 	 errAbort("%s is not in %s", name, tbf->bpt->fileName);
-    (*tbf->ourSeek)(tbf->f, offset);
-    }
-else
-    {
-    struct twoBitIndex *index = hashFindVal(tbf->hash, name);
-    if (index == NULL)
-	 errAbort("%s is not in %s", name, tbf->fileName);
-    (*tbf->ourSeek)(tbf->f, index->offset);
+    return offset;
     }
+struct twoBitIndex *index = hashFindVal(tbf->hash, name);
+if (index == NULL)
+     errAbort("%s is not in %s", name, tbf->fileName);
+return index->offset;
+}
+
+static void twoBitSeekTo(struct twoBitFile *tbf, char *name)
+/* Seek to start of named record.  Abort if can't find it. */
+{
+(*tbf->ourSeek)(tbf->f, twoBitSeqOffset(tbf, name));
 }
 
 static void readBlockCoords(struct twoBitFile *tbf, boolean isSwapped, bits32 *retBlockCount,
@@ -622,7 +695,8 @@ void *f = tbf->f;
 int i;
 int packByteCount, packedStart, packedEnd, remainder, midStart, midEnd;
 int outSize;
-UBYTE *packed, *packedAlloc;
+UBYTE *packed;
+void *packedAlloc;
 DNA *dna;
 
 /* Find offset in index and seek to it */
@@ -667,9 +741,8 @@ seq->dna[outSize] = 0;
 packedStart = (fragStart>>2);
 packedEnd = ((fragEnd+3)>>2);
 packByteCount = packedEnd - packedStart;
-packed = packedAlloc = needLargeMem(packByteCount);
 (*tbf->ourSeekCur)(f, packedStart);
-(*tbf->ourMustRead)(f, packed, packByteCount);
+packed = (*tbf->ourReadOrMap)(f, packByteCount, &packedAlloc);
 
 /* Handle case where everything is in one packed byte */
 if (packByteCount == 1)
@@ -789,6 +862,499 @@ struct dnaSeq *twoBitReadSeqFrag(struct twoBitFile *tbf, char *name,
 return twoBitReadSeqFragExt(tbf, name, fragStart, fragEnd, TRUE, NULL);
 }
 
+void twoBitCodesInit(struct twoBitCodes *codes, char base[4], char n)
+/* Set up codes to unpack base value v (T=0, C=1, A=2, G=3) as base[v], and the
+ * bases in blocks of N as n. */
+{
+int b, i;
+memcpy(codes->base, base, sizeof(codes->base));
+codes->n = n;
+for (b=0; b<256; ++b)
+    for (i=0; i<4; ++i)
+	{
+	codes->quad[b][i] = base[(b >> (6-i-i)) & 3];
+	/* Value v^2 is the complement of v. */
+	codes->rcQuad[b][i] = base[((b >> (i+i)) & 3) ^ 2];
+	}
+}
+
+static void unpackCodesRc(UBYTE *packed, int fragStart, int fragEnd,
+	struct twoBitCodes *codes, char *out)
+/* Unpack the reverse complement of bases fragStart to fragEnd into out, from
+ * its end back, a packed byte at a time through codes->rcQuad.  Packed starts
+ * with the byte holding fragStart. */
+{
+int size = fragEnd - fragStart;
+int skip = (fragStart&3);
+out += size;
+if (skip > 0)
+    {
+    int partCount = min(4 - skip, size);
+    out -= partCount;
+    memcpy(out, codes->rcQuad[*packed++] + 4 - skip - partCount, partCount);
+    size -= partCount;
+    }
+char *midEnd = out - (size & ~3);
+while (out > midEnd)
+    {
+    out -= 4;
+    memcpy(out, codes->rcQuad[*packed++], 4);
+    }
+if ((size&3) > 0)
+    memcpy(out - (size&3), codes->rcQuad[*packed] + 4 - (size&3), size&3);
+}
+
+static void unpackCodes(UBYTE *packed, int fragStart, int fragEnd,
+	struct twoBitCodes *codes, char *out)
+/* Unpack bases fragStart to fragEnd into out, a packed byte at a time through
+ * codes->quad.  Packed starts with the byte holding fragStart. */
+{
+int size = fragEnd - fragStart;
+int skip = (fragStart&3);
+if (skip > 0)
+    {
+    int partCount = min(4 - skip, size);
+    memcpy(out, codes->quad[*packed++] + skip, partCount);
+    out += partCount;
+    size -= partCount;
+    }
+char *midEnd = out + (size & ~3);
+while (out < midEnd)
+    {
+    memcpy(out, codes->quad[*packed++], 4);
+    out += 4;
+    }
+if ((size&3) > 0)
+    memcpy(out, codes->quad[*packed], size&3);
+}
+
+static void fillNBlocks(bits32 nBlockCount, bits32 *nStarts, bits32 *nSizes,
+	int fragStart, int fragEnd, boolean rc, char n, char *out)
+/* Set the bases of out, which holds fragStart to fragEnd, or its reverse
+ * complement if rc, that are in blocks of N to n. */
+{
+if (nBlockCount == 0)
+    return;
+int i, startIx = findGreatestLowerBound(nBlockCount, nStarts, fragStart);
+for (i=startIx; i<nBlockCount; ++i)
+    {
+    int s = nStarts[i];
+    int e = s + nSizes[i];
+    if (s >= fragEnd)
+	break;
+    if (s < fragStart)
+       s = fragStart;
+    if (e > fragEnd)
+       e = fragEnd;
+    if (s < e)
+	memset(out + (rc ? fragEnd - e : s - fragStart), n, e - s);
+    }
+}
+
+struct fragRef
+/* Where a fragment is in the file, to sort them by. */
+    {
+    bits64 offset;	/* Offset of record of sequence. */
+    bits32 start;	/* Start in sequence. */
+    int ix;		/* Index of fragment. */
+    };
+
+static int fragRefByte(struct fragRef *ref, int k)
+/* Return byte k of the sort key, the start and then the offset, least
+ * significant first. */
+{
+return (k < 4 ? (ref->start >> (8*k)) : (ref->offset >> (8*(k-4)))) & 0xff;
+}
+
+static void fragRefSort(struct fragRef *refs, int count)
+/* Sort refs by offset and start, keeping the order of equal keys.  This is
+ * a radix sort a byte at a time, skipping the bytes all keys share. */
+{
+struct fragRef *tmp, *from = refs, *to;
+AllocArray(tmp, count);
+to = tmp;
+int k, i;
+for (k = 0; k < 12; ++k)
+    {
+    int counts[256];
+    memset(counts, 0, sizeof(counts));
+    for (i=0; i<count; ++i)
+	++counts[fragRefByte(&from[i], k)];
+    if (counts[fragRefByte(&from[0], k)] == count)
+	continue;
+    int b, pos = 0;
+    for (b=0; b<256; ++b)
+	{
+	int c = counts[b];
+	counts[b] = pos;
+	pos += c;
+	}
+    for (i=0; i<count; ++i)
+	to[counts[fragRefByte(&from[i], k)]++] = from[i];
+    struct fragRef *swap = from;
+    from = to;
+    to = swap;
+    }
+if (from != refs)
+    memcpy(refs, from, count * sizeof(refs[0]));
+freeMem(tmp);
+}
+
+typedef void (*fragPackedFunc)(struct twoBitFrag *frag, int fragIx, UBYTE *packed,
+	bits32 nBlockCount, bits32 *nStarts, bits32 *nSizes, void *context);
+/* Handle the packed bases of a fragment, starting with the byte holding
+ * frag->start, and the blocks of N of its sequence. */
+
+static void forEachFragPacked(struct twoBitFile *tbf, struct twoBitFrag *frags,
+	int fragCount, fragPackedFunc func, void *context)
+/* Call func on the packed bases of each fragment, in order of their place in
+ * the file: the header and blocks of N of each sequence are read once, and
+ * the packed bases of fragments less than twoBitMaxFragGap bytes apart are
+ * read together, up to twoBitMaxFragRun bytes at a time. */
+{
+if (fragCount == 0)
+    return;
+boolean isSwapped = tbf->isSwapped;
+void *f = tbf->f;
+int i;
+
+/* Sort fragments by sequence and start.  Neighbours often name the same
+ * sequence, so look up its offset again only when the name changes. */
+struct fragRef *refs;
+AllocArray(refs, fragCount);
+char *lastName = NULL;
+bits64 lastOffset = 0;
+boolean unsorted = FALSE;
+for (i=0; i<fragCount; ++i)
+    {
+    char *name = frags[i].name;
+    if (lastName == NULL || (name != lastName && !sameString(name, lastName)))
+	{
+	lastOffset = twoBitSeqOffset(tbf, name);
+	lastName = name;
+	}
+    if (frags[i].start < 0)
+	errAbort("twoBitReadSeqFrag in %s start (%d) < 0", name, frags[i].start);
+    refs[i].offset = lastOffset;
+    refs[i].start = frags[i].start;
+    refs[i].ix = i;
+    if (i > 0 && (refs[i].offset < refs[i-1].offset ||
+	(refs[i].offset == refs[i-1].offset && refs[i].start < refs[i-1].start)))
+	unsorted = TRUE;
+    }
+if (unsorted)
+    fragRefSort(refs, fragCount);
+
+struct fragRef *ref = refs, *refEnd = refs + fragCount;
+while (ref < refEnd)
+    {
+    /* Read header and blocks of N of the sequence, and find its bases. */
+    bits64 seqOffset = ref->offset;
+    char *name = frags[ref->ix].name;
+    bits32 nBlockCount, *nStarts = NULL, *nSizes = NULL;
+    (*tbf->ourSeek)(f, seqOffset);
+    bits32 seqSize = (*tbf->ourReadBits32)(f, isSwapped);
+    readBlockCoords(tbf, isSwapped, &nBlockCount, &nStarts, &nSizes);
+    bits32 maskBlockCount = (*tbf->ourReadBits32)(f, isSwapped);
+    bits64 dataOffset = (bits64)seqOffset + 3*sizeof(bits32) + 2*sizeof(bits32)*(bits64)nBlockCount
+	+ 2*sizeof(bits32)*(bits64)maskBlockCount + sizeof(bits32);
+
+    struct fragRef *seqEnd = ref;
+    while (seqEnd < refEnd && seqEnd->offset == seqOffset)
+	{
+	struct twoBitFrag *frag = &frags[seqEnd->ix];
+	if (frag->end > seqSize)
+	    errAbort("twoBitReadSeqFrag in %s end (%d) >= seqSize (%d)", name, frag->end, seqSize);
+	if (frag->start >= frag->end)
+	    errAbort("twoBitReadSeqFrag in %s start (%d) >= end (%d)", name, frag->start, frag->end);
+	++seqEnd;
+	}
+
+    /* Read runs of fragments close to each other in one go. */
+    while (ref < seqEnd)
+	{
+	int packedStart = (frags[ref->ix].start>>2);
+	int packedEnd = ((frags[ref->ix].end+3)>>2);
+	struct fragRef *runEnd = ref + 1;
+	for (; runEnd < seqEnd; ++runEnd)
+	    {
+	    struct twoBitFrag *frag = &frags[runEnd->ix];
+	    int fragPackedEnd = ((frag->end+3)>>2);
+	    if ((frag->start>>2) > packedEnd + twoBitMaxFragGap)
+		break;
+	    if (fragPackedEnd > packedEnd)
+		{
+		if (fragPackedEnd - packedStart > twoBitMaxFragRun)
+		    break;
+		packedEnd = fragPackedEnd;
+		}
+	    }
+	(*tbf->ourSeek)(f, dataOffset + packedStart);
+	void *packedAlloc;
+	UBYTE *packed = (*tbf->ourReadOrMap)(f, packedEnd - packedStart, &packedAlloc);
+	for (; ref < runEnd; ++ref)
+	    {
+	    struct twoBitFrag *frag = &frags[ref->ix];
+	    func(frag, ref->ix, packed + (frag->start>>2) - packedStart,
+		nBlockCount, nStarts, nSizes, context);
+	    }
+	freez(&packedAlloc);
+	}
+    freez(&nStarts);
+    freez(&nSizes);
+    }
+freez(&refs);
+}
+
+static void unpackFrag(struct twoBitFrag *frag, int fragIx, UBYTE *packed,
+	bits32 nBlockCount, bits32 *nStarts, bits32 *nSizes, void *context)
+/* Unpack the fragment into its out, as coded by the codes in context. */
+{
+struct twoBitCodes *codes = context;
+if (frag->rc)
+    unpackCodesRc(packed, frag->start, frag->end, codes, frag->out);
+else
+    unpackCodes(packed, frag->start, frag->end, codes, frag->out);
+fillNBlocks(nBlockCount, nStarts, nSizes, frag->start, frag->end,
+    frag->rc, codes->n, frag->out);
+}
+
+void twoBitReadFragsCodes(struct twoBitFile *tbf, struct twoBitFrag *frags,
+	int fragCount, struct twoBitCodes *codes)
+/* Read each fragment into its out, as coded by codes, reverse complemented
+ * for fragments with rc set.  The fragments are read in order of their place
+ * in the file: the header and blocks of N of each sequence are read once, and
+ * the packed bases of fragments less than twoBitMaxFragGap bytes apart are
+ * read together, up to twoBitMaxFragRun bytes at a time. */
+{
+forEachFragPacked(tbf, frags, fragCount, unpackFrag, codes);
+}
+
+/* Index in A, C, G, T order of base value v (T=0, C=1, A=2, G=3). */
+static int acgtIx[4] = {3, 1, 0, 2};
+
+static void countBases(UBYTE *packed, int start, int end, bits32 counts[4])
+/* Add the count of each base value in start to end to counts.  Packed starts
+ * with the byte holding base 0.  Whole 64-bit words are counted by popcount:
+ * the high bit of a base is set for A and G, the low bit for C and G. */
+{
+int i = start;
+for (; i < end && (i&3) != 0; ++i)
+    counts[(packed[i>>2] >> (6 - 2*(i&3))) & 3] += 1;
+UBYTE *p = packed + (i>>2);
+UBYTE *wordEnd = p + (max(0, end - i) >> 5) * 8;
+bits64 low = 0x5555555555555555ULL;
+bits32 a = 0, c = 0, g = 0, total = 0;
+for (; p < wordEnd; p += 8)
+    {
+    bits64 word;
+    memcpy(&word, p, 8);
+    bits64 hi = (word >> 1) & low, lo = word & low;
+    int gCount = __builtin_popcountll(hi & lo);
+    g += gCount;
+    a += __builtin_popcountll(hi) - gCount;
+    c += __builtin_popcountll(lo) - gCount;
+    total += 32;
+    }
+counts[2] += a;
+counts[1] += c;
+counts[3] += g;
+counts[0] += total - a - c - g;
+for (i += total; i < end; ++i)
+    counts[(packed[i>>2] >> (6 - 2*(i&3))) & 3] += 1;
+}
+
+static void countPairs(UBYTE *packed, int start, int end, bits32 counts[16])
+/* Add the count of each pair of adjacent base values in start to end, as
+ * first*4 + second, to counts.  Packed starts with the byte holding base 0. */
+{
+if (end - start < 2)
+    return;
+int i = start;
+int prev = (packed[i>>2] >> (6 - 2*(i&3))) & 3;
+for (++i; i < end && (i&3) != 0; ++i)
+    {
+    int v = (packed[i>>2] >> (6 - 2*(i&3))) & 3;
+    counts[(prev<<2) | v] += 1;
+    prev = v;
+    }
+/* The three pairs within a byte, and the one across to the next. */
+UBYTE *p = packed + (i>>2), *byteEnd = p + (max(0, end - i) >> 2);
+for (; p < byteEnd; ++p, i += 4)
+    {
+    int b = *p;
+    counts[(prev<<2) | (b>>6)] += 1;
+    counts[(b>>4) & 15] += 1;
+    counts[(b>>2) & 15] += 1;
+    counts[b & 15] += 1;
+    prev = b & 3;
+    }
+for (; i < end; ++i)
+    {
+    int v = (packed[i>>2] >> (6 - 2*(i&3))) & 3;
+    counts[(prev<<2) | v] += 1;
+    prev = v;
+    }
+}
+
+struct fragCounts
+/* Where countFrag puts the counts of each fragment. */
+    {
+    bits32 *baseCounts, *pairCounts;
+    };
+
+static void countFrag(struct twoBitFrag *frag, int fragIx, UBYTE *packed,
+	bits32 nBlockCount, bits32 *nStarts, bits32 *nSizes, void *context)
+/* Count the bases and pairs of the fragment between its blocks of N. */
+{
+struct fragCounts *fc = context;
+bits32 counts[4] = {0, 0, 0, 0}, pairs[16];
+int i, shift = (frag->start & ~3), start = frag->start, end = frag->end;
+memset(pairs, 0, sizeof(pairs));
+i = (nBlockCount > 0 ? findGreatestLowerBound(nBlockCount, nStarts, start) : 0);
+for (; start < end; ++i)
+    {
+    int s = end, e = end;
+    if (i < nBlockCount && nStarts[i] < end)
+	{
+	s = max(start, (int)nStarts[i]);
+	e = max(start, (int)(nStarts[i] + nSizes[i]));
+	}
+    if (s > start)
+	{
+	countBases(packed, start - shift, s - shift, counts);
+	if (fc->pairCounts != NULL)
+	    countPairs(packed, start - shift, s - shift, pairs);
+	}
+    start = max(start, e);
+    }
+bits32 *baseCounts = fc->baseCounts + twoBitBaseCountSize*(bits64)fragIx;
+int v, w;
+for (v=0; v<4; ++v)
+    baseCounts[acgtIx[v]] = counts[v];
+baseCounts[4] = (frag->end - frag->start) - counts[0] - counts[1] - counts[2] - counts[3];
+if (fc->pairCounts != NULL)
+    {
+    bits32 *pairCounts = fc->pairCounts + twoBitPairCountSize*(bits64)fragIx;
+    for (v=0; v<4; ++v)
+	for (w=0; w<4; ++w)
+	    pairCounts[4*acgtIx[v] + acgtIx[w]] = pairs[4*v + w];
+    }
+}
+
+void twoBitCountFrags(struct twoBitFile *tbf, struct twoBitFrag *frags,
+	int fragCount, bits32 *baseCounts, bits32 *pairCounts)
+/* Count the bases of each fragment i into baseCounts[twoBitBaseCountSize*i],
+ * as A, C, G, T and N, straight from the packed bases.  If pairCounts is
+ * non-NULL, count the pairs of adjacent bases outside blocks of N into
+ * pairCounts[twoBitPairCountSize*i], as AA, AC, AG, AT, CA and so on.  The
+ * fragments are read like in twoBitReadFragsCodes, and their out and rc are
+ * not used. */
+{
+struct fragCounts fc;
+fc.baseCounts = baseCounts;
+fc.pairCounts = pairCounts;
+forEachFragPacked(tbf, frags, fragCount, countFrag, &fc);
+}
+
+static void lowerMaskBlocks(bits32 maskBlockCount, bits32 *maskStarts, bits32 *maskSizes,
+	int fragStart, int fragEnd, char *out)
+/* Lower the case of the bases of out, which holds fragStart to fragEnd, that
+ * are in masked blocks. */
+{
+if (maskBlockCount == 0)
+    return;
+int i, startIx = findGreatestLowerBound(maskBlockCount, maskStarts, fragStart);
+for (i=startIx; i<maskBlockCount; ++i)
+    {
+    int s = maskStarts[i];
+    int e = s + maskSizes[i];
+    if (s >= fragEnd)
+	break;
+    if (s < fragStart)
+       s = fragStart;
+    if (e > fragEnd)
+       e = fragEnd;
+    if (s < e)
+	toLowerN(out + s - fragStart, e - s);
+    }
+}
+
+void twoBitWriteSeqFa(struct twoBitFile *tbf, char *name, int lineSize, FILE *f)
+/* Write sequence to f as FASTA, lineSize bases per line, with the masked
+ * blocks in lower case.  The header and blocks of the sequence are read
+ * once and its bases twoBitFaChunk at a time, so memory use does not grow
+ * with its size. */
+{
+boolean isSwapped = tbf->isSwapped;
+void *file = tbf->f;
+bits32 nBlockCount, *nStarts = NULL, *nSizes = NULL;
+bits32 maskBlockCount, *maskStarts = NULL, *maskSizes = NULL;
+bits64 seqOffset = twoBitSeqOffset(tbf, name);
+if (lineSize <= 0)
+    errAbort("twoBitWriteSeqFa: lineSize (%d) <= 0", lineSize);
+(*tbf->ourSeek)(file, seqOffset);
+bits32 seqSize = (*tbf->ourReadBits32)(file, isSwapped);
+readBlockCoords(tbf, isSwapped, &nBlockCount, &nStarts, &nSizes);
+readBlockCoords(tbf, isSwapped, &maskBlockCount, &maskStarts, &maskSizes);
+bits64 dataOffset = (bits64)seqOffset + 3*sizeof(bits32) + 2*sizeof(bits32)*(bits64)nBlockCount
+    + 2*sizeof(bits32)*(bits64)maskBlockCount + sizeof(bits32);
+
+struct twoBitCodes codes;
+char base[4] = {'T', 'C', 'A', 'G'};
+twoBitCodesInit(&codes, base, 'N');
+char *dna = needLargeMem(twoBitFaChunk);
+fprintf(f, ">%s\n", name);
+bits32 start;
+int col = 0;
+for (start = 0; start < seqSize; start += twoBitFaChunk)
+    {
+    int end = (seqSize - start > twoBitFaChunk ? start + twoBitFaChunk : seqSize);
+    int packedStart = (start>>2);
+    (*tbf->ourSeek)(file, dataOffset + packedStart);
+    void *packedAlloc;
+    UBYTE *packed = (*tbf->ourReadOrMap)(file, ((end+3)>>2) - packedStart, &packedAlloc);
+    unpackCodes(packed, start, end, &codes, dna);
+    freez(&packedAlloc);
+    fillNBlocks(nBlockCount, nStarts, nSizes, start, end, FALSE, 'N', dna);
+    lowerMaskBlocks(maskBlockCount, maskStarts, maskSizes, start, end, dna);
+
+    /* Lines may go on from one chunk to the next. */
+    char *s = dna;
+    int left = end - start;
+    while (left > 0)
+	{
+	int size = min(left, lineSize - col);
+	mustWrite(f, s, size);
+	s += size;
+	left -= size;
+	col += size;
+	if (col == lineSize)
+	    {
+	    fputc('\n', f);
+	    col = 0;
+	    }
+	}
+    }
+if (col > 0)
+    fputc('\n', f);
+freez(&dna);
+freez(&nStarts);
+freez(&nSizes);
+freez(&maskStarts);
+freez(&maskSizes);
+}
+
+void twoBitReadSeqFragCodes(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, struct twoBitCodes *codes, char *out)
+/* Read bases fragStart to fragEnd of sequence into out, which has room for
+ * them, as coded by codes.  Unlike twoBitReadSeqFrag this does not allocate
+ * a dnaSeq, and the masked blocks, which only change case, are not read. */
+{
+struct twoBitFrag frag = {name, fragStart, fragEnd, FALSE, out};
+twoBitReadFragsCodes(tbf, &frag, 1, codes);
+}
+
 int twoBitSeqSize(struct twoBitFile *tbf, char *name)
 /* Return size of sequence in two bit file in bases. */
 {
@@ -26,7 +26,7 @@ struct twoBitIndex
     {
     struct twoBitIndex *next;	/* Next in list. */
     char *name;			/* Name - allocated in hash */
-    bits32 offset;		/* Offset in file. */
+    bits64 offset;		/* Offset in file, 64 bits in version 1 files. */
     };
 
 struct twoBitFile
@@ -36,7 +36,7 @@ struct twoBitFile
     char *fileName;	/* Name of this file, for error reporting. */
     void *f;            /* Open file. */
     boolean isSwapped;	/* Is byte-swapping needed. */
-    bits32 version;	/* Version of .2bit file */
+    bits32 version;	/* Version of .2bit file, 1 if offsets are 64 bits */
     bits32 seqCount;	/* Number of sequences. */
     bits32 reserved;	/* Reserved, always zero for now. */
     struct twoBitIndex *indexList;	/* List of sequence. */
@@ -49,9 +49,11 @@ struct twoBitFile
     void (*ourSeek)(void *file, bits64 offset);
     void (*ourSeekCur)(void *file, bits64 offset);
     bits32 (*ourReadBits32)(void *f, boolean isSwapped);
+    bits64 (*ourReadBits64)(void *f, boolean isSwapped);
     void (*ourClose)(void *pFile);
     boolean (*ourFastReadString)(void *f, char buf[256]);
     void (*ourMustRead)(void *file, void *buf, size_t size);
+    void *(*ourReadOrMap)(void *file, size_t size, void **retBuf);
     };
 
 struct twoBitSpec
@@ -95,6 +97,65 @@ struct dnaSeq *twoBitReadSeqFrag(struct twoBitFile *tbf, char *name,
  * be mixed case, with repeats in lower case and rest in
  * upper case. */
 
+struct twoBitCodes
+/* Bytes to unpack bases to, for twoBitReadSeqFragCodes. */
+    {
+    char base[4];		/* Byte of base value v (T=0, C=1, A=2, G=3). */
+    char n;			/* Byte of bases in blocks of N. */
+    char quad[256][4];		/* Bytes of the four bases of each packed byte. */
+    char rcQuad[256][4];	/* Same, reverse complemented. */
+    };
+
+void twoBitCodesInit(struct twoBitCodes *codes, char base[4], char n);
+/* Set up codes to unpack base value v (T=0, C=1, A=2, G=3) as base[v], and the
+ * bases in blocks of N as n. */
+
+void twoBitReadSeqFragCodes(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, struct twoBitCodes *codes, char *out);
+/* Read bases fragStart to fragEnd of sequence into out, which has room for
+ * them, as coded by codes.  Unlike twoBitReadSeqFrag this does not allocate
+ * a dnaSeq, and the masked blocks, which only change case, are not read. */
+
+struct twoBitFrag
+/* A fragment to read with twoBitReadFragsCodes. */
+    {
+    char *name;			/* Name of sequence. */
+    int start, end;		/* Bases to read. */
+    boolean rc;			/* Put reverse complement in out. */
+    char *out;			/* Where to put them, room for end - start bytes. */
+    };
+
+#define twoBitMaxFragGap 4096	/* Read fragments fewer packed bytes apart together. */
+#define twoBitMaxFragRun (8*1024*1024)	/* But read at most this many bytes at once. */
+
+void twoBitReadFragsCodes(struct twoBitFile *tbf, struct twoBitFrag *frags,
+	int fragCount, struct twoBitCodes *codes);
+/* Read each fragment into its out, as coded by codes, reverse complemented
+ * for fragments with rc set.  The fragments are read in order of their place
+ * in the file: the header and blocks of N of each sequence are read once, and
+ * the packed bases of fragments less than twoBitMaxFragGap bytes apart are
+ * read together, up to twoBitMaxFragRun bytes at a time. */
+
+#define twoBitBaseCountSize 5	/* Counts of A, C, G, T and N. */
+#define twoBitPairCountSize 16	/* Counts of AA, AC, ..., TT. */
+
+void twoBitCountFrags(struct twoBitFile *tbf, struct twoBitFrag *frags,
+	int fragCount, bits32 *baseCounts, bits32 *pairCounts);
+/* Count the bases of each fragment i into baseCounts[twoBitBaseCountSize*i],
+ * as A, C, G, T and N, straight from the packed bases.  If pairCounts is
+ * non-NULL, count the pairs of adjacent bases outside blocks of N into
+ * pairCounts[twoBitPairCountSize*i], as AA, AC, AG, AT, CA and so on.  The
+ * fragments are read like in twoBitReadFragsCodes, and their out and rc are
+ * not used. */
+
+#define twoBitFaChunk (4*1024*1024)	/* Bases twoBitWriteSeqFa reads at once. */
+
+void twoBitWriteSeqFa(struct twoBitFile *tbf, char *name, int lineSize, FILE *f);
+/* Write sequence to f as FASTA, lineSize bases per line, with the masked
+ * blocks in lower case.  The header and blocks of the sequence are read
+ * once and its bases twoBitFaChunk at a time, so memory use does not grow
+ * with its size. */
+
 struct twoBit *twoBitFromDnaSeq(struct dnaSeq *seq, boolean doMask);
 /* Convert dnaSeq representation in memory to twoBit representation.
  * If doMask is true interpret lower-case letters as masked. */
@@ -109,6 +170,22 @@ void twoBitFreeList(struct twoBit **pList);
 /* Free a list of dynamically allocated twoBit's */
 
 
+bits64 twoBitRecordSize(bits32 size, bits32 nBlockCount, bits32 maskBlockCount);
+/* Return size in file of the record of a sequence of size bases, with that
+ * many blocks of N and masked blocks. */
+
+void twoBitWriteRecordHead(FILE *f, bits32 size,
+	bits32 nBlockCount, bits32 *nStarts, bits32 *nSizes,
+	bits32 maskBlockCount, bits32 *maskStarts, bits32 *maskSizes);
+/* Write the part of the record of a sequence that comes before its packed
+ * bases: size, blocks of N, masked blocks and reserved word. */
+
+void twoBitWriteIndex(FILE *f, int seqCount, char **names, bits64 *recordSizes);
+/* Write out header portion of twoBit file, including index, for sequences
+ * whose records, written after it in the same order, take recordSizes
+ * bytes.  If a record would start past 4Gb, this writes version 1, with
+ * 64-bit offsets, instead of version 0. */
+
 void twoBitWriteOne(struct twoBit *twoBit, FILE *f);
 /* Write out one twoBit sequence to binary file. 
  * Note this does not include the name, which is
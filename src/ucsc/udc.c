@@ -23,13 +23,16 @@
  * The bitmap file contains time stamp and size data as well as an array with one bit
  * for each block of the file that has been fetched.  Currently the block size is 8K. */
 
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
 
 #ifdef __sun
 # define _XPG6
 #endif
 
 #include <sys/file.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 #include <locale.h>
 #include "common.h"
 #include "hash.h"
@@ -42,33 +45,14 @@
 #include "cheapcgi.h"
 #include "udc.h"
 #include "htmlPage.h"
+#include "https.h"
+#include "errCatch.h"
+#include <pthread.h>
 
 /* The stdio stream we'll use to output statistics on file i/o.  Off by default. */
 FILE *udcLogStream = NULL;
 static char *defaultDir = "/tmp/udcCache";
 
-struct ioStats
-/* Statistics concerning reads and seeks. */
-{
-    bits64 numSeeks;            /* The number of seeks on this file */
-    bits64 numReads;            /* The number of reads from this file */
-    bits64 bytesRead;           /* The number of bytes read from this file */
-    bits64 numWrites;           /* The number of writes to this file */
-    bits64 bytesWritten;        /* The number of bytes written to this file */
-};
-
-struct ios
-/* Statistics concerning reads and seeks for sparse, bitmap, url, and to us. */
-{
-    struct ioStats bit;         /* Statistics on file i/o to the bitmap file. */
-    struct ioStats sparse;      /* Statistics on file i/o to the sparse data file. */
-    struct ioStats udc;         /* Statistics on file i/o from the application to us. */
-    struct ioStats net;         /* Statistics on file i/o over the network. */
-    bits64 numConnects;         /* The number of socket connections made. */
-    bits64 numReuse;            /* The number of socket reuses. */
-};
-
-
 #define udcBlockSize (8*1024)
 /* All fetch requests are rounded up to block size. */
 
@@ -123,6 +107,7 @@ struct udcFile
     char *sparseFileName;	/* Name of sparse data file. */
     char *redirFileName;	/* Name of redir file. */
     int fdSparse;		/* File descriptor for sparse data file. */
+    int fdLock;			/* File descriptor for lock file, or -1 if not locking. */
     boolean sparseReadAhead;    /* Read-ahead has something in the buffer */
     char *sparseReadAheadBuf;   /* Read-ahead buffer, if any */
     bits64 sparseRAOffset;      /* Read-ahead buffer offset */
@@ -132,6 +117,14 @@ struct udcFile
     bits32 bitmapVersion;	/* Version of associated bitmap we were opened with. */
     struct connInfo connInfo;   /* Connection info for open net connection. */
     struct ios ios;             /* Statistics on file access. */
+    struct udcMemFile *mem;	/* Blocks in memory cache if that is in use, else NULL. */
+    enum udcAccessPattern access;	/* Access pattern hint. */
+    boolean sequential;		/* TRUE if the last read continued the one before. */
+    boolean haveLastRead;	/* TRUE once lastReadEnd is set. */
+    bits64 lastReadEnd;		/* End of last read. */
+    bits64 readAheadWindow;	/* Current read-ahead size, grows while reading sequentially. */
+    struct udcFile *openPrev, *openNext;	/* Neighbours in list of open files. */
+    char *map;			/* Whole of a transparent file mapped read-only, or NULL. */
     };
 
 struct udcBitmap
@@ -150,11 +143,28 @@ struct udcBitmap
 static char *bitmapName = "bitmap";
 static char *sparseDataName = "sparseData";
 static char *redirName = "redir";
+static char *lockName = "lock";
 #define udcBitmapHeaderSize (64)
 static int cacheTimeout = 0;
 
 #define MAX_SKIP_TO_SAVE_RECONNECT (udcMaxBytesPerRemoteFetch / 2)
 
+static int fetchParallelism = 4;
+/* Maximum number of connections udcPrefetch opens at once. */
+
+#define udcMaxFetchParallelism 64
+/* Highest fetchParallelism that can be set, so one query can't open
+ * thousands of connections to a server. */
+
+#define udcMinReadAhead (udcBlockSize * 8)
+/* Read-ahead window of the first sequential read that misses the cache. */
+
+static bits64 readAheadMax = 4*1024*1024;
+/* The read-ahead window doubles on each sequential miss up to this. */
+
+static enum udcAccessPattern defaultAccess = udcAccessAuto;
+/* Access pattern hint of newly opened files. */
+
 static off_t ourMustLseek(struct ioStats *ioStats, int fd, off_t offset, int whence)
 {
 ioStats->numSeeks++;
@@ -195,9 +205,7 @@ return fread(buf, size, nmemb, stream);
 static void udcReadAndIgnore(struct ioStats *ioStats, int sd, bits64 size)
 /* Read size bytes from sd and return. */
 {
-static char *buf = NULL;
-if (buf == NULL)
-    buf = needMem(udcBlockSize);
+char buf[udcBlockSize];	/* On the stack, so threads reading other files don't share it. */
 bits64 remaining = size, total = 0;
 while (remaining > 0)
     {
@@ -421,14 +429,776 @@ retInfo->size = status.st_size;
 return TRUE;
 }
 
+static enum udcCacheType cacheType = udcCacheDisk;
+
 static bool udcCacheEnabled()
-/* TRUE if caching is activated */
+/* TRUE if caching to disk is activated */
+{
+return (defaultDir != NULL && cacheType == udcCacheDisk);
+}
+
+static boolean udcUsesSparseFd(struct udcFile *file)
+/* TRUE if reads go through file->fdSparse, either the sparse cache file or,
+ * for transparent files, the file itself. */
+{
+return file->bits != NULL || (sameString(file->protocol, "transparent") && file->map == NULL);
+}
+
+static void udcAdviseMap(struct udcFile *file)
+/* Tell the kernel how the mapping of file will be read, so it reads ahead a lot
+ * or not at all. */
+{
+#ifndef WIN32
+if (file->map == NULL)
+    return;
+int advice = POSIX_MADV_NORMAL;
+if (file->access == udcAccessSequential)
+    advice = POSIX_MADV_SEQUENTIAL;
+else if (file->access == udcAccessRandom)
+    advice = POSIX_MADV_RANDOM;
+posix_madvise(file->map, file->size, advice);
+#endif
+}
+
+void udcSetCacheType(enum udcCacheType type)
+/* Set where udcFiles opened from now on keep the data they fetch. */
+{
+cacheType = type;
+}
+
+enum udcCacheType udcGetCacheType()
+/* Return where newly opened udcFiles keep the data they fetch. */
+{
+return cacheType;
+}
+
+/********* Section for I/O statistics **********/
+
+static struct udcFile *openHead = NULL, *openTail = NULL;	/* Open files, oldest first. */
+static struct ios closedIos;		/* Sums of statistics of files closed since reset. */
+static pthread_mutex_t iosMutex = PTHREAD_MUTEX_INITIALIZER;	/* Protects the above. */
+
+static void ioStatsAdd(struct ioStats *sum, struct ioStats *stats)
+/* Add stats into sum. */
+{
+sum->numSeeks += stats->numSeeks;
+sum->numReads += stats->numReads;
+sum->bytesRead += stats->bytesRead;
+sum->numWrites += stats->numWrites;
+sum->bytesWritten += stats->bytesWritten;
+}
+
+static void iosAdd(struct ios *sum, struct ios *ios)
+/* Add ios into sum. */
+{
+ioStatsAdd(&sum->bit, &ios->bit);
+ioStatsAdd(&sum->sparse, &ios->sparse);
+ioStatsAdd(&sum->udc, &ios->udc);
+ioStatsAdd(&sum->net, &ios->net);
+sum->numConnects += ios->numConnects;
+sum->numReuse += ios->numReuse;
+}
+
+static void iosAddOpen(struct udcFile *file)
+/* Put file on the list of open files. */
+{
+pthread_mutex_lock(&iosMutex);
+file->openPrev = openTail;
+file->openNext = NULL;
+if (openTail != NULL)
+    openTail->openNext = file;
+else
+    openHead = file;
+openTail = file;
+pthread_mutex_unlock(&iosMutex);
+}
+
+static void iosRemoveOpen(struct udcFile *file)
+/* Take file off the list of open files, adding its statistics to closedIos. */
+{
+pthread_mutex_lock(&iosMutex);
+if (file->openPrev != NULL)
+    file->openPrev->openNext = file->openNext;
+else
+    openHead = file->openNext;
+if (file->openNext != NULL)
+    file->openNext->openPrev = file->openPrev;
+else
+    openTail = file->openPrev;
+iosAdd(&closedIos, &file->ios);
+pthread_mutex_unlock(&iosMutex);
+}
+
+void udcFileIoStats(struct udcFile *file, struct ios *retIos)
+/* Copy statistics of file so far into retIos. */
+{
+*retIos = file->ios;
+}
+
+void udcTotalIoStats(struct ios *retIos)
+/* Put sum of statistics of all files, open or closed, since the last
+ * udcResetIoStats into retIos. */
+{
+pthread_mutex_lock(&iosMutex);
+*retIos = closedIos;
+struct udcFile *file;
+for (file = openHead; file != NULL; file = file->openNext)
+    iosAdd(retIos, &file->ios);
+pthread_mutex_unlock(&iosMutex);
+}
+
+struct udcFileIos *udcOpenFileIoStats()
+/* Return statistics of each file now open, in order of opening.  Free with
+ * udcFileIosFreeList. */
+{
+struct udcFileIos *list = NULL, *el;
+pthread_mutex_lock(&iosMutex);
+struct udcFile *file;
+for (file = openHead; file != NULL; file = file->openNext)
+    {
+    AllocVar(el);
+    el->url = cloneString(file->url);
+    el->ios = file->ios;
+    slAddHead(&list, el);
+    }
+pthread_mutex_unlock(&iosMutex);
+slReverse(&list);
+return list;
+}
+
+void udcFileIosFreeList(struct udcFileIos **pList)
+/* Free a list from udcOpenFileIoStats. */
+{
+struct udcFileIos *el, *next;
+for (el = *pList; el != NULL; el = next)
+    {
+    next = el->next;
+    freeMem(el->url);
+    freeMem(el);
+    }
+*pList = NULL;
+}
+
+void udcResetIoStats()
+/* Zero the statistics of all open files and the sums of closed ones. */
+{
+pthread_mutex_lock(&iosMutex);
+ZeroVar(&closedIos);
+struct udcFile *file;
+for (file = openHead; file != NULL; file = file->openNext)
+    ZeroVar(&file->ios);
+pthread_mutex_unlock(&iosMutex);
+}
+
+/********* Section for the in-memory cache **********/
+
+struct udcMemBlock
+/* One block of the memory cache, linked into the least recently used list. */
+    {
+    struct udcMemBlock *prev, *next;	/* Neighbors in LRU list, most recent at head. */
+    struct udcMemFile *memFile;		/* File this is a block of. */
+    int blockIx;			/* Index of block in file. */
+    char data[udcBlockSize];		/* Block data, only partly used at end of file. */
+    };
+
+struct udcMemFile
+/* The cached blocks of one url.  Shared by all udcFiles open on the url, and
+ * kept after they are closed for as long as some of its blocks are. */
+    {
+    char *url;			/* Url, also key in memFiles. */
+    bits64 size;		/* Remote size when the blocks were fetched. */
+    time_t updateTime;		/* Remote update time when the blocks were fetched. */
+    int blockCount;		/* Size of blocks array. */
+    struct udcMemBlock **blocks;	/* Cached blocks, NULL where not cached. */
+    int cachedCount;		/* Number of non-NULL blocks. */
+    int refCount;		/* Number of open udcFiles using this. */
+    };
+
+static struct hash *memFiles = NULL;	/* udcMemFiles keyed by url. */
+static struct udcMemBlock *memLruHead = NULL, *memLruTail = NULL;
+static bits64 memBudget = 128*1024*1024;	/* Most bytes of blocks to keep. */
+static bits64 memUsed = 0;			/* Bytes of blocks now kept. */
+static bits64 memEvictions = 0;			/* Blocks dropped to stay in budget. */
+static pthread_mutex_t memMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void memLruUnlink(struct udcMemBlock *block)
+/* Take block out of LRU list. */
+{
+if (block->prev)
+    block->prev->next = block->next;
+else
+    memLruHead = block->next;
+if (block->next)
+    block->next->prev = block->prev;
+else
+    memLruTail = block->prev;
+block->prev = block->next = NULL;
+}
+
+static void memLruPushHead(struct udcMemBlock *block)
+/* Put block at most recently used end of LRU list. */
+{
+block->prev = NULL;
+block->next = memLruHead;
+if (memLruHead)
+    memLruHead->prev = block;
+else
+    memLruTail = block;
+memLruHead = block;
+}
+
+static void memFileFreeIfUnused(struct udcMemFile *memFile)
+/* Free memFile if no udcFile uses it and it has no blocks left. */
+{
+if (memFile->refCount == 0 && memFile->cachedCount == 0)
+    {
+    hashRemove(memFiles, memFile->url);
+    freeMem(memFile->url);
+    freeMem(memFile->blocks);
+    freeMem(memFile);
+    }
+}
+
+static void memDropBlock(struct udcMemBlock *block)
+/* Remove block from cache and free it.  Does not free its udcMemFile. */
+{
+struct udcMemFile *memFile = block->memFile;
+memLruUnlink(block);
+memFile->blocks[block->blockIx] = NULL;
+memFile->cachedCount--;
+memUsed -= sizeof(*block);
+freeMem(block);
+}
+
+static void memEvictToBudget()
+/* Drop least recently used blocks until the cache fits its budget. */
+{
+while (memUsed > memBudget && memLruTail != NULL)
+    {
+    struct udcMemFile *memFile = memLruTail->memFile;
+    memDropBlock(memLruTail);
+    memEvictions++;
+    memFileFreeIfUnused(memFile);
+    }
+}
+
+static struct udcMemFile *memFileAttach(char *url, bits64 size, time_t updateTime)
+/* Return the memory cache of url, creating it if need be, and dropping its
+ * blocks if the remote file changed since they were fetched. */
+{
+pthread_mutex_lock(&memMutex);
+if (memFiles == NULL)
+    memFiles = hashNew(0);
+struct udcMemFile *memFile = hashFindVal(memFiles, url);
+if (memFile != NULL && (memFile->size != size || memFile->updateTime != updateTime))
+    {
+    int i;
+    for (i = 0; i < memFile->blockCount; ++i)
+	if (memFile->blocks[i] != NULL)
+	    memDropBlock(memFile->blocks[i]);
+    freeMem(memFile->blocks);
+    memFile->size = size;
+    memFile->updateTime = updateTime;
+    memFile->blockCount = (size + udcBlockSize - 1)/udcBlockSize;
+    AllocArray(memFile->blocks, memFile->blockCount);
+    }
+if (memFile == NULL)
+    {
+    AllocVar(memFile);
+    memFile->url = cloneString(url);
+    memFile->size = size;
+    memFile->updateTime = updateTime;
+    memFile->blockCount = (size + udcBlockSize - 1)/udcBlockSize;
+    AllocArray(memFile->blocks, memFile->blockCount);
+    hashAdd(memFiles, url, memFile);
+    }
+memFile->refCount++;
+pthread_mutex_unlock(&memMutex);
+return memFile;
+}
+
+static void memFileDetach(struct udcMemFile **pMemFile)
+/* Release a udcFile's use of its memory cache. */
+{
+struct udcMemFile *memFile = *pMemFile;
+if (memFile != NULL)
+    {
+    pthread_mutex_lock(&memMutex);
+    memFile->refCount--;
+    memFileFreeIfUnused(memFile);
+    pthread_mutex_unlock(&memMutex);
+    *pMemFile = NULL;
+    }
+}
+
+static void memStore(struct udcMemFile *memFile, int startBlock, int blockCount,
+	char *buf, bits64 size)
+/* Put size bytes of data starting at startBlock into memory cache. */
+{
+pthread_mutex_lock(&memMutex);
+int i;
+for (i = 0; i < blockCount; ++i)
+    {
+    int blockIx = startBlock + i;
+    bits64 offset = (bits64)i * udcBlockSize;
+    if (blockIx >= memFile->blockCount || offset >= size)
+	break;
+    struct udcMemBlock *block = memFile->blocks[blockIx];
+    if (block == NULL)
+	{
+	block = needMem(sizeof(*block));
+	block->memFile = memFile;
+	block->blockIx = blockIx;
+	memFile->blocks[blockIx] = block;
+	memFile->cachedCount++;
+	memUsed += sizeof(*block);
+	}
+    else
+	memLruUnlink(block);
+    memcpy(block->data, buf + offset, min(size - offset, udcBlockSize));
+    memLruPushHead(block);
+    }
+memEvictToBudget();
+pthread_mutex_unlock(&memMutex);
+}
+
+static boolean memCopyBlock(struct udcMemFile *memFile, int blockIx, int startInBlock,
+	int size, char *buf)
+/* Copy size bytes from startInBlock of block to buf if the block is cached,
+ * and mark it most recently used.  Return FALSE if block is not cached.  A
+ * block past the end of memFile, resized since file saw the remote size, is
+ * never cached. */
+{
+boolean cached = FALSE;
+pthread_mutex_lock(&memMutex);
+struct udcMemBlock *block = NULL;
+if (blockIx < memFile->blockCount)
+    block = memFile->blocks[blockIx];
+if (block != NULL)
+    {
+    memcpy(buf, block->data + startInBlock, size);
+    memLruUnlink(block);
+    memLruPushHead(block);
+    cached = TRUE;
+    }
+pthread_mutex_unlock(&memMutex);
+return cached;
+}
+
+static boolean udcFetchAhead(struct udcFile *file, bits64 start, bits64 end);  // forward declaration
+
+static bits64 udcMemRead(struct udcFile *file, void *buf, bits64 size)
+/* Read from file through the memory cache, fetching missing runs of blocks
+ * remotely.  Return amount read. */
+{
+struct udcMemFile *memFile = file->mem;
+bits64 start = file->offset;
+if (start > file->size)
+    return 0;
+bits64 end = min(start + size, file->size);
+char *cbuf = buf;
+bits64 pos = start;
+boolean triedAhead = FALSE;
+while (pos < end)
+    {
+    int blockIx = pos / udcBlockSize;
+    bits64 blockStart = (bits64)blockIx * udcBlockSize;
+    bits64 partEnd = min(end, blockStart + udcBlockSize);
+    if (memCopyBlock(memFile, blockIx, pos - blockStart, partEnd - pos, cbuf))
+	{
+	cbuf += partEnd - pos;
+	pos = partEnd;
+	continue;
+	}
+    if (!triedAhead)
+	{
+	triedAhead = TRUE;
+	if (udcFetchAhead(file, pos, end))
+	    continue;
+	}
+
+    /* Fetch the run of missing blocks starting here, up to the end of the read. */
+    int endBlock = (end + udcBlockSize - 1) / udcBlockSize;
+    int maxBlocks = udcMaxBytesPerRemoteFetch / udcBlockSize;
+    int runEnd = blockIx + 1;
+    pthread_mutex_lock(&memMutex);
+    while (runEnd < endBlock && runEnd - blockIx < maxBlocks &&
+       (runEnd >= memFile->blockCount || memFile->blocks[runEnd] == NULL))
+	++runEnd;
+    pthread_mutex_unlock(&memMutex);
+    bits64 runSize = min((bits64)runEnd * udcBlockSize, file->size) - blockStart;
+    char *runBuf = needLargeMem(runSize);
+    int actualSize = file->prot->fetchData(file->url, blockStart, runSize, runBuf, file);
+    if (actualSize != runSize)
+	errAbort("unable to fetch %lld bytes from %s @%lld (got %d bytes)",
+		 runSize, file->url, blockStart, actualSize);
+    memStore(memFile, blockIx, runEnd - blockIx, runBuf, runSize);
+
+    /* Copy out of what we fetched, the blocks may already be evicted again. */
+    partEnd = min(end, blockStart + runSize);
+    memcpy(cbuf, runBuf + (pos - blockStart), partEnd - pos);
+    freeMem(runBuf);
+    cbuf += partEnd - pos;
+    pos = partEnd;
+    }
+file->offset = end;
+return end - start;
+}
+
+static void memHaveBits(struct udcMemFile *memFile, int startBlock, int endBlock,
+	Bits **retBits, int *retPartOffset)
+/* Like readBitsIntoBuf, but for blocks in the memory cache. */
+{
+int partOffset = (startBlock/8)*8;
+Bits *b = bitAlloc(endBlock - partOffset);
+pthread_mutex_lock(&memMutex);
+int i;
+for (i = startBlock; i < endBlock && i < memFile->blockCount; ++i)
+    if (memFile->blocks[i] != NULL)
+	bitSetOne(b, i - partOffset);
+pthread_mutex_unlock(&memMutex);
+*retBits = b;
+*retPartOffset = partOffset;
+}
+
+void udcSetMemoryCacheBudget(bits64 bytes)
+/* Set most bytes the memory cache keeps, evicting blocks if need be. */
+{
+pthread_mutex_lock(&memMutex);
+memBudget = bytes;
+memEvictToBudget();
+pthread_mutex_unlock(&memMutex);
+}
+
+bits64 udcMemoryCacheBudget()
+/* Return most bytes the memory cache keeps. */
+{
+return memBudget;
+}
+
+void udcMemoryCacheStats(bits64 *retBytes, bits64 *retBlocks, bits64 *retEvictions)
+/* Return bytes and blocks now in the memory cache, and number of blocks
+ * evicted to stay within budget so far. */
+{
+pthread_mutex_lock(&memMutex);
+*retBytes = memUsed;
+*retBlocks = memUsed / sizeof(struct udcMemBlock);
+*retEvictions = memEvictions;
+pthread_mutex_unlock(&memMutex);
+}
+
+void udcMemoryCacheClear()
+/* Drop all blocks from the memory cache. */
 {
-return (defaultDir != NULL);
+pthread_mutex_lock(&memMutex);
+bits64 budget = memBudget, evictions = memEvictions;
+memBudget = 0;
+memEvictToBudget();
+memBudget = budget;
+memEvictions = evictions;
+pthread_mutex_unlock(&memMutex);
 }
 
 #ifndef WIN32
 
+/********* Section for pooled keep-alive http connections **********/
+
+struct udcPooledConn
+/* An idle keep-alive connection, kept after its last request for the next one. */
+    {
+    struct udcPooledConn *next;	/* Next in list, most recently used first. */
+    char *key;			/* Protocol, host and port, e.g. https://host:443 */
+    int sd;			/* Socket descriptor. */
+    };
+
+#define udcMaxPooledConns 16
+/* Idle connections beyond this many are closed, least recently used first. */
+
+#define udcMaxHttpHeaderSize (16*1024)
+/* Responses with a bigger header are not served from the pool. */
+
+static struct udcPooledConn *connPool = NULL;	/* Idle connections of all udcFiles. */
+static pthread_mutex_t connPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static bits64 connPoolNew = 0;		/* Connections opened for pooled requests. */
+static bits64 connPoolReused = 0;	/* Pooled requests sent on an idle connection. */
+static boolean connPoolEnabled = TRUE;
+
+static int connPoolTake(char *key)
+/* Remove the most recently used idle socket for key from the pool and return it,
+ * or return -1 if there is none. */
+{
+int sd = -1;
+pthread_mutex_lock(&connPoolMutex);
+struct udcPooledConn *conn, *prev = NULL;
+for (conn = connPool; conn != NULL; prev = conn, conn = conn->next)
+    {
+    if (sameString(conn->key, key))
+	{
+	if (prev == NULL)
+	    connPool = conn->next;
+	else
+	    prev->next = conn->next;
+	sd = conn->sd;
+	freeMem(conn->key);
+	freeMem(conn);
+	break;
+	}
+    }
+pthread_mutex_unlock(&connPoolMutex);
+return sd;
+}
+
+static void connPoolGive(char *key, int sd)
+/* Put idle socket sd for key in the pool, closing the least recently used
+ * connection if that makes the pool too big. */
+{
+struct udcPooledConn *conn;
+AllocVar(conn);
+conn->key = cloneString(key);
+conn->sd = sd;
+pthread_mutex_lock(&connPoolMutex);
+slAddHead(&connPool, conn);
+struct udcPooledConn *last = NULL;
+int count = 0;
+for (conn = connPool; conn != NULL; conn = conn->next)
+    {
+    if (++count == udcMaxPooledConns)
+	last = conn;
+    }
+struct udcPooledConn *extra = NULL;
+if (last != NULL)
+    {
+    extra = last->next;
+    last->next = NULL;
+    }
+pthread_mutex_unlock(&connPoolMutex);
+while (extra != NULL)
+    {
+    conn = extra;
+    extra = extra->next;
+    close(conn->sd);
+    freeMem(conn->key);
+    freeMem(conn);
+    }
+}
+
+void udcConnectionPoolClear()
+/* Close all idle pooled connections. */
+{
+pthread_mutex_lock(&connPoolMutex);
+struct udcPooledConn *list = connPool;
+connPool = NULL;
+pthread_mutex_unlock(&connPoolMutex);
+struct udcPooledConn *conn;
+while ((conn = list) != NULL)
+    {
+    list = list->next;
+    close(conn->sd);
+    freeMem(conn->key);
+    freeMem(conn);
+    }
+}
+
+void udcConnectionPoolStats(bits64 *retNew, bits64 *retReused, int *retIdle)
+/* Return number of connections opened for pooled requests, number of requests
+ * that reused an idle connection, and number of connections now idle. */
+{
+pthread_mutex_lock(&connPoolMutex);
+*retNew = connPoolNew;
+*retReused = connPoolReused;
+*retIdle = slCount(connPool);
+pthread_mutex_unlock(&connPoolMutex);
+}
+
+void udcSetKeepAlive(boolean enable)
+/* Turn pooling of keep-alive connections on or off.  Turning it off also
+ * closes the idle connections. */
+{
+connPoolEnabled = enable;
+if (!enable)
+    udcConnectionPoolClear();
+}
+
+boolean udcKeepAlive()
+/* Return TRUE if keep-alive connections are pooled. */
+{
+return connPoolEnabled;
+}
+
+static boolean sendAll(int sd, char *buf, size_t size)
+/* Write all of buf to socket, returning FALSE rather than raising SIGPIPE
+ * if the server has gone away. */
+{
+while (size > 0)
+    {
+#ifdef MSG_NOSIGNAL
+    ssize_t wr = send(sd, buf, size, MSG_NOSIGNAL);
+#else
+    ssize_t wr = write(sd, buf, size);
+#endif
+    if (wr <= 0)
+	return FALSE;
+    buf += wr;
+    size -= wr;
+    }
+return TRUE;
+}
+
+static int readHttpHeader(int sd, char *buf, int bufSize, int *retBodyStart)
+/* Read from sd until buf holds the complete response header, which is then
+ * zero terminated.  Return number of bytes in buf, which may include the
+ * start of the body at *retBodyStart, or -1 if the connection was closed
+ * or the header is too big. */
+{
+int used = 0;
+while (used < bufSize - 1)
+    {
+    ssize_t rd = read(sd, buf + used, bufSize - 1 - used);
+    if (rd <= 0)
+	return -1;
+    used += rd;
+    buf[used] = 0;
+    char *end = strstr(buf, "\r\n\r\n");
+    if (end != NULL)
+	{
+	*end = 0;
+	*retBodyStart = end + 4 - buf;
+	return used;
+	}
+    }
+return -1;
+}
+
+static ssize_t udcFetchKeepAlive(char *url, bits64 offset, bits64 size, void *buffer,
+	boolean *retReused)
+/* Fetch size bytes at offset of http(s) url into buffer with a HTTP/1.1 range
+ * request over a pooled connection, opening one if none is idle, and put the
+ * connection back in the pool if the server keeps it open.  Return number of
+ * bytes read, or -1 if the request can't be served this way (proxy, redirect,
+ * server ignoring the range...) and the caller should fall back to a
+ * connection of its own. */
+{
+*retReused = FALSE;
+if (!connPoolEnabled || getenv("http_proxy") != NULL)
+    return -1;
+struct netParsedUrl npu;
+netParseUrl(url, &npu);
+boolean isHttps = sameString(npu.protocol, "https");
+if (!isHttps && !sameString(npu.protocol, "http"))
+    return -1;
+char key[512];
+safef(key, sizeof(key), "%s://%s:%s", npu.protocol, npu.host, npu.port);
+
+struct dyString *dy = dyStringNew(512);
+dyStringPrintf(dy, "GET %s HTTP/1.1\r\n", npu.file);
+dyStringPrintf(dy, "User-Agent: genome.ucsc.edu/net.c\r\n");
+if ((!isHttps && sameString("80", npu.port)) || (isHttps && sameString("443", npu.port)))
+    dyStringPrintf(dy, "Host: %s\r\n", npu.host);
+else
+    dyStringPrintf(dy, "Host: %s:%s\r\n", npu.host, npu.port);
+setAuthorization(npu, "Authorization", dy);
+dyStringAppend(dy, "Accept: */*\r\n");
+dyStringPrintf(dy, "Range: bytes=%lld-%lld\r\n", (long long)offset, (long long)(offset + size - 1));
+dyStringAppend(dy, "Connection: keep-alive\r\n\r\n");
+
+ssize_t total = -1;
+char *header = needMem(udcMaxHttpHeaderSize);
+int attempt;
+for (attempt = 0; attempt < 2; ++attempt)
+    {
+    /* An idle connection may have been closed by the server in the meantime,
+     * in which case it is retried once on a fresh one. */
+    int sd = (attempt == 0) ? connPoolTake(key) : -1;
+    boolean reused = (sd >= 0);
+    if (!reused)
+	{
+	sd = isHttps ? netConnectHttps(npu.host, atoi(npu.port)) : netConnect(npu.host, atoi(npu.port));
+	if (sd < 0)
+	    break;
+	}
+    int bodyStart = 0;
+    int used = -1;
+    if (sendAll(sd, dy->string, dy->stringSize))
+	used = readHttpHeader(sd, header, udcMaxHttpHeaderSize, &bodyStart);
+    if (used < 0)
+	{
+	close(sd);
+	if (reused)
+	    continue;
+	break;
+	}
+    /* Parse status line and the headers we care about. */
+    char *line = header;
+    char *next = strchr(line, '\n');
+    if (next != NULL)
+	*next++ = 0;
+    char *httpVersion = nextWord(&line);
+    char *status = nextWord(&line);
+    long long contentLength = -1;
+    boolean keepAlive = (httpVersion != NULL && sameString(httpVersion, "HTTP/1.1"));
+    boolean chunked = FALSE;
+    long long rangeStart = -1, rangeEnd = -1;
+    for (line = next; line != NULL; line = next)
+	{
+	line = skipLeadingSpaces(line);
+	next = strchr(line, '\n');
+	if (next != NULL)
+	    *next++ = 0;
+	char *value = strchr(line, ':');
+	if (value == NULL)
+	    continue;
+	*value++ = 0;
+	value = trimSpaces(value);
+	if (sameWord(line, "Content-Length"))
+	    contentLength = atoll(value);
+	else if (sameWord(line, "Connection"))
+	    keepAlive = sameWord(value, "keep-alive");
+	else if (sameWord(line, "Transfer-Encoding"))
+	    chunked = !sameWord(value, "identity");
+	else if (sameWord(line, "Content-Range"))
+	    {
+	    /* Content-Range: bytes 100-199/2738262 */
+	    if (sscanf(value, "bytes %lld-%lld", &rangeStart, &rangeEnd) != 2)
+		rangeStart = rangeEnd = -1;
+	    }
+	}
+    /* Only a body holding exactly the start of the requested range is used. */
+    if (status == NULL || !sameString(status, "206") || chunked
+        || contentLength <= 0 || contentLength > size
+        || rangeStart != (long long)offset || rangeEnd - rangeStart + 1 != contentLength)
+	{
+	close(sd);
+	break;
+	}
+    pthread_mutex_lock(&connPoolMutex);
+    if (reused)
+	connPoolReused++;
+    else
+	connPoolNew++;
+    pthread_mutex_unlock(&connPoolMutex);
+    *retReused = reused;
+
+    /* Part of the body may have come in with the header. */
+    ssize_t got = min(used - bodyStart, contentLength);
+    memcpy(buffer, header + bodyStart, got);
+    if (got < contentLength)
+	{
+	ssize_t rd = netReadAll(sd, (char *)buffer + got, contentLength - got);
+	if (rd > 0)
+	    got += rd;
+	}
+    if (keepAlive && got == contentLength && used - bodyStart <= contentLength)
+	connPoolGive(key, sd);
+    else
+	close(sd);
+    total = got;
+    break;
+    }
+freeMem(header);
+dyStringFree(&dy);
+return total;
+}
+
 /********* Section for http protocol **********/
 
 int udcDataViaHttpOrFtp( char *url, bits64 offset, int size, void *buffer, struct udcFile *file)
@@ -442,6 +1212,26 @@ if (startsWith("http://",url) || startsWith("https://",url) || startsWith("ftp:/
 else
     errAbort("Invalid protocol in url [%s] in udcDataViaFtp, only http, https, or ftp supported",
 	     url); 
+if (!startsWith("ftp://", url))
+    {
+    char *keepAliveUrl = url;
+    if (file->connInfo.redirUrl)
+	keepAliveUrl = transferParamsToRedirectedUrl(url, file->connInfo.redirUrl);
+    boolean reused;
+    ssize_t total = udcFetchKeepAlive(keepAliveUrl, offset, size, buffer, &reused);
+    if (keepAliveUrl != url)
+	freeMem(keepAliveUrl);
+    if (total >= 0)
+	{
+	file->ios.net.numReads++;
+	file->ios.net.bytesRead += total;
+	if (reused)
+	    file->ios.numReuse++;
+	else
+	    file->ios.numConnects++;
+	return total;
+	}
+    }
 int sd = connInfoGetSocket(file, url, offset, size);
 if (sd < 0)
     errAbort("Can't get data socket for %s", url);
@@ -609,70 +1399,426 @@ if (t == -1)
     hashFree(&hash);
     errAbort("mktimeFromUtc failed while converting last-modified string [%s] from UTC time", lastModString);
     }
-retInfo->updateTime = t;
-
-hashFree(&hash);
-return status;
+retInfo->updateTime = t;
+
+hashFree(&hash);
+return status;
+}
+
+
+/********* Section for ftp protocol **********/
+
+// fetchData method: See udcDataViaHttpOrFtp above.
+
+boolean udcInfoViaFtp(char *url, struct udcRemoteFileInfo *retInfo)
+/* Gets size and last modified time of FTP URL */
+{
+verbose(4, "checking ftp remote info on %s\n", url);
+long long size = 0;
+time_t t, tUtc;
+struct tm *tm = NULL;
+// TODO: would be nice to add int *retCtrlSocket to netGetFtpInfo so we can stash 
+// in retInfo->connInfo and keep socket open.
+boolean ok = netGetFtpInfo(url, &size, &tUtc);
+if (!ok)
+    return FALSE;
+// Convert UTC to localtime
+tm = localtime(&tUtc);
+t = mktimeFromUtc(tm);
+if (t == -1)
+    { /* Handle error */;
+    errAbort("mktimeFromUtc failed while converting FTP UTC last-modified time %ld to local time", (long) tUtc);
+    }
+retInfo->size = size;
+retInfo->updateTime = t;
+return TRUE;
+}
+
+#else
+
+/* No pooled keep-alive connections on Windows, where remote files are not read. */
+
+void udcConnectionPoolClear()
+/* Close all idle pooled connections.  There are none on Windows. */
+{
+}
+
+void udcConnectionPoolStats(bits64 *retNew, bits64 *retReused, int *retIdle)
+/* Return number of connections opened for pooled requests, number of requests
+ * that reused an idle connection, and number of connections now idle, all
+ * zero on Windows. */
+{
+*retNew = 0;
+*retReused = 0;
+*retIdle = 0;
+}
+
+void udcSetKeepAlive(boolean enable)
+/* Turn pooling of keep-alive connections on or off.  Pooling stays off on
+ * Windows. */
+{
+}
+
+boolean udcKeepAlive()
+/* Return TRUE if keep-alive connections are pooled, never on Windows. */
+{
+return FALSE;
+}
+
+#endif
+
+/********* Non-protocol-specific bits **********/
+
+boolean udcFastReadString(struct udcFile *f, char buf[256])
+/* Read a string into buffer, which must be long enough
+ * to hold it.  String is in 'writeString' format. */
+{
+UBYTE bLen;
+int len;
+if (!udcReadOne(f, bLen))
+    return FALSE;
+if ((len = bLen)> 0)
+    udcMustRead(f, buf, len);
+buf[len] = 0;
+return TRUE;
+}
+
+static char *fileNameInCacheDir(struct udcFile *file, char *fileName)
+/* Return the name of a file in the cache dir, from the cache root directory on down.
+ * Do a freeMem on this when done. */
+{
+int dirLen = strlen(file->cacheDir);
+int nameLen = strlen(fileName);
+char *path = needMem(dirLen + nameLen + 2);
+memcpy(path, file->cacheDir, dirLen);
+path[dirLen] = '/';
+memcpy(path+dirLen+1, fileName, nameLen);
+return path;
+}
+
+/********* Section for locking and size of the disk cache **********/
+
+/* Several processes may share a cache directory.  Each cached file has a
+ * lock file next to its bitmap that is never rewritten, only removed when
+ * the whole entry is evicted.  Setting up or resetting the bitmap and sparse
+ * file, and storing fetched blocks, happen under an exclusive flock on it,
+ * and bitmap reads under a shared one.  Stored data is written before the
+ * bitmap bits that cover it, and bits set by other processes are merged
+ * rather than overwritten. */
+
+static bits64 diskBudget = 0;		/* Most bytes in disk cache, 0 for no limit. */
+static bits64 writtenSinceTrim = 0;	/* Bytes stored since cache was last trimmed. */
+static pthread_mutex_t trimMutex = PTHREAD_MUTEX_INITIALIZER;	/* Protects the above. */
+
+static void udcLock(struct udcFile *file, int operation)
+/* Take (LOCK_SH or LOCK_EX) or release (LOCK_UN) the lock on file's cache
+ * entry.  Does nothing if the file system doesn't support locks. */
+{
+#ifndef WIN32
+if (file->fdLock < 0)
+    return;
+while (flock(file->fdLock, operation) != 0 && errno == EINTR)
+    ;
+#endif
+}
+
+#ifdef WIN32
+static pthread_mutex_t seekMutex = PTHREAD_MUTEX_INITIALIZER;	/* Serializes seek+read/write. */
+#endif
+
+static ssize_t udcPread(int fd, void *buf, size_t size, off_t offset)
+/* Read size bytes at offset of fd without moving a file pointer shared with
+ * other threads.  Windows has no pread, so there the file pointer is moved
+ * and read under a mutex. */
+{
+#ifndef WIN32
+return pread(fd, buf, size, offset);
+#else
+ssize_t rd = -1;
+pthread_mutex_lock(&seekMutex);
+if (lseek(fd, offset, SEEK_SET) == offset)
+    rd = read(fd, buf, size);
+pthread_mutex_unlock(&seekMutex);
+return rd;
+#endif
+}
+
+static ssize_t udcPwrite(int fd, void *buf, size_t size, off_t offset)
+/* Write size bytes at offset of fd, the counterpart of udcPread. */
+{
+#ifndef WIN32
+return pwrite(fd, buf, size, offset);
+#else
+ssize_t wr = -1;
+pthread_mutex_lock(&seekMutex);
+if (lseek(fd, offset, SEEK_SET) == offset)
+    wr = write(fd, buf, size);
+pthread_mutex_unlock(&seekMutex);
+return wr;
+#endif
+}
+
+static void udcLockEntry(struct udcFile *file)
+/* Open the lock file of file's cache entry and lock it exclusively.  The
+ * entry may be evicted while we wait, so check the lock file we got is still
+ * the one in the directory. */
+{
+file->fdLock = -1;
+#ifndef WIN32
+char *lockFileName = fileNameInCacheDir(file, lockName);
+for (;;)
+    {
+    file->fdLock = open(lockFileName, O_RDWR | O_CREAT, 0666);
+    if (file->fdLock < 0)
+	break;
+    udcLock(file, LOCK_EX);
+    struct stat held, named;
+    if (fstat(file->fdLock, &held) != 0 || stat(lockFileName, &named) != 0 ||
+	held.st_ino != named.st_ino || held.st_dev != named.st_dev)
+	{
+	close(file->fdLock);
+	continue;
+	}
+    break;
+    }
+freeMem(lockFileName);
+#endif
+}
+
+static void udcCloseLock(struct udcFile *file)
+/* Close lock file, which also releases the lock. */
+{
+if (file->fdLock >= 0)
+    close(file->fdLock);
+file->fdLock = -1;
+}
+
+static void udcTouchAccess(struct udcFile *file)
+/* Set last access time of bitmap file to now, which orders files for eviction.
+ * Modification time is left alone since it tells when the file was last checked
+ * against the remote one. */
+{
+#ifndef WIN32
+if (file->bits != NULL)
+    {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = 0;
+    times[1].tv_nsec = UTIME_OMIT;
+    futimens(file->bits->fd, times);
+    }
+#endif
+}
+
+static void udcStoreBlocks(struct udcFile *file, bits64 start, void *buf, bits64 size,
+	int startBlock, int blockCount)
+/* Write data of blocks fetched from remote to the sparse file, then set their
+ * bits in the bitmap file, merging with bits set by others since we last
+ * looked.  All under an exclusive lock. */
+{
+struct udcBitmap *bits = file->bits;
+int byteStart = startBlock/8;
+int byteEnd = bitToByteSize(startBlock + blockCount);
+int byteSize = byteEnd - byteStart;
+Bits *b = needMem(byteSize);
+udcLock(file, LOCK_EX);
+ssize_t dataWritten = udcPwrite(file->fdSparse, buf, size, start);
+ssize_t bitsRead = udcPread(bits->fd, b, byteSize, byteStart + udcBitmapHeaderSize);
+bitSetRange(b, startBlock - byteStart*8, blockCount);
+ssize_t bitsWritten = -1;
+if (dataWritten == size && bitsRead == byteSize)
+    bitsWritten = udcPwrite(bits->fd, b, byteSize, byteStart + udcBitmapHeaderSize);
+udcLock(file, LOCK_UN);
+freeMem(b);
+if (dataWritten != size || bitsWritten != byteSize)
+    errnoAbort("udc couldn't store %lld bytes in cache of %s", size, file->url);
+file->ios.sparse.numWrites++;
+file->ios.sparse.bytesWritten += size;
+file->ios.bit.numReads++;
+file->ios.bit.bytesRead += byteSize;
+file->ios.bit.numWrites++;
+file->ios.bit.bytesWritten += byteSize;
+}
+
+struct udcCacheEntry
+/* A cached file found when scanning the cache directory. */
+    {
+    struct udcCacheEntry *next;	/* Next in list. */
+    char *dir;			/* Directory with bitmap and sparse files. */
+    time_t lastAccess;		/* Last access time of bitmap. */
+    bits64 bytes;		/* Disk space taken by the files. */
+    };
+
+static bits64 diskBytes(char *fileName)
+/* Return disk space taken by file, which may be sparse, or 0 if it doesn't exist. */
+{
+struct stat status;
+if (stat(fileName, &status) != 0)
+    return 0;
+#ifndef WIN32
+return (bits64)status.st_blocks * 512;
+#else
+return status.st_size;
+#endif
+}
+
+static void rListCacheEntries(char *dir, struct udcCacheEntry **pList)
+/* Add entries in dir and its subdirectories to list. */
+{
+struct fileInfo *file, *fileList = listDirX(dir, "*", FALSE);
+for (file = fileList; file != NULL; file = file->next)
+    {
+    char path[PATH_LEN];
+    safef(path, sizeof(path), "%s/%s", dir, file->name);
+    if (file->isDir)
+	rListCacheEntries(path, pList);
+    else if (sameString(file->name, bitmapName))
+	{
+	struct udcCacheEntry *entry;
+	AllocVar(entry);
+	entry->dir = cloneString(dir);
+	entry->lastAccess = file->lastAccess;
+	entry->bytes = diskBytes(path);
+	safef(path, sizeof(path), "%s/%s", dir, sparseDataName);
+	entry->bytes += diskBytes(path);
+	slAddHead(pList, entry);
+	}
+    }
+slFreeList(&fileList);
 }
 
+static int udcCacheEntryCmpAccess(const void *va, const void *vb)
+/* Compare to sort least recently used first. */
+{
+const struct udcCacheEntry *a = *((struct udcCacheEntry **)va);
+const struct udcCacheEntry *b = *((struct udcCacheEntry **)vb);
+if (a->lastAccess != b->lastAccess)
+    return a->lastAccess < b->lastAccess ? -1 : 1;
+return strcmp(a->dir, b->dir);
+}
 
-/********* Section for ftp protocol **********/
-
-// fetchData method: See udcDataViaHttpOrFtp above.
+static void udcCacheEntryFreeList(struct udcCacheEntry **pList)
+/* Free a list of cache entries. */
+{
+struct udcCacheEntry *el, *next;
+for (el = *pList; el != NULL; el = next)
+    {
+    next = el->next;
+    freeMem(el->dir);
+    freeMem(el);
+    }
+*pList = NULL;
+}
 
-boolean udcInfoViaFtp(char *url, struct udcRemoteFileInfo *retInfo)
-/* Gets size and last modified time of FTP URL */
+static boolean udcEvictEntry(char *cacheDir, struct udcCacheEntry *entry)
+/* Remove files of entry unless some process holds its lock, and then its
+ * directory and any parents up to cacheDir left empty.  Return TRUE if
+ * removed. */
 {
-verbose(4, "checking ftp remote info on %s\n", url);
-long long size = 0;
-time_t t, tUtc;
-struct tm *tm = NULL;
-// TODO: would be nice to add int *retCtrlSocket to netGetFtpInfo so we can stash 
-// in retInfo->connInfo and keep socket open.
-boolean ok = netGetFtpInfo(url, &size, &tUtc);
-if (!ok)
+char lockFileName[PATH_LEN];
+safef(lockFileName, sizeof(lockFileName), "%s/%s", entry->dir, lockName);
+int fd = -1;
+#ifndef WIN32
+fd = open(lockFileName, O_RDWR | O_CREAT, 0666);
+if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+    close(fd);
     return FALSE;
-// Convert UTC to localtime
-tm = localtime(&tUtc);
-t = mktimeFromUtc(tm);
-if (t == -1)
-    { /* Handle error */;
-    errAbort("mktimeFromUtc failed while converting FTP UTC last-modified time %ld to local time", (long) tUtc);
     }
-retInfo->size = size;
-retInfo->updateTime = t;
+#endif
+char *names[] = {bitmapName, sparseDataName, redirName};
+int i;
+for (i = 0; i < ArraySize(names); ++i)
+    {
+    char path[PATH_LEN];
+    safef(path, sizeof(path), "%s/%s", entry->dir, names[i]);
+    remove(path);
+    }
+remove(lockFileName);
+if (fd >= 0)
+    close(fd);
+
+/* Remove directories left empty, rmdir fails on the first that is not. */
+char *dir = cloneString(entry->dir);
+int rootLen = strlen(cacheDir);
+while (strlen(dir) > rootLen && rmdir(dir) == 0)
+    {
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+	break;
+    *slash = 0;
+    }
+freeMem(dir);
 return TRUE;
 }
 
-#endif
+bits64 udcCacheTrim(char *cacheDir, bits64 maxBytes)
+/* Remove least recently used files from the cache in cacheDir until what is left
+ * takes at most maxBytes of disk.  Files some process is storing data in are
+ * skipped.  Return number of bytes removed. */
+{
+if (cacheDir == NULL || !fileExists(cacheDir))
+    return 0;
+struct udcCacheEntry *list = NULL, *entry;
+rListCacheEntries(cacheDir, &list);
+slSort(&list, udcCacheEntryCmpAccess);
+bits64 total = 0, removed = 0;
+for (entry = list; entry != NULL; entry = entry->next)
+    total += entry->bytes;
+for (entry = list; entry != NULL && total > maxBytes; entry = entry->next)
+    {
+    if (udcEvictEntry(cacheDir, entry))
+	{
+	total -= entry->bytes;
+	removed += entry->bytes;
+	}
+    }
+udcCacheEntryFreeList(&list);
+return removed;
+}
 
-/********* Non-protocol-specific bits **********/
+void udcCacheOccupancy(char *cacheDir, bits64 *retFiles, bits64 *retBytes)
+/* Return number of cached files in cacheDir and disk space they take. */
+{
+struct udcCacheEntry *list = NULL, *entry;
+if (cacheDir != NULL && fileExists(cacheDir))
+    rListCacheEntries(cacheDir, &list);
+*retFiles = slCount(list);
+*retBytes = 0;
+for (entry = list; entry != NULL; entry = entry->next)
+    *retBytes += entry->bytes;
+udcCacheEntryFreeList(&list);
+}
 
-boolean udcFastReadString(struct udcFile *f, char buf[256])
-/* Read a string into buffer, which must be long enough
- * to hold it.  String is in 'writeString' format. */
+void udcSetDiskCacheBudget(bits64 bytes)
+/* Set most bytes of disk the cache in udcDefaultDir() may take, 0 for no limit.
+ * Least recently used files are removed beyond that, checked after each
+ * sixteenth of the budget stored by this process. */
 {
-UBYTE bLen;
-int len;
-if (!udcReadOne(f, bLen))
-    return FALSE;
-if ((len = bLen)> 0)
-    udcMustRead(f, buf, len);
-buf[len] = 0;
-return TRUE;
+diskBudget = bytes;
 }
 
-static char *fileNameInCacheDir(struct udcFile *file, char *fileName)
-/* Return the name of a file in the cache dir, from the cache root directory on down.
- * Do a freeMem on this when done. */
+bits64 udcDiskCacheBudget()
+/* Return most bytes of disk the cache may take, 0 for no limit. */
 {
-int dirLen = strlen(file->cacheDir);
-int nameLen = strlen(fileName);
-char *path = needMem(dirLen + nameLen + 2);
-memcpy(path, file->cacheDir, dirLen);
-path[dirLen] = '/';
-memcpy(path+dirLen+1, fileName, nameLen);
-return path;
+return diskBudget;
+}
+
+static void udcNoteStored(bits64 bytes)
+/* Count bytes stored in the disk cache, trimming it when they add up to a
+ * sixteenth of the budget. */
+{
+if (diskBudget == 0 || bytes == 0)
+    return;
+pthread_mutex_lock(&trimMutex);
+writtenSinceTrim += bytes;
+boolean trim = writtenSinceTrim >= diskBudget / 16;
+if (trim)
+    writtenSinceTrim = 0;
+pthread_mutex_unlock(&trimMutex);
+if (trim)
+    udcCacheTrim(udcDefaultDir(), diskBudget);
 }
 
 static void udcNewCreateBitmapAndSparse(struct udcFile *file, 
@@ -1145,9 +2291,11 @@ if (!isTransparent)
 /* Allocate file object and start filling it in. */
 struct udcFile *file;
 AllocVar(file);
+file->fdLock = -1;
 file->url = cloneString(url);
 file->protocol = protocol;
 file->prot = prot;
+file->access = defaultAccess;
 if (isTransparent)
     {
     /* If transparent dummy up things so that the "sparse" file pointer is actually
@@ -1163,6 +2311,19 @@ if (isTransparent)
     fstat(fd, &status);
     file->startData = 0;
     file->endData = file->size = status.st_size;
+#ifndef WIN32
+    /* Map the file, so reads are copies from memory and callers can use
+     * udcReadOrMap to get at the data without any copy. */
+    if (file->size > 0)
+	{
+	void *map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED)
+	    {
+	    file->map = map;
+	    udcAdviseMap(file);
+	    }
+	}
+#endif
     }
 else
     {
@@ -1187,16 +2348,34 @@ if (udcCacheTimeout() > 0 && udcCacheEnabled() && fileExists(file->bitmapFileNam
         /* Make directory. */
         makeDirsOnPath(file->cacheDir);
 
-        /* Figure out a little bit about the extent of the good cached data if any. Open bits bitmap. */
-        setInitialCachedDataBounds(file, useCacheInfo);
+        /* Set up the cache files while no other process can reset or evict them. */
+        udcLockEntry(file);
+        struct errCatch *errCatch = errCatchNew();
+        if (errCatchStart(errCatch))
+            {
+            /* Figure out a little bit about the extent of the good cached data if any. Open bits bitmap. */
+            setInitialCachedDataBounds(file, useCacheInfo);
 
-        file->fdSparse = mustOpenFd(file->sparseFileName, O_RDWR);
+            file->fdSparse = mustOpenFd(file->sparseFileName, O_RDWR);
 
-        // update redir with latest redirect status
-        udcTestAndSetRedirect(file, protocol, useCacheInfo);
+            // update redir with latest redirect status
+            udcTestAndSetRedirect(file, protocol, useCacheInfo);
+            }
+        errCatchEnd(errCatch);
+        udcLock(file, LOCK_UN);
+        if (errCatch->gotError)
+            {
+            udcCloseLock(file);
+            errAbort("%s", errCatch->message->string);
+            }
+        errCatchFree(&errCatch);
+        udcTouchAccess(file);
         }
+    else if (cacheType == udcCacheMemory)
+	file->mem = memFileAttach(url, file->size, file->updateTime);
     }
 freeMem(afterProtocol);
+iosAddOpen(file);
 return file;
 }
 
@@ -1252,6 +2431,7 @@ if (file != NULL)
            file->ios.udc.numSeeks, file->ios.udc.numReads, file->ios.udc.bytesRead, file->ios.udc.numWrites,  file->ios.udc.bytesWritten,
            file->ios.net.numSeeks, file->ios.net.numReads, file->ios.net.bytesRead, file->ios.net.numWrites,  file->ios.net.bytesWritten);
         }
+    iosRemoveOpen(file);
     if (file->connInfo.socket != 0)
 	mustCloseFd(&(file->connInfo.socket));
     if (file->connInfo.ctrlSocket != 0)
@@ -1263,9 +2443,16 @@ if (file != NULL)
     freeMem(file->bitmapFileName);
     freeMem(file->sparseFileName);
     freeMem(file->sparseReadAheadBuf);
+#ifndef WIN32
+    if (file->map != NULL)
+	munmap(file->map, file->size);
+#endif
     if (file->fdSparse != 0)
         mustCloseFd(&(file->fdSparse));
     udcBitmapClose(&file->bits);
+    udcCloseLock(file);
+    udcNoteStored(file->ios.sparse.bytesWritten);
+    memFileDetach(&file->mem);
     }
 freez(pFile);
 }
@@ -1343,8 +2530,13 @@ int byteStart = bitStart/8;
 int byteEnd = bitToByteSize(bitEnd);
 int byteSize = byteEnd - byteStart;
 Bits *bits = needLargeMem(byteSize);
-ourMustLseek(&file->ios.bit,fd, headerSize + byteStart, SEEK_SET);
-ourMustRead(&file->ios.bit, fd, bits, byteSize);
+udcLock(file, LOCK_SH);
+ssize_t bytesRead = udcPread(fd, bits, byteSize, headerSize + byteStart);
+udcLock(file, LOCK_UN);
+if (bytesRead != byteSize)
+    errnoAbort("udc couldn't read %d bytes of bitmap of %s", byteSize, file->url);
+file->ios.bit.numReads++;
+file->ios.bit.bytesRead += byteSize;
 *retBits = bits;
 *retPartOffset = byteStart*8;
 }
@@ -1362,25 +2554,27 @@ return allSet;
 
 static void fetchMissingBlocks(struct udcFile *file, struct udcBitmap *bits, 
 	int startBlock, int blockCount, int blockSize)
-/* Fetch missing blocks from remote and put them into file.  errAbort if trouble. */
+/* Fetch missing blocks from remote and put them into file and bitmap.  errAbort if
+ * trouble. */
 {
 bits64 startPos = (bits64)startBlock * blockSize;
 bits64 endPos = startPos + (bits64)blockCount * blockSize;
 if (endPos > file->size)
     endPos = file->size;
+bits64 readSize = 0;
+void *buf = NULL;
 if (endPos > startPos)
     {
-    bits64 readSize = endPos - startPos;
-    void *buf = needLargeMem(readSize);
+    readSize = endPos - startPos;
+    buf = needLargeMem(readSize);
     
     int actualSize = file->prot->fetchData(file->url, startPos, readSize, buf, file);
     if (actualSize != readSize)
 	errAbort("unable to fetch %lld bytes from %s @%lld (got %d bytes)",
 		 readSize, file->url, startPos, actualSize);
-    ourMustLseek(&file->ios.sparse, file->fdSparse, startPos, SEEK_SET);
-    ourMustWrite(&file->ios.sparse, file->fdSparse, buf, readSize);
-    freez(&buf);
     }
+udcStoreBlocks(file, startPos, buf, readSize, startBlock, blockCount);
+freez(&buf);
 }
 
 static boolean fetchMissingBits(struct udcFile *file, struct udcBitmap *bits,
@@ -1393,14 +2587,16 @@ Bits *b;
 int startBlock = start / bits->blockSize;
 int endBlock = (end + bits->blockSize - 1) / bits->blockSize;
 readBitsIntoBuf(file, bits->fd, udcBitmapHeaderSize, startBlock, endBlock, &b, &partOffset);
+*retFetchedStart = startBlock * bits->blockSize;
+*retFetchedEnd = endBlock * bits->blockSize;
 if (allBitsSetInFile(startBlock, endBlock, partOffset, b))
     {  // it is already in the cache
     freeMem(b);
     return TRUE;
     }
 
-/* Loop around first skipping set bits, then fetching clear bits. */
-boolean dirty = FALSE;
+/* Loop around first skipping set bits, then fetching clear bits.  Each run is
+ * marked in the bitmap file as it is stored. */
 int s = startBlock - partOffset;
 int e = endBlock - partOffset;
 for (;;)
@@ -1414,25 +2610,12 @@ for (;;)
     fetchMissingBlocks(file, bits, nextClearBit + partOffset, clearSize, bits->blockSize);
     bitSetRange(b, nextClearBit, clearSize);
 
-    dirty = TRUE;
     if (nextSetBit >= e)
         break;
     s = nextSetBit;
     }
 
-if (dirty)
-    {
-    /* Update bitmap on disk.... */
-    int byteStart = startBlock/8;
-    int byteEnd = bitToByteSize(endBlock);
-    int byteSize = byteEnd - byteStart;
-    ourMustLseek(&file->ios.bit, bits->fd, byteStart + udcBitmapHeaderSize, SEEK_SET);
-    ourMustWrite(&file->ios.bit, bits->fd, b, byteSize);
-    }
-
 freeMem(b);
-*retFetchedStart = startBlock * bits->blockSize;
-*retFetchedEnd = endBlock * bits->blockSize;
 return FALSE;
 }
 
@@ -1445,16 +2628,29 @@ return e >= s;
 }
 
 
+static boolean udcRangeCached(struct udcFile *file, bits64 start, bits64 end)
+/* Return TRUE if all blocks from start to end are in the sparse file. */
+{
+struct udcBitmap *bits = file->bits;
+int startBlock = start / bits->blockSize;
+int endBlock = (end + bits->blockSize - 1) / bits->blockSize;
+int partOffset;
+Bits *b;
+readBitsIntoBuf(file, bits->fd, udcBitmapHeaderSize, startBlock, endBlock, &b, &partOffset);
+boolean allSet = allBitsSetInFile(startBlock, endBlock, partOffset, b);
+freeMem(b);
+return allSet;
+}
+
 static void udcFetchMissing(struct udcFile *file, struct udcBitmap *bits, bits64 start, bits64 end)
 /* Fetch missing pieces of data from file */
 {
 /* Call lower level routine fetch remote data that is not already here. */
 bits64 fetchedStart, fetchedEnd;
-if (fetchMissingBits(file, bits, start, end, &fetchedStart, &fetchedEnd))
-    return;
+fetchMissingBits(file, bits, start, end, &fetchedStart, &fetchedEnd);
 
-/* Update file startData/endData members to include new data (and old as well if
- * the new data overlaps the old). */
+/* Update file startData/endData members to include new data, or data found
+ * already cached (and old as well if the new data overlaps the old). */
 if (rangeIntersectOrTouch64(file->startData, file->endData, fetchedStart, fetchedEnd))
     {
     if (fetchedStart > file->startData)
@@ -1505,11 +2701,479 @@ for (s = offset; s < endPos; s = e)
 return ok;
 }
 
+struct udcFetchJob
+/* A run of missing blocks that is fetched over its own connection. */
+    {
+    int startBlock;		/* First block of run. */
+    int blockCount;		/* Number of blocks in run. */
+    bits64 start, size;		/* Same run in bytes, clipped to file size. */
+    char *buf;			/* Data, filled in by worker. */
+    char *errMessage;		/* Set by worker if fetch failed. */
+    boolean done;		/* Set by worker when buf or errMessage is ready. */
+    boolean stored;		/* Set once data is in sparse file and bitmap. */
+    boolean reused;		/* Fetched over an idle pooled connection. */
+    };
+
+struct udcFetchQueue
+/* Jobs shared between udcPrefetch and its worker threads. */
+    {
+    char *url;			/* Url to fetch from, after any known redirect. */
+    struct udcFetchJob *jobs;	/* Array of jobs. */
+    int jobCount;		/* Size of jobs array. */
+    int nextJob;		/* Index of next job nobody has started on. */
+    boolean cancel;		/* Tells workers to stop taking jobs. */
+    pthread_mutex_t mutex;	/* Protects everything above. */
+    pthread_cond_t jobDone;	/* Signaled each time a job is done. */
+    };
+
+#ifndef WIN32
+
+static void udcFetchRangeOnNewConnection(char *url, bits64 offset, bits64 size, char *buf)
+/* Fetch size bytes at offset from url into buf with a request of its own,
+ * following redirects.  Unlike connInfoGetSocket this touches no state in
+ * the udcFile, so it is safe to call from several threads at once.
+ * errAbort if trouble. */
+{
+char rangeUrl[2048];
+safef(rangeUrl, sizeof(rangeUrl), "%s;byterange=%lld-%lld",
+      url, (long long)offset, (long long)(offset + size - 1));
+int sd = netUrlOpen(rangeUrl);
+if (sd < 0)
+    errAbort("Couldn't open %s", url);
+char *newUrl = NULL;
+int newSd = 0;
+if (!netSkipHttpHeaderLinesHandlingRedirect(sd, rangeUrl, &newSd, &newUrl))
+    errAbort("Couldn't read http header of %s", url);
+if (newUrl)
+    {
+    freeMem(newUrl);
+    sd = newSd;
+    }
+ssize_t rd = netReadAll(sd, buf, size);
+close(sd);
+if (rd < 0)
+    errnoAbort("udcFetchRangeOnNewConnection: error reading socket");
+if (rd != size)
+    errAbort("unable to fetch %lld bytes from %s @%lld (got %lld bytes)",
+	     (long long)size, url, (long long)offset, (long long)rd);
+}
+
+static char *udcFetchJobData(char *url, struct udcFetchJob *job, char *buf)
+/* Fetch the data of job into buf.  Return the message of any errAbort, caught
+ * here as the default handler of a new thread would exit, or NULL. */
+{
+struct errCatch *errCatch = errCatchNew();
+if (errCatchStart(errCatch))
+    {
+    ssize_t got = udcFetchKeepAlive(url, job->start, job->size, buf, &job->reused);
+    if (got < 0)
+	udcFetchRangeOnNewConnection(url, job->start, job->size, buf);
+    else if (got != job->size)
+	errAbort("unable to fetch %lld bytes from %s @%lld (got %lld bytes)",
+		 (long long)job->size, url, (long long)job->start, (long long)got);
+    }
+errCatchEnd(errCatch);
+char *errMessage = NULL;
+if (errCatch->gotError)
+    errMessage = cloneString(trimSpaces(errCatch->message->string));
+errCatchFree(&errCatch);
+return errMessage;
+}
+
+static boolean udcFetchNextJob(struct udcFetchQueue *q)
+/* Take the next job off the queue and fetch it.  Return FALSE if there are
+ * none left. */
+{
+pthread_mutex_lock(&q->mutex);
+struct udcFetchJob *job = NULL;
+if (!q->cancel && q->nextJob < q->jobCount)
+    job = &q->jobs[q->nextJob++];
+pthread_mutex_unlock(&q->mutex);
+if (job == NULL)
+    return FALSE;
+
+char *buf = needLargeMem(job->size);
+char *errMessage = udcFetchJobData(q->url, job, buf);
+if (errMessage != NULL)
+    freez(&buf);
+
+pthread_mutex_lock(&q->mutex);
+job->buf = buf;
+job->errMessage = errMessage;
+job->done = TRUE;
+if (errMessage != NULL)
+    q->cancel = TRUE;
+pthread_cond_signal(&q->jobDone);
+pthread_mutex_unlock(&q->mutex);
+return TRUE;
+}
+
+static void *udcFetchWorker(void *v)
+/* Take jobs off the queue and fetch them until there are none left. */
+{
+struct udcFetchQueue *q = v;
+while (udcFetchNextJob(q))
+    ;
+return NULL;
+}
+
+static void udcStoreFetched(struct udcFile *file, struct udcFetchJob *job,
+	Bits *b, int partOffset)
+/* Write fetched data to sparse file and mark its blocks as present in both
+ * the in-memory part of the bitmap and the bitmap file.  With the memory
+ * cache just put the data there. */
+{
+file->ios.net.numReads++;
+file->ios.net.bytesRead += job->size;
+if (job->reused)
+    file->ios.numReuse++;
+else
+    file->ios.numConnects++;
+if (file->mem != NULL)
+    {
+    memStore(file->mem, job->startBlock, job->blockCount, job->buf, job->size);
+    return;
+    }
+udcStoreBlocks(file, job->start, job->buf, job->size, job->startBlock, job->blockCount);
+bitSetRange(b, job->startBlock - partOffset, job->blockCount);
+}
+
+static char *udcStoreFetchedJob(struct udcFile *file, struct udcFetchJob *job,
+	Bits *b, int partOffset)
+/* Store what job fetched and free its buffer.  Return the message of any
+ * errAbort, caught so it is only passed on once the workers are gone, or NULL. */
+{
+struct errCatch *errCatch = errCatchNew();
+if (errCatchStart(errCatch))
+    udcStoreFetched(file, job, b, partOffset);
+errCatchEnd(errCatch);
+freez(&job->buf);
+char *errMessage = NULL;
+if (errCatch->gotError)
+    errMessage = cloneString(trimSpaces(errCatch->message->string));
+errCatchFree(&errCatch);
+return errMessage;
+}
+
+static struct udcFetchJob *udcMissingRuns(struct udcFile *file, struct fileOffsetSize *list,
+	Bits **retBits, int *retPartOffset, int *retJobCount)
+/* Return array of runs of blocks covered by list that are not yet in the cache.
+ * Runs are split at udcMaxBytesPerRemoteFetch so large reads are spread across
+ * connections too.  Returns NULL if nothing is missing. */
+{
+bits64 minStart = file->size, maxEnd = 0;
+struct fileOffsetSize *el;
+for (el = list; el != NULL; el = el->next)
+    {
+    if (el->size == 0 || el->offset >= file->size)
+	continue;
+    minStart = min(minStart, el->offset);
+    maxEnd = max(maxEnd, min(el->offset + el->size, file->size));
+    }
+if (maxEnd <= minStart)
+    return NULL;
+
+/* Read the part of the bitmap spanning the list, and build a second one with
+ * just the blocks we want. */
+int startBlock = minStart / udcBlockSize;
+int endBlock = (maxEnd + udcBlockSize - 1) / udcBlockSize;
+int partOffset;
+Bits *b;
+if (file->mem != NULL)
+    memHaveBits(file->mem, startBlock, endBlock, &b, &partOffset);
+else
+    readBitsIntoBuf(file, file->bits->fd, udcBitmapHeaderSize, startBlock, endBlock,
+		    &b, &partOffset);
+int partBits = endBlock - partOffset;
+Bits *want = bitAlloc(partBits);
+for (el = list; el != NULL; el = el->next)
+    {
+    if (el->size == 0 || el->offset >= file->size)
+	continue;
+    int s = el->offset / udcBlockSize;
+    int e = (min(el->offset + el->size, file->size) + udcBlockSize - 1) / udcBlockSize;
+    bitSetRange(want, s - partOffset, e - s);
+    }
+
+/* Runs are blocks that are wanted and clear in the cache bitmap. */
+int maxRunBlocks = udcMaxBytesPerRemoteFetch / udcBlockSize;
+int jobCount = 0, jobAlloc = 16;
+struct udcFetchJob *jobs = needMem(jobAlloc * sizeof(jobs[0]));
+int i = startBlock - partOffset;
+while (i < partBits)
+    {
+    if (!bitReadOne(want, i) || bitReadOne(b, i))
+	{
+	++i;
+	continue;
+	}
+    int runStart = i;
+    while (i < partBits && i - runStart < maxRunBlocks && bitReadOne(want, i) && !bitReadOne(b, i))
+	++i;
+    if (jobCount == jobAlloc)
+	{
+	jobs = needMoreMem(jobs, jobAlloc * sizeof(jobs[0]), 2 * jobAlloc * sizeof(jobs[0]));
+	jobAlloc *= 2;
+	}
+    struct udcFetchJob *job = &jobs[jobCount++];
+    job->startBlock = runStart + partOffset;
+    job->blockCount = i - runStart;
+    job->start = (bits64)job->startBlock * udcBlockSize;
+    bits64 end = (bits64)(job->startBlock + job->blockCount) * udcBlockSize;
+    job->size = min(end, file->size) - job->start;
+    }
+bitFree(&want);
+if (jobCount == 0)
+    {
+    freeMem(jobs);
+    freeMem(b);
+    return NULL;
+    }
+*retBits = b;
+*retPartOffset = partOffset;
+*retJobCount = jobCount;
+return jobs;
+}
+
+#endif
+
+void udcPrefetch(struct udcFile *file, struct fileOffsetSize *list)
+/* Make sure the byte ranges in list are in the cache.  Runs of missing blocks
+ * are fetched over up to udcFetchParallelism() concurrent connections, and
+ * written to the sparse file and bitmap as each one arrives.  Later reads of
+ * these ranges are then served from the cache.  For a mapped local file the
+ * kernel is asked to page the ranges in.  Otherwise does nothing unless file
+ * is http(s) and caching is enabled. */
+{
+#ifndef WIN32
+if (file->map != NULL)
+    {
+    /* Have the kernel start paging in the ranges of a mapped file. */
+    bits64 pageSize = sysconf(_SC_PAGESIZE);
+    struct fileOffsetSize *el;
+    for (el = list; el != NULL; el = el->next)
+	{
+	if (el->offset >= file->size)
+	    continue;
+	bits64 start = el->offset - el->offset % pageSize;
+	bits64 end = min(el->offset + el->size, file->size);
+	posix_madvise(file->map + start, end - start, POSIX_MADV_WILLNEED);
+	}
+    return;
+    }
+if (!sameString(file->prot->type, "http"))
+    return;
+if (file->mem == NULL)
+    {
+    if (!udcCacheEnabled() || file->bits == NULL || file->bits->version != file->bitmapVersion)
+	return;
+    }
+Bits *b;
+int partOffset, jobCount;
+struct udcFetchJob *jobs = udcMissingRuns(file, list, &b, &partOffset, &jobCount);
+if (jobs == NULL)
+    return;
+verbose(4, "udcPrefetch: %d runs of missing blocks in %s\n", jobCount, file->url);
+
+struct udcFetchQueue q;
+ZeroVar(&q);
+q.url = file->url;
+if (file->connInfo.redirUrl)
+    q.url = transferParamsToRedirectedUrl(file->url, file->connInfo.redirUrl);
+q.jobs = jobs;
+q.jobCount = jobCount;
+pthread_mutex_init(&q.mutex, NULL);
+pthread_cond_init(&q.jobDone, NULL);
+
+/* Start workers.  If none can be started do all the work on this thread. */
+int threadCount = min(fetchParallelism, jobCount), started = 0;
+pthread_t *threads = needMem(threadCount * sizeof(pthread_t));
+if (threadCount > 1)
+    {
+    for (started = 0; started < threadCount; ++started)
+	if (pthread_create(&threads[started], NULL, udcFetchWorker, &q) != 0)
+	    break;
+    }
+
+/* Store results as they come in, freeing each buffer once stored.  Without
+ * workers, fetch each job here just before storing it. */
+char *errMessage = NULL;
+int storedCount = 0;
+pthread_mutex_lock(&q.mutex);
+while (storedCount < jobCount && errMessage == NULL)
+    {
+    struct udcFetchJob *job = NULL;
+    int i;
+    for (i = 0; i < jobCount; ++i)
+	if (jobs[i].done && !jobs[i].stored)
+	    {
+	    job = &jobs[i];
+	    break;
+	    }
+    if (job == NULL)
+	{
+	if (q.cancel && q.nextJob == jobCount)
+	    break;
+	if (started > 0)
+	    pthread_cond_wait(&q.jobDone, &q.mutex);
+	else
+	    {
+	    pthread_mutex_unlock(&q.mutex);
+	    boolean fetched = udcFetchNextJob(&q);
+	    pthread_mutex_lock(&q.mutex);
+	    if (!fetched)
+		break;
+	    }
+	continue;
+	}
+    job->stored = TRUE;
+    ++storedCount;
+    if (job->errMessage != NULL)
+	{
+	errMessage = cloneString(job->errMessage);
+	q.cancel = TRUE;
+	break;
+	}
+    pthread_mutex_unlock(&q.mutex);
+    errMessage = udcStoreFetchedJob(file, job, b, partOffset);
+    pthread_mutex_lock(&q.mutex);
+    if (errMessage != NULL)
+	q.cancel = TRUE;
+    }
+pthread_mutex_unlock(&q.mutex);
+
+int i;
+for (i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+for (i = 0; i < jobCount; ++i)
+    {
+    freeMem(jobs[i].buf);
+    freeMem(jobs[i].errMessage);
+    }
+freeMem(threads);
+freeMem(jobs);
+freeMem(b);
+if (q.url != file->url)
+    freeMem(q.url);
+pthread_cond_destroy(&q.jobDone);
+pthread_mutex_destroy(&q.mutex);
+if (errMessage != NULL)
+    {
+    char msg[1024];
+    safecpy(msg, sizeof(msg), errMessage);
+    freeMem(errMessage);
+    errAbort("%s", msg);
+    }
+#endif
+}
+
+void udcSetFetchParallelism(int n)
+/* Set maximum number of connections udcPrefetch opens at once, which is
+ * clamped to [1, udcMaxFetchParallelism]. */
+{
+fetchParallelism = max(min(n, udcMaxFetchParallelism), 1);
+}
+
+int udcFetchParallelism()
+/* Return maximum number of connections udcPrefetch opens at once. */
+{
+return fetchParallelism;
+}
+
+void udcSetAccessPattern(struct udcFile *file, enum udcAccessPattern pattern)
+/* Tell file how it will be read.  With udcAccessSequential reads that miss the
+ * cache fetch a growing window beyond what was asked for, with udcAccessRandom
+ * they fetch just the blocks asked for, and with udcAccessAuto (the default)
+ * the pattern is guessed from whether each read starts where the last ended. */
+{
+file->access = pattern;
+udcAdviseMap(file);
+}
+
+void udcSetDefaultAccessPattern(enum udcAccessPattern pattern)
+/* Set access pattern hint of files opened from now on. */
+{
+defaultAccess = pattern;
+}
+
+enum udcAccessPattern udcDefaultAccessPattern()
+/* Return access pattern hint of newly opened files. */
+{
+return defaultAccess;
+}
+
+void udcSetReadAheadMax(bits64 bytes)
+/* Set largest read-ahead window, 0 turns read-ahead off. */
+{
+readAheadMax = bytes;
+}
+
+bits64 udcReadAheadMax()
+/* Return largest read-ahead window. */
+{
+return readAheadMax;
+}
+
+static void udcNoteAccess(struct udcFile *file, bits64 start, bits64 end)
+/* Classify read of start to end as sequential or random, and forget the
+ * read-ahead window on random access. */
+{
+if (file->access == udcAccessSequential)
+    file->sequential = TRUE;
+else if (file->access == udcAccessRandom)
+    file->sequential = FALSE;
+else
+    file->sequential = (file->haveLastRead && start >= file->lastReadEnd
+			&& start - file->lastReadEnd <= udcBlockSize);
+if (!file->sequential)
+    file->readAheadWindow = 0;
+file->lastReadEnd = end;
+file->haveLastRead = TRUE;
+}
+
+static boolean udcFetchAhead(struct udcFile *file, bits64 start, bits64 end)
+/* If reading sequentially, prefetch start to end along with the read-ahead
+ * window past it, and grow the window for next time.  The window is fetched
+ * in udcMaxBytesPerRemoteFetch pieces over concurrent connections.  Return
+ * TRUE if a prefetch was made. */
+{
+if (!file->sequential || readAheadMax == 0 || end >= file->size)
+    return FALSE;
+if (file->readAheadWindow == 0)
+    file->readAheadWindow = min(udcMinReadAhead, readAheadMax);
+else
+    file->readAheadWindow = min(2 * file->readAheadWindow, readAheadMax);
+struct fileOffsetSize el;
+ZeroVar(&el);
+el.offset = start;
+el.size = min(end + file->readAheadWindow, file->size) - start;
+verbose(4, "udcFetchAhead: %lld bytes past %lld\n", el.size - (end - start), end);
+udcPrefetch(file, &el);
+return TRUE;
+}
+
 #define READAHEADBUFSIZE 4096
 bits64 udcRead(struct udcFile *file, void *buf, bits64 size)
 /* Read a block from file.  Return amount actually read. */
 {
 file->ios.udc.numReads++;
+udcNoteAccess(file, file->offset, file->offset + size);
+if (file->mem != NULL)
+    {
+    bits64 actualSize = udcMemRead(file, buf, size);
+    file->ios.udc.bytesRead += actualSize;
+    return actualSize;
+    }
+if (file->map != NULL)
+    {
+    bits64 actualSize = 0;
+    if (file->offset < file->size)
+	actualSize = min(size, file->size - file->offset);
+    memcpy(buf, file->map + file->offset, actualSize);
+    file->offset += actualSize;
+    file->ios.udc.bytesRead += actualSize;
+    return actualSize;
+    }
 // if not caching, just fetch the data
 if (!udcCacheEnabled() && !sameString(file->protocol, "transparent"))
     {
@@ -1580,7 +3244,8 @@ while(TRUE)
      * consult cache on disk, and maybe even fetch data remotely! */
     if (start < file->startData || end > file->endData)
 	{
-
+	if (file->sequential && !udcRangeCached(file, start, end))
+	    udcFetchAhead(file, start, end);
 	if (!udcCachePreload(file, start, size))
 	    {
 	    verbose(4, "udcCachePreload failed");
@@ -1621,6 +3286,31 @@ if (sizeRead < size)
     errAbort("udc couldn't read %llu bytes from %s, did read %llu", size, file->url, sizeRead);
 }
 
+void *udcReadOrMap(struct udcFile *file, bits64 size, void **retBuf)
+/* Return the next size bytes of file, aborting if there are not that many.  For
+ * a mapped local file this points into the mapping, with no copy, and *retBuf
+ * is set to NULL.  Otherwise the bytes are read into a new buffer that is
+ * also put in *retBuf, for the caller to freeMem.  Either way the data must not
+ * be changed. */
+{
+if (file->map != NULL)
+    {
+    if (file->offset > file->size || size > file->size - file->offset)
+	errAbort("udc couldn't read %llu bytes from %s, did read %llu", size, file->url,
+		 file->offset < file->size ? file->size - file->offset : 0);
+    file->ios.udc.numReads++;
+    file->ios.udc.bytesRead += size;
+    udcNoteAccess(file, file->offset, file->offset + size);
+    void *data = file->map + file->offset;
+    file->offset += size;
+    *retBuf = NULL;
+    return data;
+    }
+*retBuf = needLargeMem(size);
+udcMustRead(file, *retBuf, size);
+return *retBuf;
+}
+
 int udcGetChar(struct udcFile *file)
 /* Get next character from file or die trying. */
 {
@@ -1774,7 +3464,7 @@ void udcSeekCur(struct udcFile *file, bits64 offset)
 {
 file->ios.udc.numSeeks++;
 file->offset += offset;
-if (udcCacheEnabled())
+if (udcUsesSparseFd(file))
     ourMustLseek(&file->ios.sparse,file->fdSparse, offset, SEEK_CUR);
 }
 
@@ -1783,7 +3473,7 @@ void udcSeek(struct udcFile *file, bits64 offset)
 {
 file->ios.udc.numSeeks++;
 file->offset = offset;
-if (udcCacheEnabled())
+if (udcUsesSparseFd(file))
     ourMustLseek(&file->ios.sparse,file->fdSparse, offset, SEEK_SET);
 }
 
@@ -1852,6 +3542,8 @@ for (file = fileList; file != NULL; file = file->next)
 		remove(sparseDataName);
 		if (fileExists(redirName))
 		    remove(redirName);
+		if (fileExists(lockName))
+		    remove(lockName);
 		}
 	    }
 	}
@@ -49,6 +49,13 @@ void udcMustRead(struct udcFile *file, void *buf, bits64 size);
 #define udcMustReadOne(file, var) udcMustRead(file, &(var), sizeof(var))
 /* Read one variable from file or die. */
 
+void *udcReadOrMap(struct udcFile *file, bits64 size, void **retBuf);
+/* Return the next size bytes of file, aborting if there are not that many.  For
+ * a mapped local file this points into the mapping, with no copy, and *retBuf
+ * is set to NULL.  Otherwise the bytes are read into a new buffer that is
+ * also put in *retBuf, for the caller to freeMem.  Either way the data must not
+ * be changed. */
+
 bits64 udcReadBits64(struct udcFile *file, boolean isSwapped);
 /* Read and optionally byte-swap 64 bit entity. */
 
@@ -81,6 +88,135 @@ char *udcFileReadAll(char *url, char *cacheDir, size_t maxSize, size_t *retSize)
  * returns size of file in *retSize. Do a freeMem or freez of the returned buffer
  * when done. */
 
+void udcPrefetch(struct udcFile *file, struct fileOffsetSize *list);
+/* Make sure the byte ranges in list are in the cache.  Runs of missing blocks
+ * are fetched over up to udcFetchParallelism() concurrent connections, and
+ * written to the cache as each one arrives.  For a mapped local file the
+ * kernel is asked to page the ranges in.  Otherwise does nothing unless file
+ * is http(s) and caching is enabled. */
+
+void udcSetFetchParallelism(int n);
+/* Set maximum number of connections udcPrefetch opens at once, which is
+ * clamped to [1, 64]. */
+
+int udcFetchParallelism();
+/* Return maximum number of connections udcPrefetch opens at once. */
+
+void udcSetKeepAlive(boolean enable);
+/* Turn pooling of keep-alive http(s) connections on or off.  Turning it off
+ * also closes the idle connections. */
+
+boolean udcKeepAlive();
+/* Return TRUE if keep-alive connections are pooled. */
+
+void udcConnectionPoolClear();
+/* Close all idle pooled connections. */
+
+void udcConnectionPoolStats(bits64 *retNew, bits64 *retReused, int *retIdle);
+/* Return number of connections opened for pooled requests, number of requests
+ * that reused an idle connection, and number of connections now idle.  The
+ * pool is shared by all udcFiles and outlives udcFileClose. */
+
+enum udcCacheType
+/* Where udc keeps the data it fetches. */
+    {
+    udcCacheDisk = 0,		/* Sparse files under udcDefaultDir(), the default. */
+    udcCacheMemory = 1,		/* Blocks in memory, shared by all udcFiles. */
+    udcCacheNone = 2,		/* Nowhere, every read goes to the remote file. */
+    };
+
+void udcSetCacheType(enum udcCacheType type);
+/* Set where udcFiles opened from now on keep the data they fetch. */
+
+enum udcCacheType udcGetCacheType();
+/* Return where newly opened udcFiles keep the data they fetch. */
+
+void udcSetMemoryCacheBudget(bits64 bytes);
+/* Set most bytes the memory cache keeps.  Least recently used blocks are
+ * evicted beyond that. */
+
+bits64 udcMemoryCacheBudget();
+/* Return most bytes the memory cache keeps. */
+
+void udcMemoryCacheStats(bits64 *retBytes, bits64 *retBlocks, bits64 *retEvictions);
+/* Return bytes and blocks now in the memory cache, and number of blocks
+ * evicted to stay within budget so far. */
+
+void udcMemoryCacheClear();
+/* Drop all blocks from the memory cache. */
+
+enum udcAccessPattern
+/* How a file is expected to be read, see udcSetAccessPattern. */
+    {
+    udcAccessAuto = 0,		/* Guess from successive reads. */
+    udcAccessSequential = 1,	/* Mostly forward from where the last read ended. */
+    udcAccessRandom = 2,	/* Scattered small reads. */
+    };
+
+void udcSetAccessPattern(struct udcFile *file, enum udcAccessPattern pattern);
+/* Tell file how it will be read.  With udcAccessSequential reads that miss the
+ * cache fetch a growing window beyond what was asked for, with udcAccessRandom
+ * they fetch just the blocks asked for, and with udcAccessAuto (the default)
+ * the pattern is guessed from whether each read starts where the last ended. */
+
+void udcSetDefaultAccessPattern(enum udcAccessPattern pattern);
+/* Set access pattern hint of files opened from now on. */
+
+enum udcAccessPattern udcDefaultAccessPattern();
+/* Return access pattern hint of newly opened files. */
+
+void udcSetReadAheadMax(bits64 bytes);
+/* Set largest read-ahead window, 0 turns read-ahead off. */
+
+bits64 udcReadAheadMax();
+/* Return largest read-ahead window. */
+
+struct ioStats
+/* Statistics concerning reads and seeks. */
+{
+    bits64 numSeeks;            /* The number of seeks on this file */
+    bits64 numReads;            /* The number of reads from this file */
+    bits64 bytesRead;           /* The number of bytes read from this file */
+    bits64 numWrites;           /* The number of writes to this file */
+    bits64 bytesWritten;        /* The number of bytes written to this file */
+};
+
+struct ios
+/* Statistics concerning reads and seeks for sparse, bitmap, url, and to us. */
+{
+    struct ioStats bit;         /* Statistics on file i/o to the bitmap file. */
+    struct ioStats sparse;      /* Statistics on file i/o to the sparse data file. */
+    struct ioStats udc;         /* Statistics on file i/o from the application to us. */
+    struct ioStats net;         /* Statistics on file i/o over the network. */
+    bits64 numConnects;         /* The number of socket connections made. */
+    bits64 numReuse;            /* The number of socket reuses. */
+};
+
+struct udcFileIos
+/* Statistics of one open udcFile. */
+    {
+    struct udcFileIos *next;	/* Next in list. */
+    char *url;			/* Url of file. */
+    struct ios ios;		/* Statistics so far. */
+    };
+
+void udcFileIoStats(struct udcFile *file, struct ios *retIos);
+/* Copy statistics of file so far into retIos. */
+
+void udcTotalIoStats(struct ios *retIos);
+/* Put sum of statistics of all files, open or closed, since the last
+ * udcResetIoStats into retIos. */
+
+struct udcFileIos *udcOpenFileIoStats();
+/* Return statistics of each file now open, in order of opening.  Free with
+ * udcFileIosFreeList. */
+
+void udcFileIosFreeList(struct udcFileIos **pList);
+/* Free a list from udcOpenFileIoStats. */
+
+void udcResetIoStats();
+/* Zero the statistics of all open files and the sums of closed ones. */
+
 void udcSeek(struct udcFile *file, bits64 offset);
 /* Seek to a particular (absolute) position in file. */
 
@@ -95,6 +231,22 @@ bits64 udcCleanup(char *cacheDir, double maxDays, boolean testOnly);
  * no clean up is done, but the size of the files that would be
  * cleaned up is still. */
 
+bits64 udcCacheTrim(char *cacheDir, bits64 maxBytes);
+/* Remove least recently used files from the cache in cacheDir until what is left
+ * takes at most maxBytes of disk.  Files some process is storing data in are
+ * skipped.  Return number of bytes removed. */
+
+void udcCacheOccupancy(char *cacheDir, bits64 *retFiles, bits64 *retBytes);
+/* Return number of cached files in cacheDir and disk space they take. */
+
+void udcSetDiskCacheBudget(bits64 bytes);
+/* Set most bytes of disk the cache in udcDefaultDir() may take, 0 for no limit.
+ * Least recently used files are removed beyond that, checked after each
+ * sixteenth of the budget stored by this process. */
+
+bits64 udcDiskCacheBudget();
+/* Return most bytes of disk the cache may take, 0 for no limit. */
+
 void udcParseUrl(char *url, char **retProtocol, char **retAfterProtocol, char **retColon);
 /* Parse the URL into components that udc treats separately. 
  * *retAfterProtocol is Q-encoded to keep special chars out of filenames.  
@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <stdlib.h>
+
 #include "utils.h"
 
 SEXP _STRSXP_collapse(SEXP x, SEXP sep) {
@@ -38,3 +41,59 @@ SEXP CharacterList_pasteCollapse(SEXP x, SEXP sep) {
   UNPROTECT(1);
   return ans;
 }
+
+/* Clamps a thread count given by the user to [1, MAX_THREADS] */
+int clampThreads(int threads)
+{
+  if (threads == NA_INTEGER || threads < 1)
+    return 1;
+  return threads < MAX_THREADS ? threads : MAX_THREADS;
+}
+
+struct jobQueue
+{
+  void *(*fun)(void *);
+  char *jobs;
+  size_t jobSize;
+  int n, next;
+  pthread_mutex_t lock;
+};
+
+static void *runQueuedJobs(void *arg)
+{
+  struct jobQueue *queue = arg;
+  for (;;) {
+    pthread_mutex_lock(&queue->lock);
+    int i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (i >= queue->n)
+      return NULL;
+    queue->fun(queue->jobs + i * queue->jobSize);
+  }
+}
+
+/* Runs 'fun' on each of the 'n' jobs and waits for them. The jobs are
+ * taken in turn by at most MAX_THREADS threads, the calling thread being
+ * one of them, so the jobs run on the calling thread alone when no other
+ * thread can be created. */
+void runJobs(void *(*fun)(void *), void *jobs, size_t jobSize, int n)
+{
+  struct jobQueue queue;
+  int n_workers = (n < MAX_THREADS ? n : MAX_THREADS) - 1, started = 0;
+  pthread_t *tids = n_workers > 0 ? malloc(n_workers * sizeof(pthread_t)) : NULL;
+  queue.fun = fun;
+  queue.jobs = jobs;
+  queue.jobSize = jobSize;
+  queue.n = n;
+  queue.next = 0;
+  pthread_mutex_init(&queue.lock, NULL);
+  if (tids != NULL)
+    while (started < n_workers &&
+           pthread_create(&tids[started], NULL, runQueuedJobs, &queue) == 0)
+      started++;
+  runQueuedJobs(&queue);
+  for (int i = 0; i < started; ++i)
+    pthread_join(tids[i], NULL);
+  free(tids);
+  pthread_mutex_destroy(&queue.lock);
+}
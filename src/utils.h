@@ -5,4 +5,11 @@
 
 SEXP CharacterList_pasteCollapse(SEXP x, SEXP sep);
 
+/* The most threads a job may use, whatever the user asks for */
+#define MAX_THREADS 64
+
+int clampThreads(int threads);
+
+void runJobs(void *(*fun)(void *), void *jobs, size_t jobSize, int n);
+
 #endif